@@ -1,3 +1,12 @@
 #!/usr/bin/bash
-clang src/linux.c -o build/a.out `pkg-config --cflags --libs pango x11 pangocairo`
-./build/a.out
+# ./run.sh builds and starts the program, ./run.sh bench [benchmark...] builds and runs the benchmarks instead
+mkdir -p build
+clang -O2 -c src/core.c -o build/core.o -pthread && ar rcs build/libcore.a build/core.o || exit 1
+if [ "$1" = "bench" ]; then
+  shift
+  clang -O2 src/bench.c build/libcore.a -o build/bench -pthread -lm || exit 1
+  ./build/bench "$@"
+  exit
+fi
+clang src/linux.c build/libcore.a -o build/a.out -pthread -lm `pkg-config --cflags --libs pango x11 xext pangocairo`
+./build/a.out "$@"
@@ -0,0 +1,554 @@
+// Benchmarks for the sheet core. Built without X11 by ./run.sh bench, and every benchmark prints tab separated columns
+// with a header line so the output can be pasted into a spreadsheet or diffed between builds.
+#include "core.h"
+
+
+
+//******************************************//
+//               Benchmarks                 //
+//******************************************//
+
+// Times row and column insertion and deletion in the middle of sheets of growing size, all with 10 filled cells per row.
+// The time per operation should grow with the number of rows (or columns), and not with the number of cells.
+void benchStructure() {
+  const int operations = 100;
+  const int columnCount = 100;
+  const int bulkCount = 5000;
+  printf("rows\tcolumns\tfilledCells\tinsertRowNs\tinsertColumnNs\tdeleteRowNs\tdeleteColumnNs\tinsert5000RowsNs\n");
+  for (int rowCount = 1000; rowCount <= 1000000; rowCount *= 10) {
+    Sheet sheet = newSheet(rowCount, columnCount);
+    for (int row = 0; row < rowCount; row++) {
+      for (int column = 0; column < columnCount; column += 10) {
+        sheetCellAppend(&sheet, row, column, "12345", 5);
+      }
+    }
+    sheet.changedCells.length = 0;
+
+    int64_t start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetAppendRow(&sheet, sheet.rowCount / 2);
+    int64_t insertRow = (nowNanoseconds() - start) / operations;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetAppendColumn(&sheet, sheet.columnCount / 2);
+    int64_t insertColumn = (nowNanoseconds() - start) / operations;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetDeleteRow(&sheet, sheet.rowCount / 2);
+    int64_t deleteRow = (nowNanoseconds() - start) / operations;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetDeleteColumn(&sheet, sheet.columnCount / 2);
+    int64_t deleteColumn = (nowNanoseconds() - start) / operations;
+
+    // As 5000o does it, in one go
+    start = nowNanoseconds();
+    sheetAppendRows(&sheet, sheet.rowCount / 2, bulkCount);
+    int64_t bulkInsertRows = nowNanoseconds() - start;
+
+    printf("%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", rowCount, columnCount, rowCount * columnCount / 10, insertRow, insertColumn, deleteRow, deleteColumn, bulkInsertRows);
+  }
+}
+
+
+// Imports a CSV file without opening a window and reports how long the first rows and the whole file took
+void benchImport(char *path, int threadCount) {
+  Sheet sheet = newSheet(1, 1);
+  CsvImport import;
+  if (!csvImportStart(&import, &sheet, path, threadCount)) {
+    printf("couldn't open %s\n", path);
+    return;
+  }
+  while (import.active) {
+    struct pollfd wake = {import.wakePipe[0], POLLIN, 0};
+    poll(&wake, 1, -1);
+    csvImportPoll(&import, &sheet);
+  }
+  int64_t total = nowNanoseconds() - import.startTime;
+  printf("bytes\tthreads\trows\tcolumns\tfirstRowsMs\ttotalMs\tmbPerSecond\n");
+  printf("%zu\t%d\t%d\t%d\t%.1f\t%.1f\t%.0f\n", import.size, import.threadCount, sheet.rowCount, sheet.columnCount, import.firstChunkTime / 1e6, total / 1e6, import.size / (total / 1e9) / 1e6);
+}
+
+// Opens a workbook and reads the cells of a first screen the way render() would, reporting how long each took and how
+// little of the file was touched. A CSV file is imported and saved as path.spc first.
+void benchOpen(char *path, int threadCount) {
+  char workbookPath[4096];
+  snprintf(workbookPath, sizeof(workbookPath), "%s", path);
+  if (!workbookIsFile(path)) {
+    Sheet imported = newSheet(1, 1);
+    CsvImport import;
+    if (!csvImportStart(&import, &imported, path, threadCount)) {
+      printf("couldn't open %s\n", path);
+      return;
+    }
+    while (import.active) {
+      struct pollfd wake = {import.wakePipe[0], POLLIN, 0};
+      poll(&wake, 1, -1);
+      csvImportPoll(&import, &imported);
+    }
+    snprintf(workbookPath, sizeof(workbookPath), "%s.spc", path);
+    int64_t start = nowNanoseconds();
+    if (!workbookSave(&imported, workbookPath)) {
+      printf("couldn't save %s\n", workbookPath);
+      return;
+    }
+    printf("saved in %.1fms\n", (nowNanoseconds() - start) / 1e6);
+  }
+
+  const int screenRows = 60;
+  const int screenColumns = 20;
+  Sheet sheet;
+  int64_t start = nowNanoseconds();
+  if (!workbookOpen(&sheet, workbookPath)) {
+    printf("couldn't open %s\n", workbookPath);
+    return;
+  }
+  int64_t opened = nowNanoseconds() - start;
+  size_t characters = 0;
+  for (int row = 0; row < screenRows && row < sheet.rowCount; row++) {
+    for (int column = 0; column < screenColumns && column < sheet.columnCount; column++)
+      characters += sheetGetCellDisplay(&sheet, row, column).length;
+  }
+  int64_t firstScreen = nowNanoseconds() - start;
+  int formulaCount = sheet.unloadedFormulaCount;
+  workbookLoadFormulas(&sheet);
+  int64_t formulas = nowNanoseconds() - start;
+  printf("bytes\trows\tcolumns\ttiles\ttilesFaulted\tformulas\topenMs\tfirstScreenMs\tformulasLoadedMs\n");
+  printf("%zu\t%d\t%d\t%d\t%d\t%d\t%.2f\t%.2f\t%.1f\n", sheet.cells.mapped.size, sheet.rowCount, sheet.columnCount, sheet.cells.mapped.count, sheet.cells.tileCount, formulaCount, opened / 1e6, firstScreen / 1e6, formulas / 1e6);
+  if (characters == 0)
+    printf("the first screen is empty\n");
+}
+
+// Times SUM, MIN, MAX, COUNT and AVERAGE over a column of a million numbers with every lane kernel this machine has
+void benchAggregate() {
+  const int rowCount = 1000000;
+  const int repeats = 10;
+  Sheet sheet = newSheet(rowCount, 2);
+  char text[32];
+  for (int row = 0; row < rowCount; row++) {
+    int length = sprintf(text, "%d.5", row % 1000);
+    String string = {text, length};
+    sheetCommitCell(&sheet, row, 0, string);
+  }
+  sheet.changedCells.length = 0;
+
+  LaneKernel kernels[3] = {laneKernelScalar};
+  char *names[3] = {"scalar"};
+  int kernelCount = 1;
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse2")) {
+    kernels[kernelCount] = laneKernelSse2;
+    names[kernelCount++] = "sse2";
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[kernelCount] = laneKernelAvx2;
+    names[kernelCount++] = "avx2";
+  }
+#endif
+  char *functions[] = {"SUM", "MIN", "MAX", "COUNT", "AVERAGE"};
+  printf("kernel\tfunction\trows\tbestMs\tresult\n");
+  for (int k = 0; k < kernelCount; k++) {
+    laneKernel = kernels[k];
+    for (int f = 0; f < 5; f++) {
+      int length = sprintf(text, "=%s(A1:A%d)", functions[f], rowCount);
+      String formula = {text, length};
+      int64_t best = INT64_MAX;
+      for (int i = 0; i < repeats; i++) {
+        int64_t start = nowNanoseconds();
+        sheetCommitCell(&sheet, 0, 1, formula);
+        int64_t elapsed = nowNanoseconds() - start;
+        best = elapsed < best ? elapsed : best;
+      }
+      String result = sheetGetCellDisplay(&sheet, 0, 1);
+      printf("%s\t%s\t%d\t%.3f\t%.*s\n", names[k], functions[f], rowCount, best / 1e6, result.length, result.value);
+    }
+  }
+  laneKernelSelect();
+}
+
+// Recalculates a 1000 x 1000 grid of formulas, each averaging the two cells above it, with 1, 2, 4... threads up to
+// the number of cores. Every row depends on the one above so at most 1000 formulas are ever ready at once.
+void benchRecalc() {
+  const int size = 1000;
+  Sheet sheet = newSheet(size + 1, size);
+  char text[64];
+  for (int column = 0; column < size; column++) {
+    sprintf(text, "%d", column);
+    sheetCellAppend(&sheet, 0, column, text, strlen(text));
+  }
+  for (int row = 1; row <= size; row++) {
+    for (int column = 0; column < size; column++) {
+      String left = intToLetters(column == 0 ? 0 : column - 1);
+      String above = intToLetters(column);
+      int length = sprintf(text, "=(%.*s%d+%.*s%d)/2", left.length, left.value, row, above.length, above.value, row);
+      free(left.value);
+      free(above.value);
+      sheetCellAppend(&sheet, row, column, text, length);
+    }
+  }
+  sheet.changedCells.length = 0;
+
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int64_t singleThreaded = 0;
+  printf("formulas\tthreads\trecalcMs\tspeedup\tcorner\n");
+  int threads = 1;
+  while (TRUE) {
+    sheet.formulas.threadCount = threads;
+    int64_t start = nowNanoseconds();
+    formulasRecalculateAll(&sheet);
+    int64_t elapsed = nowNanoseconds() - start;
+    sheet.changedCells.length = 0;
+    if (threads == 1)
+      singleThreaded = elapsed;
+    String corner = sheetGetCellDisplay(&sheet, size, size - 1);
+    printf("%d\t%d\t%.1f\t%.2f\t%.*s\n", sheet.formulas.recalculatedCount, threads, elapsed / 1e6, (double)singleThreaded / elapsed, corner.length, corner.value);
+    if (threads >= cores)
+      break;
+    threads = threads * 2 < cores ? threads * 2 : cores;
+  }
+}
+
+// Times the basic operations on sheets of 1e3 to 1e7 cells, 100 columns wide: creating the sheet, filling every cell,
+// editing cells at random the way typing does, and inserting rows and columns in the middle of the filled sheet.
+void benchCore() {
+  const int columnCount = 100;
+  const int edits = 10000;
+  const int operations = 100;
+  printf("cells\trows\tcolumns\tnewSheetNs\tfillNsPerCell\teditNs\tinsertRowNs\tinsertColumnNs\tmemoryBytes\n");
+  for (int cellCount = 1000; cellCount <= 10000000; cellCount *= 10) {
+    int rowCount = cellCount / columnCount;
+    int64_t start = nowNanoseconds();
+    Sheet sheet = newSheet(rowCount, columnCount);
+    int64_t create = nowNanoseconds() - start;
+
+    char text[16];
+    start = nowNanoseconds();
+    for (int row = 0; row < rowCount; row++) {
+      for (int column = 0; column < columnCount; column++) {
+        String string = {text, snprintf(text, sizeof(text), "%d", row + column)};
+        sheetCommitCell(&sheet, row, column, string);
+      }
+    }
+    int64_t fill = (nowNanoseconds() - start) / cellCount;
+
+    srand(1);
+    start = nowNanoseconds();
+    for (int i = 0; i < edits; i++) {
+      int row = rand() % rowCount;
+      int column = rand() % columnCount;
+      sheetCellAppend(&sheet, row, column, "7", 1);
+    }
+    int64_t edit = (nowNanoseconds() - start) / edits;
+    sheet.changedCells.length = 0;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetAppendRow(&sheet, sheet.rowCount / 2);
+    int64_t insertRow = (nowNanoseconds() - start) / operations;
+
+    start = nowNanoseconds();
+    for (int i = 0; i < operations; i++)
+      sheetAppendColumn(&sheet, sheet.columnCount / 2);
+    int64_t insertColumn = (nowNanoseconds() - start) / operations;
+
+    printf("%d\t%d\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\t%zu\n", cellCount, rowCount, columnCount, create, fill, edit, insertRow, insertColumn, tileStoreMemoryUsage(&sheet.cells));
+  }
+}
+
+
+// Undo and redo of single cell edits should cost the same however big the sheet is, and of inserts and deletes no
+// more than doing them did
+void benchUndo() {
+  const int columnCount = 10;
+  const int edits = 1000;
+  printf("rows\tcolumns\tundoEditNs\tredoEditNs\tundoInsert5000RowsNs\tundoDelete100RowsNs\thistoryBytes\n");
+  for (int rowCount = 1000; rowCount <= 1000000; rowCount *= 10) {
+    Sheet sheet = newSheet(rowCount, columnCount);
+    char text[16];
+    for (int row = 0; row < rowCount; row++) {
+      for (int column = 0; column < columnCount; column++) {
+        String string = {text, snprintf(text, sizeof(text), "%d", row + column)};
+        sheetCommitCell(&sheet, row, column, string);
+      }
+    }
+    History history = historyNew((size_t)256 * 1024 * 1024);
+    sheet.history = &history;
+
+    srand(1);
+    for (int i = 0; i < edits; i++) {
+      sheetCellAppend(&sheet, rand() % rowCount, rand() % columnCount, "7", 1);
+      historyCheckpoint(&sheet);
+    }
+    size_t historyBytes = history.bytes;
+    int64_t start = nowNanoseconds();
+    for (int i = 0; i < edits; i++)
+      historyUndo(&sheet);
+    int64_t undoEdit = (nowNanoseconds() - start) / edits;
+    start = nowNanoseconds();
+    for (int i = 0; i < edits; i++)
+      historyRedo(&sheet);
+    int64_t redoEdit = (nowNanoseconds() - start) / edits;
+
+    sheetAppendRows(&sheet, rowCount / 2, 5000);
+    historyCheckpoint(&sheet);
+    start = nowNanoseconds();
+    historyUndo(&sheet);
+    int64_t undoInsert = nowNanoseconds() - start;
+
+    sheetDeleteRows(&sheet, rowCount / 2, 100);
+    historyCheckpoint(&sheet);
+    start = nowNanoseconds();
+    historyUndo(&sheet);
+    int64_t undoDelete = nowNanoseconds() - start;
+
+    printf("%d\t%d\t%ld\t%ld\t%ld\t%ld\t%zu\n", rowCount, columnCount, undoEdit, redoEdit, undoInsert, undoDelete, historyBytes);
+  }
+}
+
+
+
+//******************************************//
+//               Checks                     //
+//******************************************//
+
+// Behaviour that has gone wrong before and is easy to get wrong again. Each check prints a line saying ok or FAIL, and
+// bench check exits with 1 if any failed.
+int checkFailures = 0;
+
+void checkPrint(char *name, Boolean passed) {
+  printf("%s\t%s\n", passed ? "ok" : "FAIL", name);
+  if (!passed)
+    checkFailures++;
+}
+
+// Column names go A to Z then AA, and a reference to a column reaches the cell the headers name it
+void checkColumnLetters() {
+  char letters[16];
+  int length = intToLettersInto(26, letters);
+  checkPrint("column 26 is named AA", length == 2 && !memcmp(letters, "AA", 2));
+
+  const int columnCount = 800;
+  Sheet sheet = newSheet(2, columnCount);
+  char text[32];
+  for (int column = 0; column < columnCount; column++) {
+    String number = {text, sprintf(text, "%d", column)};
+    sheetCommitCell(&sheet, 0, column, number);
+  }
+  String a1 = {"=A1", 3};
+  String aa1 = {"=AA1", 4};
+  sheetCommitCell(&sheet, 1, 0, a1);
+  sheetCommitCell(&sheet, 1, 1, aa1);
+  String display = sheetGetCellDisplay(&sheet, 1, 1);
+  checkPrint("AA1 refers to column 26, not A1", display.length == 2 && !memcmp(display.value, "26", 2));
+
+  Boolean roundTrips = TRUE;
+  for (int column = 0; column < columnCount; column++) {
+    text[0] = '=';
+    length = 1 + intToLettersInto(column, text + 1);
+    length += sprintf(text + length, "1");
+    String formula = {text, length};
+    sheetCommitCell(&sheet, 1, 0, formula);
+    display = sheetGetCellDisplay(&sheet, 1, 0);
+    char expected[16];
+    int expectedLength = sprintf(expected, "%d", column);
+    roundTrips = roundTrips && display.length == expectedLength && !memcmp(display.value, expected, expectedLength);
+  }
+  checkPrint("every column's name refers back to it", roundTrips);
+}
+
+Boolean checkDisplay(Sheet *sheet, int row, int column, char *expected) {
+  String display = sheetGetCellDisplay(sheet, row, column);
+  return display.length == (int)strlen(expected) && !memcmp(display.value, expected, display.length);
+}
+
+// Formulas can come from any imported file, so malformed numbers and deep nesting have to be errors and not crashes
+void checkFormulaParsing() {
+  Sheet sheet = newSheet(1, 1);
+  char *numbers[][2] = {{"=1.5", "1.5"}, {"=.5", "0.5"}, {"=1.2.3", "#PARSE!"}, {"=1..5", "#PARSE!"}, {"=.", "#PARSE!"}};
+  for (int i = 0; i < 5; i++) {
+    String text = {numbers[i][0], strlen(numbers[i][0])};
+    sheetCommitCell(&sheet, 0, 0, text);
+    char name[64];
+    snprintf(name, sizeof(name), "%s shows %s", numbers[i][0], numbers[i][1]);
+    checkPrint(name, checkDisplay(&sheet, 0, 0, numbers[i][1]));
+  }
+
+  const int deep = 500000;
+  char *text = malloc(2 * deep + 8);
+  int length = sprintf(text, "=");
+  for (int i = 0; i < 10; i++)
+    text[length++] = '(';
+  length += sprintf(text + length, "-1");
+  for (int i = 0; i < 10; i++)
+    text[length++] = ')';
+  String shallow = {text, length};
+  sheetCommitCell(&sheet, 0, 0, shallow);
+  checkPrint("a few nested parentheses still work", checkDisplay(&sheet, 0, 0, "-1"));
+
+  char *openers[] = {"(", "-", "SUM("};
+  char *names[] = {"deeply nested parentheses are a parse error", "a long run of minus signs is a parse error", "deeply nested functions are a parse error"};
+  for (int k = 0; k < 3; k++) {
+    length = sprintf(text, "=");
+    for (int i = 0; i < deep / (int)strlen(openers[k]); i++)
+      length += sprintf(text + length, "%s", openers[k]);
+    text[length++] = '1';
+    String nested = {text, length};
+    sheetCommitCell(&sheet, 0, 0, nested);
+    checkPrint(names[k], checkDisplay(&sheet, 0, 0, "#PARSE!"));
+  }
+  free(text);
+}
+
+// A damaged workbook is refused or opened, but never crashes: every int of the header and of the tables after it is set
+// to a few bad values in turn, and whatever opens has all its cells and formulas read
+void checkDamagedWorkbook() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/bench-check-%d-workbook.spc", (int)getpid());
+  Sheet sheet = newSheet(5, 3);
+  char *texts[] = {"1", "2", "3", "text", "=SUM(A1:A3)*B1", "=A1+A2"};
+  for (int i = 0; i < 6; i++) {
+    String text = {texts[i], strlen(texts[i])};
+    sheetCommitCell(&sheet, i % 5, i / 5, text);
+  }
+  if (!workbookSave(&sheet, path)) {
+    checkPrint("a workbook is saved for damaging", FALSE);
+    return;
+  }
+  Sheet opened;
+  checkPrint("an undamaged workbook opens", workbookOpen(&opened, path));
+
+  const int damagedInts = 96;
+  int values[] = {-1, 50000000, INT_MAX};
+  int fd = open(path, O_RDWR);
+  int refused = 0;
+  for (int i = 0; i < damagedInts; i++) {
+    int original;
+    if (pread(fd, &original, sizeof(int), sizeof(int) * i) != sizeof(int))
+      break;
+    for (int v = 0; v < 3; v++) {
+      if (pwrite(fd, &values[v], sizeof(int), sizeof(int) * i) != sizeof(int))
+        break;
+      if (!workbookOpen(&opened, path)) {
+        refused++;
+        continue;
+      }
+      for (int row = 0; row < opened.rowCount && row < 10; row++) {
+        for (int column = 0; column < opened.columnCount && column < 10; column++)
+          sheetGetCellDisplay(&opened, row, column);
+      }
+      workbookLoadFormulas(&opened);
+    }
+    if (pwrite(fd, &original, sizeof(int), sizeof(int) * i) != sizeof(int))
+      break;
+  }
+  close(fd);
+  unlink(path);
+  checkPrint("damaged workbooks are refused instead of crashing", refused > 0);
+}
+
+// Undoing a delete puts back the formulas it broke or shrank, and replaying the journal after a restart has to as well
+void checkUndoJournal() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/bench-check-%d.spc", (int)getpid());
+  char *suffixes[3] = {".journal", ".journal.sealed", ".journal.base"};
+  char journalFile[96];
+
+  Sheet sheet = newSheet(8, 3);
+  sheet.path = path;
+  // The journal's worker keeps using it until the program exits
+  Journal *journal = malloc(sizeof(Journal));
+  journalOpen(journal, &sheet);
+  History history = historyNew(1024 * 1024);
+  sheet.history = &history;
+  char text[16];
+  for (int row = 0; row < 7; row++) {
+    String number = {text, sprintf(text, "%d", row + 1)};
+    sheetCommitCell(&sheet, row, 0, number);
+  }
+  String cell = {"=A5*2", 5};
+  String range = {"=SUM(A3:A5)", 11};
+  sheetCommitCell(&sheet, 0, 1, cell);
+  sheetCommitCell(&sheet, 0, 2, range);
+  historyCheckpoint(&sheet);
+  sheetDeleteRows(&sheet, 4, 1);
+  historyCheckpoint(&sheet);
+  historyUndo(&sheet);
+  checkPrint("undoing a delete restores a reference into it", checkDisplay(&sheet, 0, 1, "10"));
+  checkPrint("undoing a delete restores a range it shrank", checkDisplay(&sheet, 0, 2, "12"));
+  journalClose(journal);
+
+  Sheet replayed = newSheet(8, 3);
+  replayed.path = path;
+  Journal *replayJournal = malloc(sizeof(Journal));
+  journalOpen(replayJournal, &replayed);
+  checkPrint("a reference restored by undo survives a restart", checkDisplay(&replayed, 0, 1, "10"));
+  checkPrint("a range restored by undo survives a restart", checkDisplay(&replayed, 0, 2, "12"));
+  journalClose(replayJournal);
+  for (int i = 0; i < 3; i++) {
+    snprintf(journalFile, sizeof(journalFile), "%s%s", path, suffixes[i]);
+    unlink(journalFile);
+  }
+}
+
+
+
+//******************************************//
+//               Main                       //
+//******************************************//
+
+// usage: bench [--threads n] [core|structure|aggregate|recalc|undo|check|import file|open file]...
+// Runs every benchmark that doesn't need a file when none are named. check runs the checks instead of a benchmark.
+int main(int argc, char **argv) {
+  laneKernelSelect();
+  int threadCount = 0;
+  for (int i = 1; i < argc; i++) {
+    if (stringsEqual("--threads", 9, argv[i]) && i + 1 < argc)
+      threadCount = atoi(argv[++i]);
+  }
+  if (threadCount <= 0)
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+  Boolean ranAny = FALSE;
+  for (int i = 1; i < argc; i++) {
+    if (stringsEqual("--threads", 9, argv[i])) {
+      i++;
+      continue;
+    }
+    ranAny = TRUE;
+    if (!strcmp("core", argv[i]))
+      benchCore();
+    else if (!strcmp("structure", argv[i]))
+      benchStructure();
+    else if (!strcmp("aggregate", argv[i]))
+      benchAggregate();
+    else if (!strcmp("recalc", argv[i]))
+      benchRecalc();
+    else if (!strcmp("undo", argv[i]))
+      benchUndo();
+    else if (!strcmp("check", argv[i])) {
+      checkColumnLetters();
+      checkFormulaParsing();
+      checkDamagedWorkbook();
+      checkUndoJournal();
+    }
+    else if (!strcmp("import", argv[i]) && i + 1 < argc)
+      benchImport(argv[++i], threadCount);
+    else if (!strcmp("open", argv[i]) && i + 1 < argc)
+      benchOpen(argv[++i], threadCount);
+    else {
+      printf("unknown benchmark %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (!ranAny) {
+    benchCore();
+    benchStructure();
+    benchAggregate();
+    benchRecalc();
+    benchUndo();
+  }
+  return checkFailures ? 1 : 0;
+}
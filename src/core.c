@@ -0,0 +1,4465 @@
+#include "core.h"
+
+
+
+//******************************************//
+//                   Util                   //
+//******************************************//
+
+char keyToUpper(char key) {
+  if (key > 96 && key < 123) {
+    return key - 32;
+  }
+  return key; // TODO
+}
+
+// Writes number into buffer, which needs room for 10 characters, and returns how many were written
+int intToStringInto(int number, char *buffer) {
+  int length = 1;
+  int a = number;
+  while (a > 9) {
+    length++;
+    a /= 10;
+  }
+  for (int i = length - 1; i >= 0; i--) {
+    char character = number % 10;
+    character += 48;
+    buffer[i] = character;
+    number /= 10;
+  }
+  return length;
+}
+
+// Column names like a spreadsheet's: A to Z, then AA to ZZ, AAA... Counting with A as 1 rather than 0, as there's no
+// letter for 0, so AA comes after Z rather than being another way of writing A.
+int intToLettersInto(int number, char *buffer) {
+  int length = 1;
+  for (int a = number; a > 25; a = a / 26 - 1)
+    length++;
+  for (int i = length - 1; i >= 0; i--) {
+    buffer[i] = 'A' + number % 26;
+    number = number / 26 - 1;
+  }
+  return length;
+}
+
+String intToString(int number) {
+  char buffer[16];
+  String string = {0};
+  string.length = intToStringInto(number, buffer);
+  string.value = malloc(sizeof(char) * string.length);
+  memcpy(string.value, buffer, string.length);
+  return string;
+}
+
+String intToLetters(int number) {
+  char buffer[16];
+  String string = {0};
+  string.length = intToLettersInto(number, buffer);
+  string.value = malloc(sizeof(char) * string.length);
+  memcpy(string.value, buffer, string.length);
+  return string;
+}
+
+int clamp(int number, int lower, int higher) {
+  if (number < lower) {
+    return lower;
+  }
+  if (number > higher) {
+    return higher;
+  }
+  return number;
+}
+
+Boolean stringsEqual(char *str, int strLength, char *otherStr) {
+  for (int i = 0; i < strLength; i++) {
+    if (otherStr[i] == '\0')
+      return FALSE;
+    if (str[i] != otherStr[i])
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Mixes the bits of a key so that keys differing only in their low bits spread over a hash table
+uint64_t hashKey(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+int64_t nowNanoseconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+
+//******************************************//
+//                  Trace                   //
+//******************************************//
+
+// Spans of time (a frame, a key press, an X call...) are recorded into a ring buffer that any thread can write to
+// without a lock. A writer claims the next slot with an atomic add, fills it in and publishes it by storing its sequence
+// number, so traceDump can tell a finished span from one that is still being written or has been lapped.
+// The spans are dumped as Chrome trace JSON, which chrome://tracing and ui.perfetto.dev can open.
+#define TRACE_CAPACITY 65536 // Must be a power of two
+
+typedef struct TraceSpan {
+  uint64_t sequence; // Of the span + 1 once it's written, 0 while it's being written
+  char *name; // Always a string literal
+  int64_t start;
+  int64_t duration;
+  int thread;
+} TraceSpan;
+
+typedef struct Trace {
+  TraceSpan spans[TRACE_CAPACITY];
+  uint64_t next; // Sequence number of the next span
+  int threadCount;
+} Trace;
+
+Boolean traceEnabled = FALSE;
+Trace trace;
+_Thread_local int traceThread; // 0 until the thread records its first span
+
+// Returns 0 when tracing is off, which makes the matching traceEnd do nothing
+int64_t traceBegin() {
+  return traceEnabled ? nowNanoseconds() : 0;
+}
+
+void traceEnd(char *name, int64_t start) {
+  if (!start)
+    return;
+  int64_t duration = nowNanoseconds() - start;
+  if (!traceThread)
+    traceThread = __atomic_add_fetch(&trace.threadCount, 1, __ATOMIC_RELAXED);
+  uint64_t sequence = __atomic_fetch_add(&trace.next, 1, __ATOMIC_RELAXED);
+  TraceSpan *span = &trace.spans[sequence & (TRACE_CAPACITY - 1)];
+  __atomic_store_n(&span->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&span->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&span->start, start, __ATOMIC_RELAXED);
+  __atomic_store_n(&span->duration, duration, __ATOMIC_RELAXED);
+  __atomic_store_n(&span->thread, traceThread, __ATOMIC_RELAXED);
+  __atomic_store_n(&span->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Writes the last TRACE_CAPACITY spans to path. Spans still being written are left out.
+Boolean traceDump(char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    printf("couldn't write %s\n", path);
+    return FALSE;
+  }
+  uint64_t next = __atomic_load_n(&trace.next, __ATOMIC_ACQUIRE);
+  uint64_t first = next > TRACE_CAPACITY ? next - TRACE_CAPACITY : 0;
+  int written = 0;
+  fprintf(file, "{\"traceEvents\":[\n");
+  for (uint64_t sequence = first; sequence < next; sequence++) {
+    TraceSpan *span = &trace.spans[sequence & (TRACE_CAPACITY - 1)];
+    if (__atomic_load_n(&span->sequence, __ATOMIC_ACQUIRE) != sequence + 1)
+      continue;
+    TraceSpan copy;
+    copy.name = __atomic_load_n(&span->name, __ATOMIC_RELAXED);
+    copy.start = __atomic_load_n(&span->start, __ATOMIC_RELAXED);
+    copy.duration = __atomic_load_n(&span->duration, __ATOMIC_RELAXED);
+    copy.thread = __atomic_load_n(&span->thread, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&span->sequence, __ATOMIC_RELAXED) != sequence + 1)
+      continue;
+    fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", written ? ",\n" : "", copy.name, getpid(), copy.thread, copy.start / 1e3, copy.duration / 1e3);
+    written++;
+  }
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  Boolean ok = fclose(file) == 0;
+  if (ok)
+    printf("wrote %d trace spans to %s\n", written, path);
+  return ok;
+}
+
+
+
+//******************************************//
+//                  String                  //
+//******************************************//
+
+GapBuffer gapBufferNew(int capacity) {
+  GapBuffer buffer = {0};
+  buffer.capacity = capacity;
+  buffer.data = malloc(sizeof(char) * buffer.capacity);
+  buffer.gapStart = 0;
+  buffer.gapEnd = buffer.capacity;
+  return buffer;
+}
+
+int gapBufferLength(GapBuffer *buffer) {
+  return buffer->capacity - (buffer->gapEnd - buffer->gapStart);
+}
+
+void gapBufferClear(GapBuffer *buffer) {
+  buffer->gapStart = 0;
+  buffer->gapEnd = buffer->capacity;
+}
+
+// Costs O(distance the gap moves), which is nothing while typing at the end of the text
+void gapBufferMoveGap(GapBuffer *buffer, int position) {
+  while (position < buffer->gapStart) {
+    buffer->data[--buffer->gapEnd] = buffer->data[--buffer->gapStart];
+  }
+  while (position > buffer->gapStart) {
+    buffer->data[buffer->gapStart++] = buffer->data[buffer->gapEnd++];
+  }
+}
+
+void gapBufferInsert(GapBuffer *buffer, int position, char *text, int length) {
+  gapBufferMoveGap(buffer, position);
+  if (buffer->gapEnd - buffer->gapStart < length) {
+    int textLength = gapBufferLength(buffer);
+    int afterGap = buffer->capacity - buffer->gapEnd;
+    buffer->capacity *= 2;
+    while (buffer->capacity - textLength < length) {
+      buffer->capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, sizeof(char) * buffer->capacity);
+    memmove(buffer->data + buffer->capacity - afterGap, buffer->data + buffer->gapEnd, afterGap);
+    buffer->gapEnd = buffer->capacity - afterGap;
+  }
+  memcpy(buffer->data + buffer->gapStart, text, length);
+  buffer->gapStart += length;
+}
+
+// Deletes the character at position
+void gapBufferDelete(GapBuffer *buffer, int position) {
+  gapBufferMoveGap(buffer, position + 1);
+  buffer->gapStart--;
+}
+
+// The text as one String. The String points into the buffer so it is only valid until the buffer is next changed.
+String gapBufferContents(GapBuffer *buffer) {
+  gapBufferMoveGap(buffer, gapBufferLength(buffer));
+  String string = {0};
+  string.value = buffer->data;
+  string.length = buffer->gapStart;
+  return string;
+}
+
+void gapBufferSet(GapBuffer *buffer, String string) {
+  gapBufferClear(buffer);
+  gapBufferInsert(buffer, 0, string.value, string.length);
+}
+
+
+
+//******************************************//
+//               String Array               //
+//******************************************//
+
+DynamicStringArray dynamicStringArrayNew(int capacity) {
+  DynamicStringArray array = {0};
+  array.length = 0;
+  array.capacity = capacity;
+  array.data = malloc(sizeof(String) * array.capacity);
+  return array;
+}
+void dynamicStringArrayInsert(DynamicStringArray *array, String element, int index) {
+  int oldLength = array->length;
+  int newLength = array->length + 1;
+  if (newLength > array->capacity) {
+    String *arrayData = array->data;
+    array->capacity *= 2;
+    array->data = malloc(sizeof(String) * array->capacity);
+    for (int i = 0; i < oldLength; i++) {
+      array->data[i] = arrayData[i];
+    }
+    free(arrayData);
+  }
+  for (int i = oldLength; i > index; i--) {
+    array->data[i] = array->data[i-1];
+  }
+  array->data[index] = element;
+  array->length = newLength;
+}
+void dynamicStringArrayRemove(DynamicStringArray *array, int element, int index) {
+  int newLength = array->length - 1;
+  for (int i = index; i < newLength; i++) {
+    array->data[i] = array->data[i+1];
+  }
+  if (newLength < array->capacity/4) {
+    String *arrayData = array->data;
+    array->capacity /= 2;
+    array->data = malloc(sizeof(String) * array->capacity);
+    for (int i = 0; i < newLength; i++) {
+      array->data[i] = arrayData[i];
+    }
+    free(arrayData);
+  }
+  array->length = newLength;
+}
+
+
+
+//******************************************//
+//               Int Array               //
+//******************************************//
+
+DynamicIntArray dynamicIntArrayNew(int capacity) {
+  DynamicIntArray array = {0};
+  array.length = 0;
+  array.capacity = capacity;
+  array.data = malloc(sizeof(int) * array.capacity);
+  return array;
+}
+void dynamicIntArrayInsert(DynamicIntArray *array, int element, int index) {
+  int oldLength = array->length;
+  int newLength = array->length + 1;
+  if (newLength > array->capacity) {
+    int *arrayData = array->data;
+    array->capacity = array->capacity ? array->capacity * 2 : 1; // Remove can shrink it all the way to 0
+    array->data = malloc(sizeof(int) * array->capacity);
+    for (int i = 0; i < oldLength; i++) {
+      array->data[i] = arrayData[i];
+    }
+    free(arrayData);
+  }
+  for (int i = oldLength; i > index; i--) {
+    array->data[i] = array->data[i-1];
+  }
+  array->data[index] = element;
+  array->length = newLength;
+}
+// Inserts count copies of element before index, shifting what's after it along once rather than count times
+void dynamicIntArrayInsertRepeated(DynamicIntArray *array, int element, int index, int count) {
+  int newLength = array->length + count;
+  if (newLength > array->capacity) {
+    array->capacity = array->capacity ? array->capacity : 1;
+    while (newLength > array->capacity)
+      array->capacity *= 2;
+    array->data = realloc(array->data, sizeof(int) * array->capacity);
+  }
+  memmove(&array->data[index + count], &array->data[index], sizeof(int) * (array->length - index));
+  for (int i = index; i < index + count; i++) {
+    array->data[i] = element;
+  }
+  array->length = newLength;
+}
+void dynamicIntArrayRemove(DynamicIntArray *array, int element, int index) {
+  int newLength = array->length - 1;
+  for (int i = index; i < newLength; i++) {
+    array->data[i] = array->data[i+1];
+  }
+  if (newLength < array->capacity/4) {
+    int *arrayData = array->data;
+    array->capacity /= 2;
+    array->data = malloc(sizeof(int) * array->capacity);
+    for (int i = 0; i < newLength; i++) {
+      array->data[i] = arrayData[i];
+    }
+    free(arrayData);
+  }
+  array->length = newLength;
+}
+// Removes the elements from index to index + count - 1, shifting what's after them back once
+void dynamicIntArrayRemoveRange(DynamicIntArray *array, int index, int count) {
+  memmove(&array->data[index], &array->data[index + count], sizeof(int) * (array->length - index - count));
+  array->length -= count;
+}
+void dynamicIntArrayPush(DynamicIntArray *array, int element) {
+  dynamicIntArrayInsert(array, element, array->length);
+}
+// Removes one occurrence of element without keeping the order
+void dynamicIntArrayRemoveValue(DynamicIntArray *array, int element) {
+  for (int i = 0; i < array->length; i++) {
+    if (array->data[i] == element) {
+      array->data[i] = array->data[--array->length];
+      return;
+    }
+  }
+}
+
+
+
+//******************************************//
+//               Cell Map                   //
+//******************************************//
+
+uint64_t cellKey(int row, int column) {
+  return ((uint64_t)(uint32_t)row << 32) | (uint32_t)column;
+}
+
+CellMap cellMapNew(int capacity) {
+  CellMap map = {0};
+  map.capacity = capacity;
+  map.keys = malloc(sizeof(uint64_t) * map.capacity);
+  map.values = malloc(sizeof(int) * map.capacity);
+  for (int i = 0; i < map.capacity; i++) {
+    map.values[i] = -1;
+  }
+  return map;
+}
+
+int cellMapFindSlot(CellMap *map, uint64_t key) {
+  int mask = map->capacity - 1;
+  int slot = hashKey(key) & mask;
+  while (map->values[slot] != -1 && map->keys[slot] != key) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Returns -1 if the key isn't in the map
+int cellMapGet(CellMap *map, uint64_t key) {
+  return map->values[cellMapFindSlot(map, key)];
+}
+
+void cellMapPut(CellMap *map, uint64_t key, int value) {
+  if ((map->count + 1) * 2 > map->capacity) {
+    CellMap grown = cellMapNew(map->capacity * 2);
+    for (int i = 0; i < map->capacity; i++) {
+      if (map->values[i] != -1)
+        cellMapPut(&grown, map->keys[i], map->values[i]);
+    }
+    free(map->keys);
+    free(map->values);
+    *map = grown;
+  }
+  int slot = cellMapFindSlot(map, key);
+  if (map->values[slot] == -1)
+    map->count++;
+  map->keys[slot] = key;
+  map->values[slot] = value;
+}
+
+// Backward shift deletion, the same as tileStoreRemoveTile
+void cellMapRemove(CellMap *map, uint64_t key) {
+  int mask = map->capacity - 1;
+  int slot = cellMapFindSlot(map, key);
+  if (map->values[slot] == -1)
+    return;
+  map->values[slot] = -1;
+  map->count--;
+  int next = (slot + 1) & mask;
+  while (map->values[next] != -1) {
+    int home = hashKey(map->keys[next]) & mask;
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      map->keys[slot] = map->keys[next];
+      map->values[slot] = map->values[next];
+      map->values[next] = -1;
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+}
+
+void cellMapClear(CellMap *map) {
+  for (int i = 0; i < map->capacity; i++) {
+    map->values[i] = -1;
+  }
+  map->count = 0;
+}
+
+
+
+//******************************************//
+//               Size Index                 //
+//******************************************//
+
+// Fenwick tree over row heights or column widths, so the offset of a row and the row at an offset are O(log n) however
+// the sizes vary. Changing one size is O(log n) too. Inserting or removing one shifts everything after it, so that just
+// marks the index stale from there, and the stale part is rebuilt the next time the index is used, once however many
+// were inserted. Rows added at the end, like an import does, only rebuild the end.
+void sizeIndexRebuild(SizeIndex *index, DynamicIntArray *sizes, int from) {
+  if (index->capacity < sizes->length + 1) {
+    index->capacity = sizes->length + 1024;
+    index->tree = realloc(index->tree, sizeof(int64_t) * index->capacity);
+    index->tree[0] = 0;
+  }
+  // Entries up to from only cover sizes before from, which haven't changed. The rest are set to prefix sums first and
+  // then to the difference between two of them, going backwards so the prefix sums needed are still there.
+  int64_t prefix = sizeIndexOffset(index, from);
+  index->count = sizes->length;
+  for (int i = from + 1; i <= index->count; i++) {
+    prefix += sizes->data[i - 1];
+    index->tree[i] = prefix;
+  }
+  for (int i = index->count; i > from; i--) {
+    int start = i - (i & -i);
+    index->tree[i] -= start > from ? index->tree[start] : sizeIndexOffset(index, start);
+  }
+  index->staleFrom = index->count;
+}
+
+void sizeIndexInvalidate(SizeIndex *index, int from) {
+  if (from < index->staleFrom)
+    index->staleFrom = from;
+}
+
+void sizeIndexUpdate(SizeIndex *index, DynamicIntArray *sizes) {
+  int from = index->staleFrom < index->count ? index->staleFrom : index->count;
+  from = from < sizes->length ? from : sizes->length;
+  if (from < sizes->length || index->count != sizes->length)
+    sizeIndexRebuild(index, sizes, from);
+}
+
+void sizeIndexAdd(SizeIndex *index, int i, int delta) {
+  // Stale entries are recalculated from the sizes anyway
+  if (i >= index->staleFrom)
+    return;
+  for (int k = i + 1; k <= index->count; k += k & -k) {
+    index->tree[k] += delta;
+  }
+}
+
+// Sum of the sizes before i
+int64_t sizeIndexOffset(SizeIndex *index, int i) {
+  int64_t sum = 0;
+  for (int k = clamp(i, 0, index->count); k > 0; k -= k & -k) {
+    sum += index->tree[k];
+  }
+  return sum;
+}
+
+// The item at position, where item i covers sizes[i] * unit + extra: the last one starting at or before position.
+// Walks down the tree a power of two at a time, the extra per item just being the number of items skipped times extra.
+int sizeIndexFind(SizeIndex *index, int64_t position, int64_t unit, int64_t extra) {
+  int found = 0;
+  int64_t sum = 0;
+  int step = 1;
+  while (step * 2 <= index->count)
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    int next = found + step;
+    if (next <= index->count && (sum + index->tree[next]) * unit + next * extra <= position) {
+      found = next;
+      sum += index->tree[next];
+    }
+  }
+  return clamp(found, 0, index->count - 1);
+}
+
+
+
+//******************************************//
+//               Text Arena                 //
+//******************************************//
+
+// Committed cell text is allocated from 64KB slabs split into blocks of power of two size classes. Freed blocks go on a
+// free list for their class and are handed out again, so editing cells doesn't fragment the heap or leak.
+// Text longer than the largest class goes straight to malloc.
+#define TEXT_ARENA_SMALLEST_CLASS_SHIFT 4 // 16 bytes
+#define TEXT_ARENA_SLAB_SIZE (64 * 1024)
+
+int textArenaSizeClass(int length) {
+  int sizeClass = 0;
+  while ((1 << (sizeClass + TEXT_ARENA_SMALLEST_CLASS_SHIFT)) < length) {
+    sizeClass++;
+  }
+  return sizeClass;
+}
+
+// Returns NULL for length 0. The block is at least length bytes, free it with the same length.
+char *textArenaAlloc(TextArena *arena, int length) {
+  if (length == 0)
+    return NULL;
+  int sizeClass = textArenaSizeClass(length);
+  if (sizeClass >= TEXT_ARENA_CLASS_COUNT) {
+    arena->bytesInUse += length;
+    arena->bytesReserved += length;
+    return malloc(sizeof(char) * length);
+  }
+  int blockSize = 1 << (sizeClass + TEXT_ARENA_SMALLEST_CLASS_SHIFT);
+  arena->bytesInUse += blockSize;
+  char *block = arena->freeLists[sizeClass];
+  if (block) {
+    arena->freeLists[sizeClass] = *(char **)block;
+    return block;
+  }
+  // Otherwise carve a block off the newest slab. The first 16 bytes of a slab link it to the previous one.
+  if (!arena->slabNext || arena->slabNext + blockSize > arena->slabEnd) {
+    char *slab = malloc(TEXT_ARENA_SLAB_SIZE);
+    *(char **)slab = arena->slabs;
+    arena->slabs = slab;
+    arena->slabNext = slab + 16;
+    arena->slabEnd = slab + TEXT_ARENA_SLAB_SIZE;
+    arena->bytesReserved += TEXT_ARENA_SLAB_SIZE;
+  }
+  block = arena->slabNext;
+  arena->slabNext += blockSize;
+  return block;
+}
+
+void textArenaFree(TextArena *arena, char *text, int length) {
+  if (!text || length == 0)
+    return;
+  for (int i = 0; i < arena->borrowedCount; i++) {
+    if (text >= arena->borrowedStarts[i] && text < arena->borrowedStarts[i] + arena->borrowedSizes[i])
+      return;
+  }
+  int sizeClass = textArenaSizeClass(length);
+  if (sizeClass >= TEXT_ARENA_CLASS_COUNT) {
+    arena->bytesInUse -= length;
+    arena->bytesReserved -= length;
+    free(text);
+    return;
+  }
+  arena->bytesInUse -= 1 << (sizeClass + TEXT_ARENA_SMALLEST_CLASS_SHIFT);
+  *(char **)text = arena->freeLists[sizeClass];
+  arena->freeLists[sizeClass] = text;
+}
+
+void textArenaBorrow(TextArena *arena, char *start, size_t size) {
+  arena->borrowedStarts = realloc(arena->borrowedStarts, sizeof(char *) * (arena->borrowedCount + 1));
+  arena->borrowedSizes = realloc(arena->borrowedSizes, sizeof(size_t) * (arena->borrowedCount + 1));
+  arena->borrowedStarts[arena->borrowedCount] = start;
+  arena->borrowedSizes[arena->borrowedCount] = size;
+  arena->borrowedCount++;
+}
+
+String textArenaCopy(TextArena *arena, char *text, int length) {
+  String string = {0};
+  string.value = textArenaAlloc(arena, length);
+  string.length = length;
+  if (length)
+    memcpy(string.value, text, length);
+  return string;
+}
+
+
+
+//******************************************//
+//               Tile Store                 //
+//******************************************//
+
+#define TILE_SHIFT 6
+
+typedef struct MappedTileHeader {
+  int filledCellCount;
+  int unused;
+  uint64_t occupied[TILE_SIZE];
+  uint16_t filledBeforeRow[TILE_SIZE];
+} MappedTileHeader;
+
+typedef struct MappedCell {
+  uint64_t offset; // From the start of the file
+  int length;
+  int unused;
+} MappedCell;
+
+// Index into tile->cells of the cell, whether or not it is filled
+int tileCellIndex(Tile *tile, int row, int column) {
+  uint64_t before = tile->occupied[row] & ((((uint64_t)1) << column) - 1);
+  return tile->filledBeforeRow[row] + __builtin_popcountll(before);
+}
+
+Boolean tileCellFilled(Tile *tile, int row, int column) {
+  return (tile->occupied[row] >> column) & 1;
+}
+
+void tileSetCell(Tile *tile, int row, int column, String string) {
+  int index = tileCellIndex(tile, row, column);
+  if (tileCellFilled(tile, row, column)) {
+    if (string.length) {
+      tile->cells[index] = string;
+      return;
+    }
+    for (int i = index; i < tile->filledCellCount - 1; i++) {
+      tile->cells[i] = tile->cells[i + 1];
+    }
+    tile->occupied[row] &= ~(((uint64_t)1) << column);
+    for (int r = row + 1; r < TILE_SIZE; r++) {
+      tile->filledBeforeRow[r]--;
+    }
+    tile->filledCellCount--;
+    return;
+  }
+  if (!string.length)
+    return;
+  if (tile->filledCellCount == tile->capacity) {
+    tile->capacity = tile->capacity ? tile->capacity * 2 : 4;
+    tile->cells = realloc(tile->cells, sizeof(String) * tile->capacity);
+  }
+  for (int i = tile->filledCellCount; i > index; i--) {
+    tile->cells[i] = tile->cells[i - 1];
+  }
+  tile->cells[index] = string;
+  tile->occupied[row] |= ((uint64_t)1) << column;
+  for (int r = row + 1; r < TILE_SIZE; r++) {
+    tile->filledBeforeRow[r]++;
+  }
+  tile->filledCellCount++;
+}
+
+void tileFree(Tile *tile) {
+  free(tile->cells);
+  free(tile);
+}
+
+uint64_t tileKeyHash(int tileRow, int tileColumn) {
+  return hashKey(((uint64_t)(uint32_t)tileRow << 32) | (uint32_t)tileColumn);
+}
+
+TileStore tileStoreNew(int capacity) {
+  TileStore store = {0};
+  store.capacity = capacity;
+  store.tiles = calloc(store.capacity, sizeof(Tile *));
+  return store;
+}
+
+int tileStoreFindSlot(TileStore *store, int tileRow, int tileColumn) {
+  int mask = store->capacity - 1;
+  int slot = tileKeyHash(tileRow, tileColumn) & mask;
+  while (store->tiles[slot] && (store->tiles[slot]->tileRow != tileRow || store->tiles[slot]->tileColumn != tileColumn)) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void tileStoreGrow(TileStore *store) {
+  Tile **oldTiles = store->tiles;
+  int oldCapacity = store->capacity;
+  store->capacity *= 2;
+  store->tiles = calloc(store->capacity, sizeof(Tile *));
+  for (int i = 0; i < oldCapacity; i++) {
+    if (oldTiles[i])
+      store->tiles[tileStoreFindSlot(store, oldTiles[i]->tileRow, oldTiles[i]->tileColumn)] = oldTiles[i];
+  }
+  free(oldTiles);
+}
+
+void tileStoreInsert(TileStore *store, Tile *tile) {
+  if ((store->tileCount + 1) * 2 > store->capacity)
+    tileStoreGrow(store);
+  store->tiles[tileStoreFindSlot(store, tile->tileRow, tile->tileColumn)] = tile;
+  store->tileCount++;
+}
+
+// Index into mapped->entries of the tile, or -1 when the file doesn't have it
+int mappedTilesFind(MappedTiles *mapped, int tileRow, int tileColumn) {
+  int low = 0;
+  int high = mapped->count - 1;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    MappedTileEntry *entry = &mapped->entries[middle];
+    if (entry->tileRow == tileRow && entry->tileColumn == tileColumn)
+      return middle;
+    if (entry->tileRow < tileRow || (entry->tileRow == tileRow && entry->tileColumn < tileColumn))
+      low = middle + 1;
+    else
+      high = middle - 1;
+  }
+  return -1;
+}
+
+// Text of a cell in the mapped file, which is only checked here so that opening doesn't have to read every cell. Text
+// that isn't inside the file reads as empty.
+String mappedCellText(MappedTiles *mapped, MappedCell *cell) {
+  String string = {0};
+  if (cell->length > 0 && cell->offset <= mapped->size && (uint64_t)cell->length <= mapped->size - cell->offset) {
+    string.value = mapped->data + cell->offset;
+    string.length = cell->length;
+  }
+  return string;
+}
+
+// Copies a tile out of the mapped file into the store. The cells' text stays where it is in the mapping.
+Tile *tileStoreFault(TileStore *store, int index) {
+  MappedTiles *mapped = &store->mapped;
+  mapped->faulted[index] = TRUE;
+  MappedTileHeader *header = (MappedTileHeader *)(mapped->data + mapped->entries[index].offset);
+  MappedCell *cells = (MappedCell *)(header + 1);
+  Tile *tile = calloc(1, sizeof(Tile));
+  tile->tileRow = mapped->entries[index].tileRow;
+  tile->tileColumn = mapped->entries[index].tileColumn;
+  tile->filledCellCount = header->filledCellCount;
+  tile->capacity = header->filledCellCount;
+  memcpy(tile->occupied, header->occupied, sizeof(tile->occupied));
+  memcpy(tile->filledBeforeRow, header->filledBeforeRow, sizeof(tile->filledBeforeRow));
+  tile->cells = malloc(sizeof(String) * tile->capacity);
+  for (int i = 0; i < tile->filledCellCount; i++)
+    tile->cells[i] = mappedCellText(mapped, &cells[i]);
+  tileStoreInsert(store, tile);
+  return tile;
+}
+
+void tileStoreFaultAll(TileStore *store) {
+  for (int i = 0; i < store->mapped.count; i++) {
+    if (!store->mapped.faulted[i])
+      tileStoreFault(store, i);
+  }
+}
+
+Tile *tileStoreGetTile(TileStore *store, int tileRow, int tileColumn) {
+  if (store->lastTile && store->lastTile->tileRow == tileRow && store->lastTile->tileColumn == tileColumn)
+    return store->lastTile;
+  Tile *tile = store->tiles[tileStoreFindSlot(store, tileRow, tileColumn)];
+  if (!tile && store->mapped.count) {
+    int index = mappedTilesFind(&store->mapped, tileRow, tileColumn);
+    if (index != -1 && !store->mapped.faulted[index])
+      tile = tileStoreFault(store, index);
+  }
+  if (tile)
+    store->lastTile = tile;
+  return tile;
+}
+
+Tile *tileStoreGetOrCreateTile(TileStore *store, int tileRow, int tileColumn) {
+  Tile *tile = tileStoreGetTile(store, tileRow, tileColumn);
+  if (tile)
+    return tile;
+  tile = calloc(1, sizeof(Tile));
+  tile->tileRow = tileRow;
+  tile->tileColumn = tileColumn;
+  tileStoreInsert(store, tile);
+  store->lastTile = tile;
+  return tile;
+}
+
+// Backward shift deletion so that lookups never need tombstones
+void tileStoreRemoveTile(TileStore *store, Tile *tile) {
+  int mask = store->capacity - 1;
+  int slot = tileStoreFindSlot(store, tile->tileRow, tile->tileColumn);
+  store->tiles[slot] = NULL;
+  int next = (slot + 1) & mask;
+  while (store->tiles[next]) {
+    Tile *moving = store->tiles[next];
+    int home = tileKeyHash(moving->tileRow, moving->tileColumn) & mask;
+    // Move the tile back into the hole if the hole lies between its home slot and where it is now
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      store->tiles[slot] = moving;
+      store->tiles[next] = NULL;
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+  if (store->lastTile == tile)
+    store->lastTile = NULL;
+  store->tileCount--;
+  tileFree(tile);
+}
+
+// Returns an empty String for cells that were never written
+String tileCellText(Tile *tile, int row, int column) {
+  row &= TILE_SIZE - 1;
+  column &= TILE_SIZE - 1;
+  if (!tile || !tileCellFilled(tile, row, column)) {
+    String empty = {0};
+    return empty;
+  }
+  return tile->cells[tileCellIndex(tile, row, column)];
+}
+
+String tileStoreGet(TileStore *store, int row, int column) {
+  return tileCellText(tileStoreGetTile(store, row >> TILE_SHIFT, column >> TILE_SHIFT), row, column);
+}
+
+// Same as tileStoreGet but without updating lastTile or faulting in mapped tiles, so several threads can read at once
+// as long as nobody writes. Cells of tiles still in the mapped file are read from there.
+String tileStoreGetShared(TileStore *store, int row, int column) {
+  Tile *tile = store->tiles[tileStoreFindSlot(store, row >> TILE_SHIFT, column >> TILE_SHIFT)];
+  int index = -1;
+  if (!tile && store->mapped.count)
+    index = mappedTilesFind(&store->mapped, row >> TILE_SHIFT, column >> TILE_SHIFT);
+  if (index == -1 || store->mapped.faulted[index])
+    return tileCellText(tile, row, column);
+  String string = {0};
+  MappedTileHeader *header = (MappedTileHeader *)(store->mapped.data + store->mapped.entries[index].offset);
+  row &= TILE_SIZE - 1;
+  column &= TILE_SIZE - 1;
+  if (!((header->occupied[row] >> column) & 1))
+    return string;
+  MappedCell *cell = (MappedCell *)(header + 1) + header->filledBeforeRow[row] + __builtin_popcountll(header->occupied[row] & ((((uint64_t)1) << column) - 1));
+  return mappedCellText(&store->mapped, cell);
+}
+
+// Tiles that become completely empty are freed
+void tileStoreSet(TileStore *store, int row, int column, String string) {
+  Tile *tile = string.length ? tileStoreGetOrCreateTile(store, row >> TILE_SHIFT, column >> TILE_SHIFT) : tileStoreGetTile(store, row >> TILE_SHIFT, column >> TILE_SHIFT);
+  if (!tile)
+    return;
+  tileSetCell(tile, row & (TILE_SIZE - 1), column & (TILE_SIZE - 1), string);
+  if (tile->filledCellCount == 0)
+    tileStoreRemoveTile(store, tile);
+}
+
+// Empties one row of cells, freeing their text. Only the tiles along the row are looked at.
+void tileStoreClearRow(TileStore *store, TextArena *arena, int row, int columnCount) {
+  for (int tileColumn = 0; tileColumn <= (columnCount - 1) >> TILE_SHIFT; tileColumn++) {
+    Tile *tile = tileStoreGetTile(store, row >> TILE_SHIFT, tileColumn);
+    if (!tile)
+      continue;
+    String empty = {0};
+    for (int column = 0; column < TILE_SIZE; column++) {
+      if (!tileCellFilled(tile, row & (TILE_SIZE - 1), column))
+        continue;
+      String string = tile->cells[tileCellIndex(tile, row & (TILE_SIZE - 1), column)];
+      textArenaFree(arena, string.value, string.length);
+      tileSetCell(tile, row & (TILE_SIZE - 1), column, empty);
+    }
+    if (tile->filledCellCount == 0)
+      tileStoreRemoveTile(store, tile);
+  }
+}
+
+// Empties one column of cells, freeing their text. Only the tiles along the column are looked at.
+void tileStoreClearColumn(TileStore *store, TextArena *arena, int column, int rowCount) {
+  for (int tileRow = 0; tileRow <= (rowCount - 1) >> TILE_SHIFT; tileRow++) {
+    Tile *tile = tileStoreGetTile(store, tileRow, column >> TILE_SHIFT);
+    if (!tile)
+      continue;
+    String empty = {0};
+    for (int row = 0; row < TILE_SIZE; row++) {
+      if (!tileCellFilled(tile, row, column & (TILE_SIZE - 1)))
+        continue;
+      String string = tile->cells[tileCellIndex(tile, row, column & (TILE_SIZE - 1))];
+      textArenaFree(arena, string.value, string.length);
+      tileSetCell(tile, row, column & (TILE_SIZE - 1), empty);
+    }
+    if (tile->filledCellCount == 0)
+      tileStoreRemoveTile(store, tile);
+  }
+}
+
+size_t tileStoreMemoryUsage(TileStore *store) {
+  size_t bytes = sizeof(Tile *) * store->capacity;
+  for (int i = 0; i < store->capacity; i++) {
+    if (store->tiles[i])
+      bytes += sizeof(Tile) + sizeof(String) * store->tiles[i]->capacity;
+  }
+  return bytes;
+}
+
+
+
+//******************************************//
+//               Number Lanes               //
+//******************************************//
+
+#define LANE_BLOCK_SHIFT 12
+
+LaneBlock *laneGetBlock(NumberLane *lane, int row) {
+  if (!lane || (row >> LANE_BLOCK_SHIFT) >= lane->blockCount)
+    return NULL;
+  return lane->blocks[row >> LANE_BLOCK_SHIFT];
+}
+
+void laneReserveBlock(NumberLane *lane, int block) {
+  if (block < lane->blockCount)
+    return;
+  int blockCount = lane->blockCount ? lane->blockCount : 1;
+  while (blockCount <= block)
+    blockCount *= 2;
+  lane->blocks = realloc(lane->blocks, sizeof(LaneBlock *) * blockCount);
+  memset(lane->blocks + lane->blockCount, 0, sizeof(LaneBlock *) * (blockCount - lane->blockCount));
+  lane->blockCount = blockCount;
+}
+
+LaneBlock *laneGetOrCreateBlock(NumberLane *lane, int row) {
+  int block = row >> LANE_BLOCK_SHIFT;
+  laneReserveBlock(lane, block);
+  if (!lane->blocks[block])
+    lane->blocks[block] = calloc(1, sizeof(LaneBlock));
+  return lane->blocks[block];
+}
+
+// Formulas in neighbouring rows can be stored from different threads, so the bitmaps are only touched atomically
+void laneBlockSet(LaneBlock *block, int row, double value, Boolean numeric, Boolean failed) {
+  row &= LANE_BLOCK_SIZE - 1;
+  uint64_t bit = ((uint64_t)1) << (row & 63);
+  block->values[row] = numeric ? value : 0;
+  if (numeric)
+    __atomic_fetch_or(&block->numeric[row >> 6], bit, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_and(&block->numeric[row >> 6], ~bit, __ATOMIC_RELAXED);
+  if (failed)
+    __atomic_fetch_or(&block->failed[row >> 6], bit, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_and(&block->failed[row >> 6], ~bit, __ATOMIC_RELAXED);
+}
+
+void laneClearRow(NumberLane *lane, int row) {
+  LaneBlock *block = laneGetBlock(lane, row);
+  if (block)
+    laneBlockSet(block, row, 0, FALSE, FALSE);
+}
+
+void laneFree(NumberLane *lane) {
+  for (int i = 0; i < lane->blockCount; i++) {
+    char *block = (char *)lane->blocks[i];
+    if (block < lane->borrowedStart || block >= lane->borrowedStart + lane->borrowedSize)
+      free(block);
+  }
+  free(lane->blocks);
+  lane->blocks = NULL;
+  lane->blockCount = 0;
+}
+
+// Kernels adding up 64 consecutive values, all of them numbers, into totals. Picked once at startup by laneKernelSelect.
+void laneKernelScalar(const double *values, LaneTotals *totals) {
+  double sum = 0;
+  double min = totals->min;
+  double max = totals->max;
+  for (int i = 0; i < 64; i++) {
+    sum += values[i];
+    min = values[i] < min ? values[i] : min;
+    max = values[i] > max ? values[i] : max;
+  }
+  totals->sum += sum;
+  totals->min = min;
+  totals->max = max;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+void laneKernelSse2(const double *values, LaneTotals *totals) {
+  __m128d sum0 = _mm_setzero_pd();
+  __m128d sum1 = _mm_setzero_pd();
+  __m128d min = _mm_set1_pd(totals->min);
+  __m128d max = _mm_set1_pd(totals->max);
+  for (int i = 0; i < 64; i += 4) {
+    __m128d a = _mm_loadu_pd(values + i);
+    __m128d b = _mm_loadu_pd(values + i + 2);
+    sum0 = _mm_add_pd(sum0, a);
+    sum1 = _mm_add_pd(sum1, b);
+    min = _mm_min_pd(min, _mm_min_pd(a, b));
+    max = _mm_max_pd(max, _mm_max_pd(a, b));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+  totals->sum += lanes[0] + lanes[1];
+  _mm_storeu_pd(lanes, min);
+  totals->min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+  _mm_storeu_pd(lanes, max);
+  totals->max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+}
+
+__attribute__((target("avx2")))
+void laneKernelAvx2(const double *values, LaneTotals *totals) {
+  __m256d sum0 = _mm256_setzero_pd();
+  __m256d sum1 = _mm256_setzero_pd();
+  __m256d min = _mm256_set1_pd(totals->min);
+  __m256d max = _mm256_set1_pd(totals->max);
+  for (int i = 0; i < 64; i += 8) {
+    __m256d a = _mm256_loadu_pd(values + i);
+    __m256d b = _mm256_loadu_pd(values + i + 4);
+    sum0 = _mm256_add_pd(sum0, a);
+    sum1 = _mm256_add_pd(sum1, b);
+    min = _mm256_min_pd(min, _mm256_min_pd(a, b));
+    max = _mm256_max_pd(max, _mm256_max_pd(a, b));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+  totals->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  _mm256_storeu_pd(lanes, min);
+  for (int i = 0; i < 4; i++)
+    totals->min = lanes[i] < totals->min ? lanes[i] : totals->min;
+  _mm256_storeu_pd(lanes, max);
+  for (int i = 0; i < 4; i++)
+    totals->max = lanes[i] > totals->max ? lanes[i] : totals->max;
+}
+#endif
+LaneKernel laneKernel = laneKernelScalar;
+char *laneKernelName = "scalar";
+
+void laneKernelSelect() {
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) {
+    laneKernel = laneKernelAvx2;
+    laneKernelName = "avx2";
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    laneKernel = laneKernelSse2;
+    laneKernelName = "sse2";
+  }
+#endif
+}
+
+// Adds the numbers of rows start to end - 1 of a block into totals. Words of the bitmap that are all numbers go through
+// the vector kernel, partly filled ones are walked bit by bit.
+void laneBlockAggregate(LaneBlock *block, int start, int end, LaneTotals *totals) {
+  for (int word = start >> 6; word <= (end - 1) >> 6; word++) {
+    uint64_t mask = ~(uint64_t)0;
+    if (word == start >> 6)
+      mask &= ~(uint64_t)0 << (start & 63);
+    if (word == (end - 1) >> 6 && (end & 63))
+      mask &= ~(uint64_t)0 >> (64 - (end & 63));
+    if (__atomic_load_n(&block->failed[word], __ATOMIC_RELAXED) & mask)
+      totals->failed = TRUE;
+    uint64_t numeric = __atomic_load_n(&block->numeric[word], __ATOMIC_RELAXED) & mask;
+    if (numeric == 0)
+      continue;
+    totals->count += __builtin_popcountll(numeric);
+    if (numeric == ~(uint64_t)0) {
+      laneKernel(&block->values[word << 6], totals);
+      continue;
+    }
+    while (numeric) {
+      double value = block->values[(word << 6) + __builtin_ctzll(numeric)];
+      totals->sum += value;
+      totals->min = value < totals->min ? value : totals->min;
+      totals->max = value > totals->max ? value : totals->max;
+      numeric &= numeric - 1;
+    }
+  }
+}
+
+
+
+//******************************************//
+//               Formulas                   //
+//******************************************//
+
+char *formulaErrorText[] = {"", "#PARSE!", "#VALUE!", "#REF!", "#DIV/0!", "#CYCLE!"};
+
+#define FORMULA_MAX_STACK 64
+
+FormulaEngine formulaEngineNew() {
+  FormulaEngine engine = {0};
+  engine.formulaCapacity = 64;
+  engine.formulas = malloc(sizeof(Formula) * engine.formulaCapacity);
+  engine.freeFormulas = dynamicIntArrayNew(16);
+  engine.formulaAt = cellMapNew(64);
+  engine.dependentsAt = cellMapNew(64);
+  engine.dependentListCapacity = 64;
+  engine.dependentLists = malloc(sizeof(DynamicIntArray) * engine.dependentListCapacity);
+  engine.rangeFormulas = dynamicIntArrayNew(16);
+  engine.rangeBuckets = cellMapNew(64);
+  engine.rangeBucketListCapacity = 64;
+  engine.rangeBucketLists = malloc(sizeof(DynamicIntArray) * engine.rangeBucketListCapacity);
+  engine.dirty = dynamicIntArrayNew(64);
+  engine.edges = dynamicIntArrayNew(64);
+  engine.ready = dynamicIntArrayNew(64);
+  engine.threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (engine.threadCount < 1)
+    engine.threadCount = 1;
+  return engine;
+}
+
+// Adds formula to the list stored under key in lists, creating the list if needed
+void formulaListAdd(CellMap *map, DynamicIntArray **lists, int *listCount, int *listCapacity, uint64_t key, int formula) {
+  int list = cellMapGet(map, key);
+  if (list == -1) {
+    if (*listCount == *listCapacity) {
+      *listCapacity *= 2;
+      *lists = realloc(*lists, sizeof(DynamicIntArray) * *listCapacity);
+    }
+    list = (*listCount)++;
+    (*lists)[list] = dynamicIntArrayNew(4);
+    cellMapPut(map, key, list);
+  }
+  dynamicIntArrayPush(&(*lists)[list], formula);
+}
+
+void formulaEmitNumber(DynamicIntArray *code, double number) {
+  int halves[2];
+  memcpy(halves, &number, sizeof(double));
+  dynamicIntArrayPush(code, FORMULA_NUMBER);
+  dynamicIntArrayPush(code, halves[0]);
+  dynamicIntArrayPush(code, halves[1]);
+}
+
+double formulaReadNumber(int *code) {
+  double number;
+  memcpy(&number, code, sizeof(double));
+  return number;
+}
+
+// How many ints an instruction takes, including its operands
+int formulaOpLength(int op) {
+  switch (op) {
+    case FORMULA_NUMBER: return 3;
+    case FORMULA_CELL: return 3;
+    case FORMULA_AGGREGATE_BEGIN: return 2;
+    case FORMULA_AGGREGATE_RANGE: return 5;
+  }
+  return 1;
+}
+
+// Cell text is a number if all of it parses as one
+Boolean parseNumber(String string, double *number) {
+  char buffer[64];
+  if (string.length == 0 || string.length >= (int)sizeof(buffer))
+    return FALSE;
+  // Most text can be told apart from the first character, without strtod (which would also take "inf" and "nan")
+  char first = string.value[0];
+  if (!(first >= '0' && first <= '9') && first != '-' && first != '+' && first != '.' && first != ' ')
+    return FALSE;
+  // Plain decimals with up to 15 digits are exact as integers, and dividing by an exact power of ten rounds correctly,
+  // so they don't need strtod either
+  static const double powersOfTen[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+  int i = first == '-' || first == '+' ? 1 : 0;
+  int64_t mantissa = 0;
+  int digits = 0;
+  int fractionDigits = -1;
+  for (; i < string.length; i++) {
+    char c = string.value[i];
+    if (c >= '0' && c <= '9') {
+      mantissa = mantissa * 10 + c - '0';
+      digits++;
+      if (fractionDigits >= 0)
+        fractionDigits++;
+    }
+    else if (c == '.' && fractionDigits < 0) {
+      fractionDigits = 0;
+    }
+    else {
+      break;
+    }
+  }
+  if (i == string.length && digits > 0 && digits <= 15) {
+    *number = (double)mantissa / powersOfTen[fractionDigits > 0 ? fractionDigits : 0];
+    if (first == '-')
+      *number = -*number;
+    return TRUE;
+  }
+  memcpy(buffer, string.value, string.length);
+  buffer[string.length] = '\0';
+  char *end;
+  *number = strtod(buffer, &end);
+  return end == buffer + string.length;
+}
+
+Boolean isFormula(String string) {
+  return string.length > 1 && string.value[0] == '=';
+}
+
+
+
+//******************************************//
+//               Sheet                      //
+//******************************************//
+
+const int TEMP_CELL_WIDTH = 15;
+const int TEMP_CELL_HEIGHT = 3;
+
+Sheet newSheet(int rowCount, int columnCount) {
+  Sheet sheet = {0};
+  sheet.cellWidths = dynamicIntArrayNew(columnCount + 100);
+  sheet.cellHeights = dynamicIntArrayNew(rowCount + 1000);
+  sheet.cells = tileStoreNew(64);
+  sheet.rowMap = dynamicIntArrayNew(rowCount + 1000);
+  sheet.columnMap = dynamicIntArrayNew(columnCount + 100);
+  sheet.freePhysicalRows = dynamicIntArrayNew(16);
+  sheet.freePhysicalColumns = dynamicIntArrayNew(16);
+  sheet.rowOfPhysicalRow = dynamicIntArrayNew(rowCount + 1000);
+  sheet.columnOfPhysicalColumn = dynamicIntArrayNew(columnCount + 100);
+  for (int i = 0; i < columnCount; i++) {
+    dynamicIntArrayInsert(&sheet.cellWidths, TEMP_CELL_WIDTH, i);
+    dynamicIntArrayInsert(&sheet.columnMap, i, i);
+    dynamicIntArrayInsert(&sheet.columnOfPhysicalColumn, i, i);
+  }
+  for (int i = 0; i < rowCount; i++) {
+    dynamicIntArrayInsert(&sheet.cellHeights, TEMP_CELL_HEIGHT, i);
+    dynamicIntArrayInsert(&sheet.rowMap, i, i);
+    dynamicIntArrayInsert(&sheet.rowOfPhysicalRow, i, i);
+  }
+  sheet.physicalRowCount = rowCount;
+  sheet.physicalColumnCount = columnCount;
+  sheet.verticalPadding = 4;
+  sheet.horizontalPadding = 4;
+  sheet.columnCount = columnCount;
+  sheet.rowCount = rowCount;
+  sheet.visibleRowCount = 1;
+  sheet.visibleColumnCount = 1;
+  sheet.anchorRow = -1;
+  sheet.anchorColumn = -1;
+  sheet.changedCells = dynamicIntArrayNew(64);
+  sheet.editBuffer = gapBufferNew(64);
+  sheet.formulas = formulaEngineNew();
+  return sheet;
+}
+
+String sheetGetCell(Sheet *sheet, int row, int column) {
+  if (sheet->editing && row == sheet->editRow && column == sheet->editColumn)
+    return gapBufferContents(&sheet->editBuffer);
+  return tileStoreGet(&sheet->cells, sheet->rowMap.data[row], sheet->columnMap.data[column]);
+}
+
+void sheetSetCell(Sheet *sheet, int row, int column, String string) {
+  tileStoreSet(&sheet->cells, sheet->rowMap.data[row], sheet->columnMap.data[column], string);
+}
+
+NumberLane *sheetGetLane(Sheet *sheet, int physicalColumn) {
+  if (physicalColumn >= sheet->laneCount)
+    return NULL;
+  return &sheet->lanes[physicalColumn];
+}
+
+NumberLane *sheetGetOrCreateLane(Sheet *sheet, int physicalColumn) {
+  if (physicalColumn >= sheet->laneCount) {
+    int laneCount = sheet->physicalColumnCount > physicalColumn ? sheet->physicalColumnCount : physicalColumn + 1;
+    sheet->lanes = realloc(sheet->lanes, sizeof(NumberLane) * laneCount);
+    memset(sheet->lanes + sheet->laneCount, 0, sizeof(NumberLane) * (laneCount - sheet->laneCount));
+    sheet->laneCount = laneCount;
+  }
+  return &sheet->lanes[physicalColumn];
+}
+
+// Keeps the lane in step with newly committed text. Formula cells get their block now so evaluating them (possibly
+// from another thread) never has to allocate.
+void sheetUpdateLane(Sheet *sheet, int physicalRow, int physicalColumn, String text) {
+  double value = 0;
+  if (isFormula(text) || parseNumber(text, &value)) {
+    LaneBlock *block = laneGetOrCreateBlock(sheetGetOrCreateLane(sheet, physicalColumn), physicalRow);
+    laneBlockSet(block, physicalRow, value, !isFormula(text), FALSE);
+  }
+  else {
+    laneClearRow(sheetGetLane(sheet, physicalColumn), physicalRow);
+  }
+}
+
+void sheetCellChanged(Sheet *sheet, int row, int column) {
+  dynamicIntArrayInsert(&sheet->changedCells, row, sheet->changedCells.length);
+  dynamicIntArrayInsert(&sheet->changedCells, column, sheet->changedCells.length);
+}
+
+// Rows and columns in pixels, for a font whose lines are lineHeight pixels tall and characters charWidth pixels wide.
+// A row is cellHeights[row] lines tall plus its padding, a column cellWidths[column] characters wide plus its padding.
+int sheetRowHeight(Sheet *sheet, int row, int lineHeight) {
+  return sheet->cellHeights.data[row] * lineHeight + 2 * sheet->verticalPadding;
+}
+
+int sheetColumnWidth(Sheet *sheet, int column, int charWidth) {
+  return sheet->cellWidths.data[column] * charWidth + 2 * sheet->horizontalPadding;
+}
+
+// Where row starts, from the top of the first row. row can be rowCount, for the bottom of the last row.
+int64_t sheetRowOffset(Sheet *sheet, int row, int lineHeight) {
+  sizeIndexUpdate(&sheet->rowIndex, &sheet->cellHeights);
+  return sizeIndexOffset(&sheet->rowIndex, row) * lineHeight + (int64_t)row * 2 * sheet->verticalPadding;
+}
+
+int64_t sheetColumnOffset(Sheet *sheet, int column, int charWidth) {
+  sizeIndexUpdate(&sheet->columnIndex, &sheet->cellWidths);
+  return sizeIndexOffset(&sheet->columnIndex, column) * charWidth + (int64_t)column * 2 * sheet->horizontalPadding;
+}
+
+// The row at offset pixels from the top of the first row, clamped to the rows there are
+int sheetRowAtOffset(Sheet *sheet, int64_t offset, int lineHeight) {
+  sizeIndexUpdate(&sheet->rowIndex, &sheet->cellHeights);
+  return sizeIndexFind(&sheet->rowIndex, offset, lineHeight, 2 * sheet->verticalPadding);
+}
+
+int sheetColumnAtOffset(Sheet *sheet, int64_t offset, int charWidth) {
+  sizeIndexUpdate(&sheet->columnIndex, &sheet->cellWidths);
+  return sizeIndexFind(&sheet->columnIndex, offset, charWidth, 2 * sheet->horizontalPadding);
+}
+
+// The selected range, clamped to the cells there are in case rows or columns were deleted from under the anchor
+CellRange sheetSelection(Sheet *sheet) {
+  CellRange range = {sheet->selectedRow, sheet->selectedColumn, sheet->selectedRow, sheet->selectedColumn};
+  if (sheet->anchorRow >= 0) {
+    int anchorRow = clamp(sheet->anchorRow, 0, sheet->rowCount - 1);
+    int anchorColumn = clamp(sheet->anchorColumn, 0, sheet->columnCount - 1);
+    range.top = anchorRow < range.top ? anchorRow : range.top;
+    range.bottom = anchorRow > range.bottom ? anchorRow : range.bottom;
+    range.left = anchorColumn < range.left ? anchorColumn : range.left;
+    range.right = anchorColumn > range.right ? anchorColumn : range.right;
+  }
+  return range;
+}
+
+
+
+//******************************************//
+//               Formula Engine             //
+//******************************************//
+
+// Visible row of a physical row, or -1 if the row was deleted
+int sheetRowOfPhysicalRow(Sheet *sheet, int physicalRow) {
+  return sheet->rowOfPhysicalRow.data[physicalRow];
+}
+
+int sheetColumnOfPhysicalColumn(Sheet *sheet, int physicalColumn) {
+  return sheet->columnOfPhysicalColumn.data[physicalColumn];
+}
+
+typedef struct FormulaParser {
+  Sheet *sheet;
+  String text;
+  int position;
+  DynamicIntArray *code;
+  int stackDepth;
+  int aggregateDepth;
+  int nesting; // Parentheses and minus signs being parsed, limited so text can't recurse the parser off its stack
+  FormulaError error;
+} FormulaParser;
+
+void formulaParserSkipSpaces(FormulaParser *parser) {
+  while (parser->position < parser->text.length && parser->text.value[parser->position] == ' ') {
+    parser->position++;
+  }
+}
+
+char formulaParserPeek(FormulaParser *parser) {
+  formulaParserSkipSpaces(parser);
+  if (parser->position >= parser->text.length)
+    return '\0';
+  return parser->text.value[parser->position];
+}
+
+void formulaParserPush(FormulaParser *parser, int change) {
+  parser->stackDepth += change;
+  if (parser->stackDepth > FORMULA_MAX_STACK)
+    parser->error = FORMULA_ERROR_PARSE;
+}
+
+// Reads an A1 style reference, the inverse of the intToLetters and intToString naming used for the headers
+Boolean formulaParseReference(FormulaParser *parser, int *row, int *column) {
+  formulaParserSkipSpaces(parser);
+  int position = parser->position;
+  int letters = 0;
+  int columnNumber = 0;
+  while (position < parser->text.length && keyToUpper(parser->text.value[position]) >= 'A' && keyToUpper(parser->text.value[position]) <= 'Z') {
+    columnNumber = columnNumber * 26 + keyToUpper(parser->text.value[position]) - 'A' + 1;
+    position++;
+    letters++;
+  }
+  int digits = 0;
+  int rowNumber = 0;
+  while (position < parser->text.length && parser->text.value[position] >= '0' && parser->text.value[position] <= '9') {
+    rowNumber = rowNumber * 10 + parser->text.value[position] - '0';
+    position++;
+    digits++;
+  }
+  if (letters == 0 || letters > 6 || digits == 0 || digits > 9)
+    return FALSE;
+  parser->position = position;
+  *row = rowNumber - 1;
+  *column = columnNumber - 1;
+  if (*row < 0 || *row >= parser->sheet->rowCount || *column >= parser->sheet->columnCount)
+    parser->error = FORMULA_ERROR_REF;
+  return TRUE;
+}
+
+void formulaParseExpression(FormulaParser *parser);
+
+// A function argument is either an expression or a range like A1:C10
+void formulaParseArgument(FormulaParser *parser) {
+  int start = parser->position;
+  int row1, column1, row2, column2;
+  if (formulaParseReference(parser, &row1, &column1) && formulaParserPeek(parser) == ':') {
+    parser->position++;
+    if (!formulaParseReference(parser, &row2, &column2)) {
+      parser->error = FORMULA_ERROR_PARSE;
+      return;
+    }
+    if (parser->error)
+      return;
+    Sheet *sheet = parser->sheet;
+    dynamicIntArrayPush(parser->code, FORMULA_AGGREGATE_RANGE);
+    dynamicIntArrayPush(parser->code, sheet->rowMap.data[row1 < row2 ? row1 : row2]);
+    dynamicIntArrayPush(parser->code, sheet->columnMap.data[column1 < column2 ? column1 : column2]);
+    dynamicIntArrayPush(parser->code, sheet->rowMap.data[row1 < row2 ? row2 : row1]);
+    dynamicIntArrayPush(parser->code, sheet->columnMap.data[column1 < column2 ? column2 : column1]);
+    return;
+  }
+  parser->position = start;
+  formulaParseExpression(parser);
+  dynamicIntArrayPush(parser->code, FORMULA_AGGREGATE_VALUE);
+  formulaParserPush(parser, -1);
+}
+
+Boolean formulaParseFunction(FormulaParser *parser) {
+  char *names[] = {"SUM", "AVERAGE", "AVG", "MIN", "MAX", "COUNT"};
+  FormulaFunction functions[] = {FORMULA_SUM, FORMULA_AVERAGE, FORMULA_AVERAGE, FORMULA_MIN, FORMULA_MAX, FORMULA_COUNT};
+  formulaParserSkipSpaces(parser);
+  for (int i = 0; i < 6; i++) {
+    int length = strlen(names[i]);
+    if (parser->position + length >= parser->text.length)
+      continue;
+    Boolean matches = TRUE;
+    for (int j = 0; j < length; j++) {
+      if (keyToUpper(parser->text.value[parser->position + j]) != names[i][j])
+        matches = FALSE;
+    }
+    if (!matches || parser->text.value[parser->position + length] != '(')
+      continue;
+
+    parser->position += length + 1;
+    if (++parser->aggregateDepth > FORMULA_MAX_STACK) {
+      parser->error = FORMULA_ERROR_PARSE;
+      return TRUE;
+    }
+    dynamicIntArrayPush(parser->code, FORMULA_AGGREGATE_BEGIN);
+    dynamicIntArrayPush(parser->code, functions[i]);
+    if (formulaParserPeek(parser) != ')') {
+      formulaParseArgument(parser);
+      while (!parser->error && formulaParserPeek(parser) == ',') {
+        parser->position++;
+        formulaParseArgument(parser);
+      }
+    }
+    if (formulaParserPeek(parser) != ')')
+      parser->error = FORMULA_ERROR_PARSE;
+    parser->position++;
+    parser->aggregateDepth--;
+    dynamicIntArrayPush(parser->code, FORMULA_AGGREGATE_END);
+    formulaParserPush(parser, 1);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+void formulaParsePrimary(FormulaParser *parser) {
+  char c = formulaParserPeek(parser);
+  if (c == '(') {
+    if (++parser->nesting > FORMULA_MAX_STACK) {
+      parser->error = FORMULA_ERROR_PARSE;
+      return;
+    }
+    parser->position++;
+    formulaParseExpression(parser);
+    if (formulaParserPeek(parser) != ')')
+      parser->error = FORMULA_ERROR_PARSE;
+    parser->position++;
+    parser->nesting--;
+    return;
+  }
+  if ((c >= '0' && c <= '9') || c == '.') {
+    char buffer[64];
+    int length = 0;
+    int digits = 0;
+    while (parser->position < parser->text.length && length < 63 && ((parser->text.value[parser->position] >= '0' && parser->text.value[parser->position] <= '9') || parser->text.value[parser->position] == '.')) {
+      digits += parser->text.value[parser->position] != '.';
+      buffer[length++] = parser->text.value[parser->position++];
+    }
+    buffer[length] = '\0';
+    // strtod stops at a second dot, which would quietly drop the rest of 1.2.3
+    char *end;
+    double number = strtod(buffer, &end);
+    if (!digits || end != buffer + length) {
+      parser->error = FORMULA_ERROR_PARSE;
+      return;
+    }
+    formulaEmitNumber(parser->code, number);
+    formulaParserPush(parser, 1);
+    return;
+  }
+  if (formulaParseFunction(parser))
+    return;
+  int row, column;
+  if (formulaParseReference(parser, &row, &column)) {
+    if (parser->error)
+      return;
+    dynamicIntArrayPush(parser->code, FORMULA_CELL);
+    dynamicIntArrayPush(parser->code, parser->sheet->rowMap.data[row]);
+    dynamicIntArrayPush(parser->code, parser->sheet->columnMap.data[column]);
+    formulaParserPush(parser, 1);
+    return;
+  }
+  parser->error = FORMULA_ERROR_PARSE;
+}
+
+void formulaParseUnary(FormulaParser *parser) {
+  if (formulaParserPeek(parser) == '-') {
+    if (++parser->nesting > FORMULA_MAX_STACK) {
+      parser->error = FORMULA_ERROR_PARSE;
+      return;
+    }
+    parser->position++;
+    formulaParseUnary(parser);
+    dynamicIntArrayPush(parser->code, FORMULA_NEGATE);
+    parser->nesting--;
+    return;
+  }
+  if (formulaParserPeek(parser) == '+')
+    parser->position++;
+  formulaParsePrimary(parser);
+}
+
+void formulaParseTerm(FormulaParser *parser) {
+  formulaParseUnary(parser);
+  while (!parser->error && (formulaParserPeek(parser) == '*' || formulaParserPeek(parser) == '/')) {
+    char op = parser->text.value[parser->position++];
+    formulaParseUnary(parser);
+    dynamicIntArrayPush(parser->code, op == '*' ? FORMULA_MULTIPLY : FORMULA_DIVIDE);
+    formulaParserPush(parser, -1);
+  }
+}
+
+void formulaParseExpression(FormulaParser *parser) {
+  formulaParseTerm(parser);
+  while (!parser->error && (formulaParserPeek(parser) == '+' || formulaParserPeek(parser) == '-')) {
+    char op = parser->text.value[parser->position++];
+    formulaParseTerm(parser);
+    dynamicIntArrayPush(parser->code, op == '+' ? FORMULA_ADD : FORMULA_SUBTRACT);
+    formulaParserPush(parser, -1);
+  }
+}
+
+// Compiles the text of a formula cell (including the leading '='). Formulas that don't compile keep the error
+// and no code, so they show the error and have no precedents.
+Boolean formulaCodeHasRanges(DynamicIntArray *code) {
+  for (int pc = 0; pc < code->length; pc += formulaOpLength(code->data[pc])) {
+    if (code->data[pc] == FORMULA_AGGREGATE_RANGE)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+void formulaCompile(Sheet *sheet, Formula *formula, String text) {
+  formula->code.length = 0;
+  FormulaParser parser = {0};
+  parser.sheet = sheet;
+  parser.text = text;
+  parser.position = 1;
+  parser.code = &formula->code;
+  formulaParseExpression(&parser);
+  if (!parser.error && formulaParserPeek(&parser) != '\0')
+    parser.error = FORMULA_ERROR_PARSE;
+  formula->error = parser.error;
+  if (parser.error)
+    formula->code.length = 0;
+  formula->hasRanges = formulaCodeHasRanges(&formula->code);
+}
+
+// The value of a cell as seen by a formula. Empty cells are 0 and text that isn't a number is FORMULA_ERROR_VALUE,
+// except inside ranges where both are skipped (isNumber is FALSE).
+FormulaError formulaCellValue(Sheet *sheet, int physicalRow, int physicalColumn, double *value, Boolean *isNumber) {
+  *value = 0;
+  *isNumber = FALSE;
+  if (sheetRowOfPhysicalRow(sheet, physicalRow) == -1 || sheetColumnOfPhysicalColumn(sheet, physicalColumn) == -1)
+    return FORMULA_ERROR_REF;
+  int formula = cellMapGet(&sheet->formulas.formulaAt, cellKey(physicalRow, physicalColumn));
+  if (formula != -1) {
+    *value = sheet->formulas.formulas[formula].value;
+    *isNumber = TRUE;
+    return sheet->formulas.formulas[formula].error;
+  }
+  String text = tileStoreGetShared(&sheet->cells, physicalRow, physicalColumn);
+  if (text.length == 0)
+    return FORMULA_OK;
+  if (!parseNumber(text, value))
+    return FORMULA_ERROR_VALUE;
+  *isNumber = TRUE;
+  return FORMULA_OK;
+}
+
+typedef struct FormulaAggregate {
+  FormulaFunction function;
+  double sum;
+  double min;
+  double max;
+  int count;
+} FormulaAggregate;
+
+void formulaAggregateAdd(FormulaAggregate *aggregate, double value) {
+  aggregate->sum += value;
+  aggregate->min = aggregate->count == 0 || value < aggregate->min ? value : aggregate->min;
+  aggregate->max = aggregate->count == 0 || value > aggregate->max ? value : aggregate->max;
+  aggregate->count++;
+}
+
+// Cell by cell version of formulaAggregateRange, only used to find the error when a range holds one
+FormulaError formulaAggregateCells(Sheet *sheet, FormulaAggregate *aggregate, int row1, int column1, int row2, int column2) {
+  for (int row = row1; row <= row2; row++) {
+    for (int column = column1; column <= column2; column++) {
+      double value;
+      Boolean isNumber;
+      FormulaError error = formulaCellValue(sheet, sheet->rowMap.data[row], sheet->columnMap.data[column], &value, &isNumber);
+      if (error == FORMULA_ERROR_VALUE)
+        continue;
+      if (error)
+        return error;
+      if (isNumber)
+        formulaAggregateAdd(aggregate, value);
+    }
+  }
+  return FORMULA_OK;
+}
+
+// Aggregates a range from the number lanes. Each column is split into runs of rows whose physical rows are consecutive
+// (the whole column, unless rows were inserted in the middle) and each run is handed to laneBlockAggregate.
+FormulaError formulaAggregateRange(Sheet *sheet, FormulaAggregate *aggregate, int *operands) {
+  int row1 = sheetRowOfPhysicalRow(sheet, operands[0]);
+  int column1 = sheetColumnOfPhysicalColumn(sheet, operands[1]);
+  int row2 = sheetRowOfPhysicalRow(sheet, operands[2]);
+  int column2 = sheetColumnOfPhysicalColumn(sheet, operands[3]);
+  if (row1 == -1 || column1 == -1 || row2 == -1 || column2 == -1)
+    return FORMULA_ERROR_REF;
+  LaneTotals totals = {0};
+  totals.min = INFINITY;
+  totals.max = -INFINITY;
+  int *rowMap = sheet->rowMap.data;
+  for (int column = column1; column <= column2; column++) {
+    NumberLane *lane = sheetGetLane(sheet, sheet->columnMap.data[column]);
+    if (!lane)
+      continue;
+    int row = row1;
+    while (row <= row2) {
+      int physicalRow = rowMap[row];
+      int length = 1;
+      while (row + length <= row2 && rowMap[row + length] == physicalRow + length && ((physicalRow + length) & (LANE_BLOCK_SIZE - 1)) != 0)
+        length++;
+      LaneBlock *block = laneGetBlock(lane, physicalRow);
+      if (block)
+        laneBlockAggregate(block, physicalRow & (LANE_BLOCK_SIZE - 1), (physicalRow & (LANE_BLOCK_SIZE - 1)) + length, &totals);
+      row += length;
+    }
+  }
+  if (totals.failed)
+    return formulaAggregateCells(sheet, aggregate, row1, column1, row2, column2);
+  if (totals.count) {
+    aggregate->min = aggregate->count == 0 || totals.min < aggregate->min ? totals.min : aggregate->min;
+    aggregate->max = aggregate->count == 0 || totals.max > aggregate->max ? totals.max : aggregate->max;
+    aggregate->sum += totals.sum;
+    aggregate->count += totals.count;
+  }
+  return FORMULA_OK;
+}
+
+// Publishes the result of a formula: its display text and its slot in the column's lane
+void formulaStoreResult(Sheet *sheet, Formula *formula) {
+  if (formula->error)
+    snprintf(formula->display, sizeof(formula->display), "%s", formulaErrorText[formula->error]);
+  else
+    snprintf(formula->display, sizeof(formula->display), "%.15g", formula->value);
+  LaneBlock *block = laneGetBlock(sheetGetLane(sheet, formula->physicalColumn), formula->physicalRow);
+  if (block)
+    laneBlockSet(block, formula->physicalRow, formula->value, !formula->error, formula->error != FORMULA_OK);
+}
+
+void formulaEvaluate(Sheet *sheet, Formula *formula) {
+  if (formula->code.length == 0) {
+    formulaStoreResult(sheet, formula);
+    return;
+  }
+  double stack[FORMULA_MAX_STACK];
+  int top = 0;
+  FormulaAggregate aggregates[FORMULA_MAX_STACK];
+  int aggregateTop = 0;
+  FormulaError error = FORMULA_OK;
+  int *code = formula->code.data;
+  for (int pc = 0; pc < formula->code.length && !error; pc += formulaOpLength(code[pc])) {
+    switch (code[pc]) {
+      case FORMULA_NUMBER: {
+        stack[top++] = formulaReadNumber(&code[pc + 1]);
+        break;
+      }
+      case FORMULA_CELL: {
+        Boolean isNumber;
+        error = formulaCellValue(sheet, code[pc + 1], code[pc + 2], &stack[top++], &isNumber);
+        break;
+      }
+      case FORMULA_ADD: top--; stack[top - 1] += stack[top]; break;
+      case FORMULA_SUBTRACT: top--; stack[top - 1] -= stack[top]; break;
+      case FORMULA_MULTIPLY: top--; stack[top - 1] *= stack[top]; break;
+      case FORMULA_DIVIDE: {
+        top--;
+        if (stack[top] == 0)
+          error = FORMULA_ERROR_DIVIDE_BY_ZERO;
+        else
+          stack[top - 1] /= stack[top];
+        break;
+      }
+      case FORMULA_NEGATE: stack[top - 1] = -stack[top - 1]; break;
+      case FORMULA_AGGREGATE_BEGIN: {
+        FormulaAggregate aggregate = {0};
+        aggregate.function = code[pc + 1];
+        aggregates[aggregateTop++] = aggregate;
+        break;
+      }
+      case FORMULA_AGGREGATE_VALUE: {
+        formulaAggregateAdd(&aggregates[aggregateTop - 1], stack[--top]);
+        break;
+      }
+      case FORMULA_AGGREGATE_RANGE: {
+        error = formulaAggregateRange(sheet, &aggregates[aggregateTop - 1], &code[pc + 1]);
+        break;
+      }
+      case FORMULA_AGGREGATE_END: {
+        FormulaAggregate aggregate = aggregates[--aggregateTop];
+        double result = 0;
+        switch (aggregate.function) {
+          case FORMULA_SUM: result = aggregate.sum; break;
+          case FORMULA_AVERAGE: {
+            if (aggregate.count == 0)
+              error = FORMULA_ERROR_DIVIDE_BY_ZERO;
+            else
+              result = aggregate.sum / aggregate.count;
+            break;
+          }
+          case FORMULA_MIN: result = aggregate.count ? aggregate.min : 0; break;
+          case FORMULA_MAX: result = aggregate.count ? aggregate.max : 0; break;
+          case FORMULA_COUNT: result = aggregate.count; break;
+        }
+        stack[top++] = result;
+        break;
+      }
+    }
+  }
+  formula->error = error;
+  formula->value = error ? 0 : stack[0];
+  formulaStoreResult(sheet, formula);
+}
+
+// Adds the range formula to every range index bucket its ranges overlap
+void formulaIndexRanges(Sheet *sheet, int id) {
+  FormulaEngine *engine = &sheet->formulas;
+  Formula *formula = &engine->formulas[id];
+  for (int pc = 0; pc < formula->code.length; pc += formulaOpLength(formula->code.data[pc])) {
+    if (formula->code.data[pc] != FORMULA_AGGREGATE_RANGE)
+      continue;
+    int *operands = &formula->code.data[pc + 1];
+    int row1 = sheetRowOfPhysicalRow(sheet, operands[0]);
+    int column1 = sheetColumnOfPhysicalColumn(sheet, operands[1]);
+    int row2 = sheetRowOfPhysicalRow(sheet, operands[2]);
+    int column2 = sheetColumnOfPhysicalColumn(sheet, operands[3]);
+    if (row1 == -1 || column1 == -1 || row2 == -1 || column2 == -1)
+      continue;
+    for (int bucketRow = row1 >> TILE_SHIFT; bucketRow <= row2 >> TILE_SHIFT; bucketRow++) {
+      for (int bucketColumn = column1 >> TILE_SHIFT; bucketColumn <= column2 >> TILE_SHIFT; bucketColumn++) {
+        // When another range of this formula already put it in the bucket it is the last one in there
+        uint64_t key = cellKey(bucketRow, bucketColumn);
+        int list = cellMapGet(&engine->rangeBuckets, key);
+        if (list != -1 && engine->rangeBucketLists[list].length && engine->rangeBucketLists[list].data[engine->rangeBucketLists[list].length - 1] == id)
+          continue;
+        formulaListAdd(&engine->rangeBuckets, &engine->rangeBucketLists, &engine->rangeBucketListCount, &engine->rangeBucketListCapacity, key, id);
+      }
+    }
+  }
+}
+
+void formulaRebuildRangeIndex(Sheet *sheet) {
+  FormulaEngine *engine = &sheet->formulas;
+  for (int i = 0; i < engine->rangeBucketListCount; i++) {
+    free(engine->rangeBucketLists[i].data);
+  }
+  engine->rangeBucketListCount = 0;
+  cellMapClear(&engine->rangeBuckets);
+  for (int i = 0; i < engine->rangeFormulas.length; i++) {
+    formulaIndexRanges(sheet, engine->rangeFormulas.data[i]);
+  }
+  engine->rangeIndexStale = FALSE;
+}
+
+// Registers the formula as a dependent of everything it references
+void formulaLink(Sheet *sheet, int id) {
+  FormulaEngine *engine = &sheet->formulas;
+  Formula *formula = &engine->formulas[id];
+  for (int pc = 0; pc < formula->code.length; pc += formulaOpLength(formula->code.data[pc])) {
+    if (formula->code.data[pc] == FORMULA_CELL)
+      formulaListAdd(&engine->dependentsAt, &engine->dependentLists, &engine->dependentListCount, &engine->dependentListCapacity, cellKey(formula->code.data[pc + 1], formula->code.data[pc + 2]), id);
+  }
+  if (formula->hasRanges) {
+    dynamicIntArrayPush(&engine->rangeFormulas, id);
+    if (!engine->rangeIndexStale)
+      formulaIndexRanges(sheet, id);
+  }
+}
+
+void formulaUnlink(Sheet *sheet, int id) {
+  FormulaEngine *engine = &sheet->formulas;
+  Formula *formula = &engine->formulas[id];
+  for (int pc = 0; pc < formula->code.length; pc += formulaOpLength(formula->code.data[pc])) {
+    if (formula->code.data[pc] == FORMULA_CELL) {
+      int list = cellMapGet(&engine->dependentsAt, cellKey(formula->code.data[pc + 1], formula->code.data[pc + 2]));
+      if (list != -1)
+        dynamicIntArrayRemoveValue(&engine->dependentLists[list], id);
+    }
+  }
+  if (formula->hasRanges) {
+    dynamicIntArrayRemoveValue(&engine->rangeFormulas, id);
+    // Taking it out of the buckets would mean finding them again, so the index is rebuilt lazily instead
+    engine->rangeIndexStale = TRUE;
+  }
+}
+
+// Replaces the formula's code with code compiled earlier, which undo and the journal put back
+void formulaSetCode(Sheet *sheet, int id, DynamicIntArray *code, FormulaError error) {
+  Formula *formula = &sheet->formulas.formulas[id];
+  formulaUnlink(sheet, id);
+  formula->code.length = 0;
+  for (int i = 0; i < code->length; i++) {
+    dynamicIntArrayPush(&formula->code, code->data[i]);
+  }
+  formula->hasRanges = formulaCodeHasRanges(&formula->code);
+  formula->error = error;
+  formulaLink(sheet, id);
+}
+
+// Turns the references in code from physical rows and columns into visible ones, or back. Returns FALSE if one is
+// to a deleted or missing row or column, or the code is cut short
+Boolean formulaCodeTranslate(Sheet *sheet, DynamicIntArray *code, Boolean toVisible) {
+  for (int pc = 0; pc < code->length; pc += formulaOpLength(code->data[pc])) {
+    int op = code->data[pc];
+    if (pc + formulaOpLength(op) > code->length)
+      return FALSE;
+    if (op != FORMULA_CELL && op != FORMULA_AGGREGATE_RANGE)
+      continue;
+    for (int i = pc + 1; i < pc + formulaOpLength(op); i += 2) {
+      int row = code->data[i];
+      int column = code->data[i + 1];
+      if (toVisible) {
+        row = sheetRowOfPhysicalRow(sheet, row);
+        column = sheetColumnOfPhysicalColumn(sheet, column);
+      }
+      else if (row >= 0 && row < sheet->rowCount && column >= 0 && column < sheet->columnCount) {
+        row = sheet->rowMap.data[row];
+        column = sheet->columnMap.data[column];
+      }
+      else
+        return FALSE;
+      if (row == -1 || column == -1)
+        return FALSE;
+      code->data[i] = row;
+      code->data[i + 1] = column;
+    }
+  }
+  return TRUE;
+}
+
+Boolean formulaRangeContains(Sheet *sheet, Formula *formula, int row, int column) {
+  for (int pc = 0; pc < formula->code.length; pc += formulaOpLength(formula->code.data[pc])) {
+    if (formula->code.data[pc] != FORMULA_AGGREGATE_RANGE)
+      continue;
+    int *operands = &formula->code.data[pc + 1];
+    if (row >= sheetRowOfPhysicalRow(sheet, operands[0]) && row <= sheetRowOfPhysicalRow(sheet, operands[2]) && column >= sheetColumnOfPhysicalColumn(sheet, operands[1]) && column <= sheetColumnOfPhysicalColumn(sheet, operands[3]))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+// Appends the formulas that read a cell, directly or through a range, to dependents
+void formulaDependents(Sheet *sheet, int physicalRow, int physicalColumn, DynamicIntArray *dependents) {
+  FormulaEngine *engine = &sheet->formulas;
+  int list = cellMapGet(&engine->dependentsAt, cellKey(physicalRow, physicalColumn));
+  if (list != -1) {
+    for (int i = 0; i < engine->dependentLists[list].length; i++) {
+      dynamicIntArrayPush(dependents, engine->dependentLists[list].data[i]);
+    }
+  }
+  if (engine->rangeFormulas.length == 0)
+    return;
+  if (engine->rangeIndexStale)
+    formulaRebuildRangeIndex(sheet);
+  int row = sheetRowOfPhysicalRow(sheet, physicalRow);
+  int column = sheetColumnOfPhysicalColumn(sheet, physicalColumn);
+  if (row == -1 || column == -1)
+    return;
+  int bucket = cellMapGet(&engine->rangeBuckets, cellKey(row >> TILE_SHIFT, column >> TILE_SHIFT));
+  if (bucket == -1)
+    return;
+  DynamicIntArray *candidates = &engine->rangeBucketLists[bucket];
+  for (int i = 0; i < candidates->length; i++) {
+    if (formulaRangeContains(sheet, &engine->formulas[candidates->data[i]], row, column))
+      dynamicIntArrayPush(dependents, candidates->data[i]);
+  }
+}
+
+// Recalculations with fewer dirty formulas than this aren't worth starting threads for
+#define FORMULA_PARALLEL_THRESHOLD 4096
+
+// Work stealing queue of ready formulas. The owning thread pushes and pops at the bottom, other threads steal from the top.
+// Every formula is pushed at most once per recalculation, so capacity never needs to be more than the dirty set.
+typedef struct RecalcQueue {
+  pthread_mutex_t lock;
+  int *items;
+  int top;
+  int bottom;
+} RecalcQueue;
+
+typedef struct RecalcJob {
+  Sheet *sheet;
+  RecalcQueue *queues;
+  int workerCount;
+  int outstanding; // Formulas pushed to a queue and not yet evaluated, the job is done when this reaches 0
+  int evaluated;
+} RecalcJob;
+
+typedef struct RecalcWorker {
+  RecalcJob *job;
+  int index;
+} RecalcWorker;
+
+void recalcQueuePush(RecalcQueue *queue, int formula) {
+  pthread_mutex_lock(&queue->lock);
+  queue->items[queue->bottom++] = formula;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+Boolean recalcQueuePop(RecalcQueue *queue, int *formula) {
+  Boolean found = FALSE;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->bottom > queue->top) {
+    *formula = queue->items[--queue->bottom];
+    found = TRUE;
+  }
+  if (queue->bottom == queue->top)
+    queue->bottom = queue->top = 0;
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+Boolean recalcQueueSteal(RecalcQueue *queue, int *formula) {
+  Boolean found = FALSE;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->bottom > queue->top) {
+    *formula = queue->items[queue->top++];
+    found = TRUE;
+  }
+  if (queue->bottom == queue->top)
+    queue->bottom = queue->top = 0;
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+// Evaluates formulas until every queue is empty and nothing is being evaluated anymore. A formula only becomes ready
+// once all of its precedents are evaluated, and the atomic decrement of pending orders their results before it, so
+// the values come out the same whatever thread evaluates what.
+void *recalcWorkerRun(void *argument) {
+  RecalcWorker *worker = argument;
+  RecalcJob *job = worker->job;
+  FormulaEngine *engine = &job->sheet->formulas;
+  int evaluated = 0;
+  while (__atomic_load_n(&job->outstanding, __ATOMIC_ACQUIRE) > 0) {
+    int id;
+    Boolean found = recalcQueuePop(&job->queues[worker->index], &id);
+    for (int i = 1; i < job->workerCount && !found; i++) {
+      found = recalcQueueSteal(&job->queues[(worker->index + i) % job->workerCount], &id);
+    }
+    if (!found) {
+      sched_yield();
+      continue;
+    }
+    Formula *formula = &engine->formulas[id];
+    formulaEvaluate(job->sheet, formula);
+    evaluated++;
+    for (int j = formula->edgeStart; j < formula->edgeStart + formula->edgeCount; j++) {
+      int dependent = engine->edges.data[j];
+      if (__atomic_sub_fetch(&engine->formulas[dependent].pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_add_fetch(&job->outstanding, 1, __ATOMIC_RELEASE);
+        recalcQueuePush(&job->queues[worker->index], dependent);
+      }
+    }
+    __atomic_sub_fetch(&job->outstanding, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_add_fetch(&job->evaluated, evaluated, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// Evaluates the formulas in engine->ready and everything they unlock on engine->threadCount threads, the calling
+// thread being one of them. Returns how many formulas were evaluated.
+int formulasEvaluateParallel(Sheet *sheet) {
+  FormulaEngine *engine = &sheet->formulas;
+  RecalcJob job = {0};
+  job.sheet = sheet;
+  job.workerCount = engine->threadCount;
+  job.queues = calloc(job.workerCount, sizeof(RecalcQueue));
+  for (int i = 0; i < job.workerCount; i++) {
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+    job.queues[i].items = malloc(sizeof(int) * engine->dirty.length);
+  }
+  for (int i = 0; i < engine->ready.length; i++) {
+    RecalcQueue *queue = &job.queues[i % job.workerCount];
+    queue->items[queue->bottom++] = engine->ready.data[i];
+  }
+  job.outstanding = engine->ready.length;
+
+  RecalcWorker *workers = malloc(sizeof(RecalcWorker) * job.workerCount);
+  pthread_t *threads = malloc(sizeof(pthread_t) * job.workerCount);
+  for (int i = 0; i < job.workerCount; i++) {
+    workers[i].job = &job;
+    workers[i].index = i;
+  }
+  for (int i = 1; i < job.workerCount; i++) {
+    pthread_create(&threads[i], NULL, recalcWorkerRun, &workers[i]);
+  }
+  recalcWorkerRun(&workers[0]);
+  for (int i = 1; i < job.workerCount; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < job.workerCount; i++) {
+    pthread_mutex_destroy(&job.queues[i].lock);
+    free(job.queues[i].items);
+  }
+  free(job.queues);
+  free(workers);
+  free(threads);
+  return job.evaluated;
+}
+
+// Recalculates the given formulas and everything that depends on them, each once, in topological order (Kahn's algorithm).
+// Only the formulas reachable from roots are visited.
+void formulasRecalculate(Sheet *sheet, DynamicIntArray *roots) {
+  int64_t traceStart = traceBegin();
+  FormulaEngine *engine = &sheet->formulas;
+  engine->generation++;
+  engine->dirty.length = 0;
+  engine->edges.length = 0;
+  for (int i = 0; i < roots->length; i++) {
+    Formula *formula = &engine->formulas[roots->data[i]];
+    if (formula->visited != engine->generation) {
+      formula->visited = engine->generation;
+      dynamicIntArrayPush(&engine->dirty, roots->data[i]);
+    }
+  }
+  // Find the dirty set, remembering each formula's dependents as its edges
+  for (int i = 0; i < engine->dirty.length; i++) {
+    Formula *formula = &engine->formulas[engine->dirty.data[i]];
+    formula->pending = 0;
+    formula->edgeStart = engine->edges.length;
+    formulaDependents(sheet, formula->physicalRow, formula->physicalColumn, &engine->edges);
+    formula = &engine->formulas[engine->dirty.data[i]];
+    formula->edgeCount = engine->edges.length - formula->edgeStart;
+    for (int j = formula->edgeStart; j < engine->edges.length; j++) {
+      Formula *dependent = &engine->formulas[engine->edges.data[j]];
+      if (dependent->visited != engine->generation) {
+        dependent->visited = engine->generation;
+        dynamicIntArrayPush(&engine->dirty, engine->edges.data[j]);
+      }
+    }
+  }
+  for (int i = 0; i < engine->edges.length; i++) {
+    engine->formulas[engine->edges.data[i]].pending++;
+  }
+
+  engine->ready.length = 0;
+  for (int i = 0; i < engine->dirty.length; i++) {
+    if (engine->formulas[engine->dirty.data[i]].pending == 0)
+      dynamicIntArrayPush(&engine->ready, engine->dirty.data[i]);
+  }
+  if (engine->threadCount > 1 && engine->dirty.length >= FORMULA_PARALLEL_THRESHOLD) {
+    engine->recalculatedCount = formulasEvaluateParallel(sheet);
+  }
+  else {
+    for (int i = 0; i < engine->ready.length; i++) {
+      Formula *formula = &engine->formulas[engine->ready.data[i]];
+      formulaEvaluate(sheet, formula);
+      for (int j = formula->edgeStart; j < formula->edgeStart + formula->edgeCount; j++) {
+        if (--engine->formulas[engine->edges.data[j]].pending == 0)
+          dynamicIntArrayPush(&engine->ready, engine->edges.data[j]);
+      }
+    }
+    engine->recalculatedCount = engine->ready.length;
+  }
+
+  // Anything that never became ready is in a cycle or depends on one
+  for (int i = 0; i < engine->dirty.length; i++) {
+    Formula *formula = &engine->formulas[engine->dirty.data[i]];
+    if (formula->pending > 0) {
+      formula->error = FORMULA_ERROR_CYCLE;
+      formulaStoreResult(sheet, formula);
+    }
+    sheetCellChanged(sheet, sheetRowOfPhysicalRow(sheet, formula->physicalRow), sheetColumnOfPhysicalColumn(sheet, formula->physicalColumn));
+  }
+  traceEnd("formulasRecalculate", traceStart);
+}
+
+void formulaRemove(Sheet *sheet, int id) {
+  FormulaEngine *engine = &sheet->formulas;
+  Formula *formula = &engine->formulas[id];
+  formulaUnlink(sheet, id);
+  cellMapRemove(&engine->formulaAt, cellKey(formula->physicalRow, formula->physicalColumn));
+  formula->physicalRow = -1;
+  dynamicIntArrayPush(&engine->freeFormulas, id);
+}
+
+int formulaAdd(Sheet *sheet, int physicalRow, int physicalColumn) {
+  FormulaEngine *engine = &sheet->formulas;
+  int id;
+  if (engine->freeFormulas.length) {
+    id = engine->freeFormulas.data[--engine->freeFormulas.length];
+  }
+  else {
+    if (engine->formulaCount == engine->formulaCapacity) {
+      engine->formulaCapacity *= 2;
+      engine->formulas = realloc(engine->formulas, sizeof(Formula) * engine->formulaCapacity);
+    }
+    id = engine->formulaCount++;
+    Formula empty = {0};
+    engine->formulas[id] = empty;
+    engine->formulas[id].code = dynamicIntArrayNew(8);
+  }
+  engine->formulas[id].physicalRow = physicalRow;
+  engine->formulas[id].physicalColumn = physicalColumn;
+  cellMapPut(&engine->formulaAt, cellKey(physicalRow, physicalColumn), id);
+  return id;
+}
+
+// Recalculates every formula, e.g. after loading a sheet
+void formulasRecalculateAll(Sheet *sheet) {
+  FormulaEngine *engine = &sheet->formulas;
+  DynamicIntArray roots = dynamicIntArrayNew(engine->formulaCount + 1);
+  for (int id = 0; id < engine->formulaCount; id++) {
+    if (engine->formulas[id].physicalRow != -1)
+      dynamicIntArrayPush(&roots, id);
+  }
+  formulasRecalculate(sheet, &roots);
+  free(roots.data);
+}
+
+// Called whenever the committed text of a cell changes. Recompiles the cell if it is a formula and recalculates everything downstream of it.
+void formulasCellChanged(Sheet *sheet, int physicalRow, int physicalColumn, String text) {
+  FormulaEngine *engine = &sheet->formulas;
+  engine->recalculatedCount = 0;
+  int id = cellMapGet(&engine->formulaAt, cellKey(physicalRow, physicalColumn));
+  if (id != -1) {
+    formulaRemove(sheet, id);
+    id = -1;
+  }
+  DynamicIntArray roots = dynamicIntArrayNew(8);
+  if (isFormula(text)) {
+    id = formulaAdd(sheet, physicalRow, physicalColumn);
+    formulaCompile(sheet, &engine->formulas[id], text);
+    formulaLink(sheet, id);
+    dynamicIntArrayPush(&roots, id);
+  }
+  else {
+    formulaDependents(sheet, physicalRow, physicalColumn, &roots);
+  }
+  if (roots.length)
+    formulasRecalculate(sheet, &roots);
+  free(roots.data);
+}
+
+// Called before a row (or column) is deleted. Formulas in it are removed and formulas that read from it are collected
+// into roots so they can be recalculated once the row is gone.
+// Called before the rows (or columns) index to index + count - 1 are deleted, while the maps still have them
+void formulasBeforeDelete(Sheet *sheet, Boolean column, int index, int count, DynamicIntArray *roots) {
+  FormulaEngine *engine = &sheet->formulas;
+  for (int id = 0; id < engine->formulaCount; id++) {
+    Formula *formula = &engine->formulas[id];
+    if (formula->physicalRow == -1)
+      continue;
+    int at = column ? sheetColumnOfPhysicalColumn(sheet, formula->physicalColumn) : sheetRowOfPhysicalRow(sheet, formula->physicalRow);
+    if (at >= index && at < index + count) {
+      historySaveFormula(sheet, id);
+      formulaRemove(sheet, id);
+      continue;
+    }
+    Boolean reads = FALSE;
+    Boolean lost = FALSE;
+    for (int pc = 0; pc < formula->code.length; pc += formulaOpLength(formula->code.data[pc])) {
+      int *operands = &formula->code.data[pc + 1];
+      if (formula->code.data[pc] == FORMULA_CELL) {
+        int reference = column ? sheetColumnOfPhysicalColumn(sheet, operands[1]) : sheetRowOfPhysicalRow(sheet, operands[0]);
+        if (reference >= index && reference < index + count)
+          lost = TRUE;
+      }
+      if (formula->code.data[pc] == FORMULA_AGGREGATE_RANGE) {
+        int *startOperand = column ? &operands[1] : &operands[0];
+        int *endOperand = column ? &operands[3] : &operands[2];
+        DynamicIntArray *map = column ? &sheet->columnMap : &sheet->rowMap;
+        int start = column ? sheetColumnOfPhysicalColumn(sheet, *startOperand) : sheetRowOfPhysicalRow(sheet, *startOperand);
+        int end = column ? sheetColumnOfPhysicalColumn(sheet, *endOperand) : sheetRowOfPhysicalRow(sheet, *endOperand);
+        if (end < index || start >= index + count)
+          continue;
+        reads = TRUE;
+        // Ranges shrink when an edge is deleted and only become #REF! once nothing is left of them
+        if (start >= index && end < index + count) {
+          lost = TRUE;
+        }
+        else if (start >= index) {
+          historySaveFormula(sheet, id);
+          *startOperand = map->data[index + count];
+        }
+        else if (end < index + count) {
+          historySaveFormula(sheet, id);
+          *endOperand = map->data[index - 1];
+        }
+      }
+    }
+    if (lost) {
+      historySaveFormula(sheet, id);
+      // Physical rows get reused, so a formula pointing at a deleted one has to forget the reference for good
+      formulaUnlink(sheet, id);
+      formula->code.length = 0;
+      formula->hasRanges = FALSE;
+      formula->error = FORMULA_ERROR_REF;
+    }
+    if (reads || lost)
+      dynamicIntArrayPush(roots, id);
+  }
+  engine->rangeIndexStale = TRUE;
+}
+
+// The text to draw for a cell: the value of formulas, otherwise the cell's text
+String sheetGetCellDisplay(Sheet *sheet, int row, int column) {
+  if (sheet->editing && row == sheet->editRow && column == sheet->editColumn)
+    return gapBufferContents(&sheet->editBuffer);
+  int id = cellMapGet(&sheet->formulas.formulaAt, cellKey(sheet->rowMap.data[row], sheet->columnMap.data[column]));
+  if (id == -1)
+    return sheetGetCell(sheet, row, column);
+  String string = {0};
+  string.value = sheet->formulas.formulas[id].display;
+  string.length = strlen(string.value);
+  return string;
+}
+
+
+
+//******************************************//
+//               Sheet Editing              //
+//******************************************//
+
+
+// Move the scroll origin just enough for the selected cell to be fully on screen
+void sheetScrollToSelection(Sheet *sheet) {
+  int row = sheet->selectedRow;
+  int column = sheet->selectedColumn;
+  // A partly scrolled off row or column is brought fully back on screen when it's selected
+  if (row <= sheet->scrollRow) {
+    sheet->scrollRow = row;
+    sheet->scrollRowPixels = 0;
+  }
+  if (row >= sheet->scrollRow + sheet->visibleRowCount) {
+    sheet->scrollRow = row - sheet->visibleRowCount + 1;
+    sheet->scrollRowPixels = 0;
+  }
+  if (column <= sheet->scrollColumn) {
+    sheet->scrollColumn = column;
+    sheet->scrollColumnPixels = 0;
+  }
+  if (column >= sheet->scrollColumn + sheet->visibleColumnCount) {
+    sheet->scrollColumn = column - sheet->visibleColumnCount + 1;
+    sheet->scrollColumnPixels = 0;
+  }
+  sheet->scrollRow = clamp(sheet->scrollRow, 0, sheet->rowCount - 1);
+  sheet->scrollColumn = clamp(sheet->scrollColumn, 0, sheet->columnCount - 1);
+}
+
+// Scrolls so the selected cell is fully inside a viewport of width x height pixels, and works out how many rows and
+// columns from the scroll origin fit in it completely. sheetScrollToSelection uses those counts in between frames.
+void sheetUpdateViewport(Sheet *sheet, int width, int height, int charWidth, int lineHeight) {
+  if (sheet->selectedRow < sheet->scrollRow || (sheet->selectedRow == sheet->scrollRow && sheet->scrollRowPixels)) {
+    sheet->scrollRow = sheet->selectedRow;
+    sheet->scrollRowPixels = 0;
+  }
+  sheet->scrollRowPixels = clamp(sheet->scrollRowPixels, 0, sheetRowHeight(sheet, sheet->scrollRow, lineHeight) - 1);
+  int64_t bottom = sheetRowOffset(sheet, sheet->selectedRow + 1, lineHeight);
+  if (bottom - sheetRowOffset(sheet, sheet->scrollRow, lineHeight) - sheet->scrollRowPixels > height) {
+    // The first row that leaves room for the selected one below it
+    int row = sheetRowAtOffset(sheet, bottom - height, lineHeight);
+    if (sheetRowOffset(sheet, row, lineHeight) < bottom - height)
+      row++;
+    sheet->scrollRow = clamp(row, 0, sheet->selectedRow);
+    sheet->scrollRowPixels = 0;
+  }
+  if (sheet->selectedColumn < sheet->scrollColumn || (sheet->selectedColumn == sheet->scrollColumn && sheet->scrollColumnPixels)) {
+    sheet->scrollColumn = sheet->selectedColumn;
+    sheet->scrollColumnPixels = 0;
+  }
+  sheet->scrollColumnPixels = clamp(sheet->scrollColumnPixels, 0, sheetColumnWidth(sheet, sheet->scrollColumn, charWidth) - 1);
+  int64_t right = sheetColumnOffset(sheet, sheet->selectedColumn + 1, charWidth);
+  if (right - sheetColumnOffset(sheet, sheet->scrollColumn, charWidth) - sheet->scrollColumnPixels > width) {
+    int column = sheetColumnAtOffset(sheet, right - width, charWidth);
+    if (sheetColumnOffset(sheet, column, charWidth) < right - width)
+      column++;
+    sheet->scrollColumn = clamp(column, 0, sheet->selectedColumn);
+    sheet->scrollColumnPixels = 0;
+  }
+
+  int64_t top = sheetRowOffset(sheet, sheet->scrollRow, lineHeight) + sheet->scrollRowPixels;
+  int row = sheetRowAtOffset(sheet, top + height, lineHeight);
+  if (sheetRowOffset(sheet, row + 1, lineHeight) > top + height)
+    row--;
+  sheet->visibleRowCount = clamp(row - sheet->scrollRow + 1, 1, INT_MAX);
+  int64_t left = sheetColumnOffset(sheet, sheet->scrollColumn, charWidth) + sheet->scrollColumnPixels;
+  int column = sheetColumnAtOffset(sheet, left + width, charWidth);
+  if (sheetColumnOffset(sheet, column + 1, charWidth) > left + width)
+    column--;
+  sheet->visibleColumnCount = clamp(column - sheet->scrollColumn + 1, 1, INT_MAX);
+}
+
+// Scrolls the view by x, y pixels, as far as the ends of the sheet, for the mouse wheel and trackpads. The view is
+// width x height pixels like in sheetUpdateViewport. The selection is moved along to stay on the rows and columns fully
+// on screen, the way scrolling in vim drags the cursor along, so the next frame's sheetUpdateViewport keeps the view.
+void sheetScrollByPixels(Sheet *sheet, int x, int y, int width, int height, int charWidth, int lineHeight) {
+  if (y) {
+    int64_t top = sheetRowOffset(sheet, sheet->scrollRow, lineHeight) + sheet->scrollRowPixels + y;
+    int64_t maxTop = sheetRowOffset(sheet, sheet->rowCount, lineHeight) - height;
+    top = top > maxTop ? maxTop : top;
+    top = top < 0 ? 0 : top;
+    sheet->scrollRow = sheetRowAtOffset(sheet, top, lineHeight);
+    sheet->scrollRowPixels = top - sheetRowOffset(sheet, sheet->scrollRow, lineHeight);
+    int firstRow = sheet->scrollRow + (sheet->scrollRowPixels > 0);
+    int lastRow = sheetRowAtOffset(sheet, top + height, lineHeight);
+    if (sheetRowOffset(sheet, lastRow + 1, lineHeight) > top + height)
+      lastRow--;
+    if (firstRow <= lastRow)
+      sheet->selectedRow = clamp(sheet->selectedRow, firstRow, lastRow);
+  }
+  if (x) {
+    int64_t left = sheetColumnOffset(sheet, sheet->scrollColumn, charWidth) + sheet->scrollColumnPixels + x;
+    int64_t maxLeft = sheetColumnOffset(sheet, sheet->columnCount, charWidth) - width;
+    left = left > maxLeft ? maxLeft : left;
+    left = left < 0 ? 0 : left;
+    sheet->scrollColumn = sheetColumnAtOffset(sheet, left, charWidth);
+    sheet->scrollColumnPixels = left - sheetColumnOffset(sheet, sheet->scrollColumn, charWidth);
+    int firstColumn = sheet->scrollColumn + (sheet->scrollColumnPixels > 0);
+    int lastColumn = sheetColumnAtOffset(sheet, left + width, charWidth);
+    if (sheetColumnOffset(sheet, lastColumn + 1, charWidth) > left + width)
+      lastColumn--;
+    if (firstColumn <= lastColumn)
+      sheet->selectedColumn = clamp(sheet->selectedColumn, firstColumn, lastColumn);
+  }
+}
+
+// Physical rows and columns of deleted rows and columns are reused before new ones are handed out
+int sheetNewPhysicalRow(Sheet *sheet) {
+  if (sheet->freePhysicalRows.length)
+    return sheet->freePhysicalRows.data[--sheet->freePhysicalRows.length];
+  dynamicIntArrayPush(&sheet->rowOfPhysicalRow, -1);
+  return sheet->physicalRowCount++;
+}
+
+int sheetNewPhysicalColumn(Sheet *sheet) {
+  if (sheet->freePhysicalColumns.length)
+    return sheet->freePhysicalColumns.data[--sheet->freePhysicalColumns.length];
+  dynamicIntArrayPush(&sheet->columnOfPhysicalColumn, -1);
+  return sheet->physicalColumnCount++;
+}
+
+// Brings rowOfPhysicalRow up to date for the rows from `row` on, after rowMap was shifted there
+void sheetReindexRows(Sheet *sheet, int row) {
+  for (int i = row; i < sheet->rowCount; i++) {
+    sheet->rowOfPhysicalRow.data[sheet->rowMap.data[i]] = i;
+  }
+}
+
+void sheetReindexColumns(Sheet *sheet, int column) {
+  for (int i = column; i < sheet->columnCount; i++) {
+    sheet->columnOfPhysicalColumn.data[sheet->columnMap.data[i]] = i;
+  }
+}
+
+// Inserts count empty rows before `row`. O(rows + count): no cells are moved, and rowMap and cellHeights are shifted
+// along once for all of the new rows.
+// Undo puts deleted rows back with the physical rows and heights they had, otherwise physicals and heights are NULL for
+// new rows of the default height.
+void sheetInsertRows(Sheet *sheet, int row, int count, int *physicals, int *heights) {
+  journalRecord(sheet->journal, JOURNAL_INSERT_ROW, row, 0, count, NULL, 0);
+  dynamicIntArrayInsertRepeated(&sheet->cellHeights, TEMP_CELL_HEIGHT, row, count);
+  sizeIndexInvalidate(&sheet->rowIndex, row);
+  dynamicIntArrayInsertRepeated(&sheet->rowMap, 0, row, count);
+  for (int i = 0; i < count; i++) {
+    if (physicals)
+      dynamicIntArrayRemoveValue(&sheet->freePhysicalRows, physicals[i]);
+    sheet->rowMap.data[row + i] = physicals ? physicals[i] : sheetNewPhysicalRow(sheet);
+    if (heights && heights[i] != TEMP_CELL_HEIGHT) {
+      journalRecord(sheet->journal, JOURNAL_SET_ROW_HEIGHT, row + i, 0, heights[i], NULL, 0);
+      sheet->cellHeights.data[row + i] = heights[i];
+    }
+  }
+  sheet->rowCount += count;
+  sheetReindexRows(sheet, row);
+  historyRecordOperation(sheet, JOURNAL_INSERT_ROW, row, count, &sheet->rowMap.data[row], &sheet->cellHeights.data[row]);
+  sheet->formulas.rangeIndexStale = TRUE;
+  sheet->structureChanged = TRUE;
+}
+
+// O(columns + count), the same way as sheetInsertRows
+void sheetInsertColumns(Sheet *sheet, int column, int count, int *physicals, int *widths) {
+  journalRecord(sheet->journal, JOURNAL_INSERT_COLUMN, 0, column, count, NULL, 0);
+  dynamicIntArrayInsertRepeated(&sheet->cellWidths, TEMP_CELL_WIDTH, column, count);
+  sizeIndexInvalidate(&sheet->columnIndex, column);
+  dynamicIntArrayInsertRepeated(&sheet->columnMap, 0, column, count);
+  for (int i = 0; i < count; i++) {
+    if (physicals)
+      dynamicIntArrayRemoveValue(&sheet->freePhysicalColumns, physicals[i]);
+    sheet->columnMap.data[column + i] = physicals ? physicals[i] : sheetNewPhysicalColumn(sheet);
+    if (widths && widths[i] != TEMP_CELL_WIDTH) {
+      journalRecord(sheet->journal, JOURNAL_SET_COLUMN_WIDTH, 0, column + i, widths[i], NULL, 0);
+      sheet->cellWidths.data[column + i] = widths[i];
+    }
+  }
+  sheet->columnCount += count;
+  sheetReindexColumns(sheet, column);
+  historyRecordOperation(sheet, JOURNAL_INSERT_COLUMN, column, count, &sheet->columnMap.data[column], &sheet->cellWidths.data[column]);
+  sheet->formulas.rangeIndexStale = TRUE;
+  sheet->structureChanged = TRUE;
+}
+
+void sheetAppendRows(Sheet *sheet, int row, int count) {
+  sheetInsertRows(sheet, row, count, NULL, NULL);
+}
+
+void sheetAppendColumns(Sheet *sheet, int column, int count) {
+  sheetInsertColumns(sheet, column, count, NULL, NULL);
+}
+
+void sheetAppendRow(Sheet *sheet, int row) {
+  sheetAppendRows(sheet, row, 1);
+}
+
+void sheetAppendColumn(Sheet *sheet, int column) {
+  sheetAppendColumns(sheet, column, 1);
+}
+
+// Sizes are in lines and characters. O(log rows) or O(log columns), however many rows and columns have their own sizes.
+void sheetSetRowHeight(Sheet *sheet, int row, int lines) {
+  lines = clamp(lines, 1, 1000);
+  journalRecord(sheet->journal, JOURNAL_SET_ROW_HEIGHT, row, 0, lines, NULL, 0);
+  historyRecordOperation(sheet, JOURNAL_SET_ROW_HEIGHT, row, 1, NULL, &sheet->cellHeights.data[row]);
+  sizeIndexAdd(&sheet->rowIndex, row, lines - sheet->cellHeights.data[row]);
+  sheet->cellHeights.data[row] = lines;
+  sheet->structureChanged = TRUE;
+}
+
+void sheetSetColumnWidth(Sheet *sheet, int column, int characters) {
+  characters = clamp(characters, 1, 1000);
+  journalRecord(sheet->journal, JOURNAL_SET_COLUMN_WIDTH, 0, column, characters, NULL, 0);
+  historyRecordOperation(sheet, JOURNAL_SET_COLUMN_WIDTH, column, 1, NULL, &sheet->cellWidths.data[column]);
+  sizeIndexAdd(&sheet->columnIndex, column, characters - sheet->cellWidths.data[column]);
+  sheet->cellWidths.data[column] = characters;
+  sheet->structureChanged = TRUE;
+}
+
+// Deletes count rows from `row` on, always leaving at least one row. O(rows + formulas + count * columns / TILE_SIZE):
+// the deleted rows' cells are emptied tile by tile along each row, and the maps are shifted and formulas fixed up once
+// for all of them.
+void sheetDeleteRows(Sheet *sheet, int row, int count) {
+  count = clamp(count, 0, sheet->rowCount - row);
+  if (count == sheet->rowCount)
+    count--;
+  if (count <= 0)
+    return;
+  journalRecord(sheet->journal, JOURNAL_DELETE_ROW, row, 0, count, NULL, 0);
+  historyRecordOperation(sheet, JOURNAL_DELETE_ROW, row, count, &sheet->rowMap.data[row], &sheet->cellHeights.data[row]);
+  DynamicIntArray roots = dynamicIntArrayNew(8);
+  formulasBeforeDelete(sheet, FALSE, row, count, &roots);
+  for (int i = row; i < row + count; i++) {
+    int physicalRow = sheet->rowMap.data[i];
+    historySaveRow(sheet, physicalRow);
+    tileStoreClearRow(&sheet->cells, &sheet->textArena, physicalRow, sheet->physicalColumnCount);
+    for (int j = 0; j < sheet->laneCount; j++) {
+      laneClearRow(&sheet->lanes[j], physicalRow);
+    }
+    dynamicIntArrayPush(&sheet->freePhysicalRows, physicalRow);
+    sheet->rowOfPhysicalRow.data[physicalRow] = -1;
+  }
+  dynamicIntArrayRemoveRange(&sheet->rowMap, row, count);
+  dynamicIntArrayRemoveRange(&sheet->cellHeights, row, count);
+  sizeIndexInvalidate(&sheet->rowIndex, row);
+  sheet->rowCount -= count;
+  sheetReindexRows(sheet, row);
+  sheet->selectedRow = clamp(sheet->selectedRow, 0, sheet->rowCount - 1);
+  sheet->structureChanged = TRUE;
+  if (roots.length)
+    formulasRecalculate(sheet, &roots);
+  free(roots.data);
+}
+
+// O(columns + formulas + count * rows / TILE_SIZE), the same way as sheetDeleteRows
+void sheetDeleteColumns(Sheet *sheet, int column, int count) {
+  count = clamp(count, 0, sheet->columnCount - column);
+  if (count == sheet->columnCount)
+    count--;
+  if (count <= 0)
+    return;
+  journalRecord(sheet->journal, JOURNAL_DELETE_COLUMN, 0, column, count, NULL, 0);
+  historyRecordOperation(sheet, JOURNAL_DELETE_COLUMN, column, count, &sheet->columnMap.data[column], &sheet->cellWidths.data[column]);
+  DynamicIntArray roots = dynamicIntArrayNew(8);
+  formulasBeforeDelete(sheet, TRUE, column, count, &roots);
+  for (int i = column; i < column + count; i++) {
+    int physicalColumn = sheet->columnMap.data[i];
+    historySaveColumn(sheet, physicalColumn);
+    tileStoreClearColumn(&sheet->cells, &sheet->textArena, physicalColumn, sheet->physicalRowCount);
+    if (sheetGetLane(sheet, physicalColumn))
+      laneFree(sheetGetLane(sheet, physicalColumn));
+    dynamicIntArrayPush(&sheet->freePhysicalColumns, physicalColumn);
+    sheet->columnOfPhysicalColumn.data[physicalColumn] = -1;
+  }
+  dynamicIntArrayRemoveRange(&sheet->columnMap, column, count);
+  dynamicIntArrayRemoveRange(&sheet->cellWidths, column, count);
+  sizeIndexInvalidate(&sheet->columnIndex, column);
+  sheet->columnCount -= count;
+  sheetReindexColumns(sheet, column);
+  sheet->selectedColumn = clamp(sheet->selectedColumn, 0, sheet->columnCount - 1);
+  sheet->structureChanged = TRUE;
+  if (roots.length)
+    formulasRecalculate(sheet, &roots);
+  free(roots.data);
+}
+
+void sheetDeleteRow(Sheet *sheet, int row) {
+  sheetDeleteRows(sheet, row, 1);
+}
+
+void sheetDeleteColumn(Sheet *sheet, int column) {
+  sheetDeleteColumns(sheet, column, 1);
+}
+
+// Replaces the text of a cell with a copy of string, freeing the old text
+void sheetCommitCell(Sheet *sheet, int row, int column, String string) {
+  journalRecord(sheet->journal, JOURNAL_SET_CELL, row, column, 0, string.value, string.length);
+  historySaveCell(sheet, sheet->rowMap.data[row], sheet->columnMap.data[column]);
+  int formula = cellMapGet(&sheet->formulas.formulaAt, cellKey(sheet->rowMap.data[row], sheet->columnMap.data[column]));
+  if (formula != -1)
+    historySaveFormula(sheet, formula);
+  String old = tileStoreGet(&sheet->cells, sheet->rowMap.data[row], sheet->columnMap.data[column]);
+  String copy = textArenaCopy(&sheet->textArena, string.value, string.length);
+  sheetSetCell(sheet, row, column, copy);
+  textArenaFree(&sheet->textArena, old.value, old.length);
+  sheetUpdateLane(sheet, sheet->rowMap.data[row], sheet->columnMap.data[column], copy);
+  formulasCellChanged(sheet, sheet->rowMap.data[row], sheet->columnMap.data[column], copy);
+}
+
+void sheetBeginEdit(Sheet *sheet, int row, int column) {
+  journalRecord(sheet->journal, JOURNAL_BEGIN_EDIT, row, column, 0, NULL, 0);
+  gapBufferSet(&sheet->editBuffer, sheetGetCell(sheet, row, column));
+  sheet->editing = TRUE;
+  sheet->editRow = row;
+  sheet->editColumn = column;
+  sheetCellChanged(sheet, row, column); // Formulas show their text instead of their value while being edited
+}
+
+void sheetEndEdit(Sheet *sheet) {
+  if (!sheet->editing)
+    return;
+  sheet->editing = FALSE;
+  sheetCommitCell(sheet, sheet->editRow, sheet->editColumn, gapBufferContents(&sheet->editBuffer));
+  sheetCellChanged(sheet, sheet->editRow, sheet->editColumn);
+}
+
+Boolean sheetIsEditing(Sheet *sheet, int row, int column) {
+  return sheet->editing && row == sheet->editRow && column == sheet->editColumn;
+}
+
+void sheetCellBackSpace(Sheet *sheet, int row, int column, int stringIndex) {
+  String string = sheetGetCell(sheet, row, column);
+  if (stringIndex < 0 || stringIndex >= string.length)
+    return;
+  if (sheetIsEditing(sheet, row, column)) {
+    journalRecord(sheet->journal, JOURNAL_EDIT_BACKSPACE, row, column, stringIndex, NULL, 0);
+    gapBufferDelete(&sheet->editBuffer, stringIndex);
+  }
+  else {
+    // Not being edited, so build the new text in the edit buffer and commit it straight away
+    gapBufferSet(&sheet->editBuffer, string);
+    gapBufferDelete(&sheet->editBuffer, stringIndex);
+    sheetCommitCell(sheet, row, column, gapBufferContents(&sheet->editBuffer));
+  }
+  sheetCellChanged(sheet, row, column);
+}
+
+void sheetCellAppend(Sheet *sheet, int row, int column, char* valueToInsert, int valueToInsertLength) {
+  if (sheetIsEditing(sheet, row, column)) {
+    journalRecord(sheet->journal, JOURNAL_EDIT_APPEND, row, column, 0, valueToInsert, valueToInsertLength);
+    gapBufferInsert(&sheet->editBuffer, gapBufferLength(&sheet->editBuffer), valueToInsert, valueToInsertLength);
+  }
+  else {
+    gapBufferSet(&sheet->editBuffer, sheetGetCell(sheet, row, column));
+    gapBufferInsert(&sheet->editBuffer, gapBufferLength(&sheet->editBuffer), valueToInsert, valueToInsertLength);
+    sheetCommitCell(sheet, row, column, gapBufferContents(&sheet->editBuffer));
+  }
+  sheetCellChanged(sheet, row, column);
+}
+
+
+// Commands can be given a count first, like 5000o or 50j, which does them count times over. Inserts are done as one
+// batch however big the count is.
+char handleNormalModeInput(Sheet *sheet, char charKeyPressed, Boolean useRecordedCommand, char lastCharKeyPressed, String text) {
+  if ((charKeyPressed >= '1' && charKeyPressed <= '9') || (charKeyPressed == '0' && sheet->count)) {
+    sheet->count = clamp(sheet->count * 10 + charKeyPressed - '0', 0, SHEET_MAX_COUNT);
+    return lastCharKeyPressed;
+  }
+  Boolean counted = sheet->count > 0;
+  int count = counted ? sheet->count : 1;
+  sheet->count = 0;
+  // Each command is a step of its own to undo. Text typed in insert mode goes in with the command that started it.
+  historyCheckpoint(sheet);
+  // The importer relies on rows and columns staying where they are until it is done
+  if (sheet->importing && charKeyPressed != 'h' && charKeyPressed != 'j' && charKeyPressed != 'k' && charKeyPressed != 'l')
+    return lastCharKeyPressed;
+  switch (charKeyPressed) {
+    case 'h': {
+      sheet->selectedColumn = clamp(sheet->selectedColumn - count, 0, sheet->columnCount - 1);
+      break;
+    }
+    case 'j': {
+      sheet->selectedRow = clamp(sheet->selectedRow + count, 0, sheet->rowCount - 1);
+      break;
+    }
+    case 'k': {
+      sheet->selectedRow = clamp(sheet->selectedRow - count, 0, sheet->rowCount - 1);
+      break;
+    }
+    case 'l': {
+      sheet->selectedColumn = clamp(sheet->selectedColumn + count, 0, sheet->columnCount - 1);
+      break;
+    }
+    case 'i': {
+      if (useRecordedCommand && text.length) {
+        for (int i = 0; i < count; i++)
+          sheetCellAppend(sheet, sheet->selectedRow, sheet->selectedColumn, text.value, text.length);
+      }
+      else {
+        sheet->insertMode = TRUE;
+        sheetBeginEdit(sheet, sheet->selectedRow, sheet->selectedColumn);
+      }
+      lastCharKeyPressed = 'i';
+      // INSERT MODE AT THE START OF THE STRING. Maybe ii does this, i puts you in "normal text mode" as opposed to "normal sheet mode"
+      break;
+    }
+    /* case 'I': { */
+    /*   sheet->insertMode = TRUE; */
+    /*   // INSERT MODE AT THE END OF THE STRING */
+    /*   break; */
+    /* } */
+    case 'a': {
+      // Selects the last of the new columns
+      sheetAppendColumns(sheet, sheet->selectedColumn + 1, count);
+      sheet->selectedColumn += count;
+      lastCharKeyPressed = 'a';
+      break;
+    }
+    case 'A': {
+      // INSERT NEW COLUMN
+      sheetAppendColumns(sheet, sheet->selectedColumn, count);
+      lastCharKeyPressed = 'A';
+      break;
+    }
+    case 'o': {
+      sheetAppendRows(sheet, sheet->selectedRow + 1, count);
+      sheet->selectedRow += count;
+      lastCharKeyPressed = 'o';
+      break;
+    }
+    case 'O': {
+      sheetAppendRows(sheet, sheet->selectedRow, count);
+      lastCharKeyPressed = 'O';
+      break;
+    }
+    case 'd': {
+      sheetDeleteRows(sheet, sheet->selectedRow, count);
+      lastCharKeyPressed = 'd';
+      break;
+    }
+    case 'D': {
+      sheetDeleteColumns(sheet, sheet->selectedColumn, count);
+      lastCharKeyPressed = 'D';
+      break;
+    }
+    case 'u': {
+      for (int i = 0; i < count && historyUndo(sheet); i++);
+      break;
+    }
+    case KEY_CONTROL('r'): {
+      for (int i = 0; i < count && historyRedo(sheet); i++);
+      break;
+    }
+    case '=': {
+      sheetSetRowHeight(sheet, sheet->selectedRow, sheet->cellHeights.data[sheet->selectedRow] + count);
+      lastCharKeyPressed = '=';
+      break;
+    }
+    case '-': {
+      sheetSetRowHeight(sheet, sheet->selectedRow, sheet->cellHeights.data[sheet->selectedRow] - count);
+      lastCharKeyPressed = '-';
+      break;
+    }
+    case ']': {
+      sheetSetColumnWidth(sheet, sheet->selectedColumn, sheet->cellWidths.data[sheet->selectedColumn] + count);
+      lastCharKeyPressed = ']';
+      break;
+    }
+    case '[': {
+      sheetSetColumnWidth(sheet, sheet->selectedColumn, sheet->cellWidths.data[sheet->selectedColumn] - count);
+      lastCharKeyPressed = '[';
+      break;
+    }
+    case 'w': {
+      if (!workbookSave(sheet, sheet->path))
+        printf("couldn't save %s\n", sheet->path);
+      break;
+    }
+    case '.': { // TODO
+      // Repeats with the count the command was given, unless . was given one of its own
+      sheet->count = counted ? count : sheet->lastCount;
+      handleNormalModeInput(sheet, lastCharKeyPressed, TRUE, 0, text);
+      break;
+    }
+    /* case '$': { // TODO */
+    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
+    /*   break; */
+    /* } */
+    /* case 'e': { // TODO */
+    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
+    /*   break; */
+    /* } */
+    /* case 'Input.CTRL_E': { // TODO */
+    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
+    /*   break; */
+    /* } */
+    /* case 'y???': { // TODO */
+    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
+    /*   break; */
+    /* } */
+    /* case 'Input.CTRL_Y': { // TODO */
+    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
+    /*   break; */
+    /* } */
+  }
+  // Only the commands . can repeat set lastCharKeyPressed
+  if (lastCharKeyPressed == charKeyPressed)
+    sheet->lastCount = count;
+  // Moving with the keyboard drops back to selecting just the selected cell
+  sheet->anchorRow = -1;
+  sheet->anchorColumn = -1;
+  sheetScrollToSelection(sheet);
+  return lastCharKeyPressed;
+}
+
+
+
+//******************************************//
+//               CSV Import                 //
+//******************************************//
+
+// The file is mmapped privately and cells point straight into the mapping, so fields are never copied or malloced.
+// Quoted fields with "" escapes are unescaped in place, which only dirties the pages they are on.
+// The file is cut into chunks that are parsed on their own threads into staging tile stores and lanes. Staging tiles are
+// handed over to the sheet whole once a chunk is done, only the tiles shared with a neighbouring chunk are merged cell by cell.
+// To parse chunks independently each one needs to know whether it starts inside quotes and which row its first record
+// goes to, so a first parallel pass counts the quotes and newlines in every chunk.
+#define CSV_FIRST_CHUNK_SIZE (256 * 1024) // Small so the first screen of rows shows up straight away
+#define CSV_CHUNK_SIZE (16 * 1024 * 1024)
+
+// Appends a cell after all the cells already in the tile, which is how the importer fills tiles. filledBeforeRow is left
+// stale until tileRebuildCounts.
+void tileAppendCell(Tile *tile, int row, int column, String string) {
+  if (tile->filledCellCount == tile->capacity) {
+    tile->capacity = tile->capacity ? tile->capacity * 2 : 4;
+    tile->cells = realloc(tile->cells, sizeof(String) * tile->capacity);
+  }
+  tile->cells[tile->filledCellCount++] = string;
+  tile->occupied[row] |= ((uint64_t)1) << column;
+}
+
+void tileRebuildCounts(Tile *tile) {
+  int filled = 0;
+  for (int row = 0; row < TILE_SIZE; row++) {
+    tile->filledBeforeRow[row] = filled;
+    filled += __builtin_popcountll(tile->occupied[row]);
+  }
+}
+
+// Moves every tile of source into store. Tiles store already has are merged cell by cell, which is only expected where
+// the two never both filled the same cell.
+void tileStoreMerge(TileStore *store, TileStore *source) {
+  for (int i = 0; i < source->capacity; i++) {
+    Tile *tile = source->tiles[i];
+    if (!tile)
+      continue;
+    Tile *existing = tileStoreGetTile(store, tile->tileRow, tile->tileColumn);
+    if (existing) {
+      for (int row = 0; row < TILE_SIZE; row++) {
+        for (int column = 0; column < TILE_SIZE; column++) {
+          if (tileCellFilled(tile, row, column))
+            tileSetCell(existing, row, column, tile->cells[tileCellIndex(tile, row, column)]);
+        }
+      }
+      tileFree(tile);
+      continue;
+    }
+    tileStoreInsert(store, tile);
+  }
+  free(source->tiles);
+  source->tiles = NULL;
+  source->tileCount = 0;
+}
+
+void laneMerge(NumberLane *lane, NumberLane *source) {
+  for (int i = 0; i < source->blockCount; i++) {
+    LaneBlock *block = source->blocks[i];
+    if (!block)
+      continue;
+    LaneBlock *existing = laneGetBlock(lane, i << LANE_BLOCK_SHIFT);
+    if (!existing) {
+      laneGetOrCreateBlock(lane, i << LANE_BLOCK_SHIFT);
+      free(lane->blocks[i]);
+      lane->blocks[i] = block;
+      continue;
+    }
+    for (int word = 0; word < LANE_BLOCK_SIZE / 64; word++) {
+      for (uint64_t bits = block->numeric[word]; bits; bits &= bits - 1) {
+        int row = (word << 6) + __builtin_ctzll(bits);
+        existing->values[row] = block->values[row];
+      }
+      existing->numeric[word] |= block->numeric[word];
+      existing->failed[word] |= block->failed[word];
+    }
+    free(block);
+  }
+  free(source->blocks);
+  source->blocks = NULL;
+  source->blockCount = 0;
+}
+
+// Has to see the file as it was: unescaping moves quotes around, so a chunk is always counted before the chunk ahead of
+// it could parse a record that runs into it
+void csvChunkCount(CsvChunk *chunk) {
+  int parity = 0;
+  char *p = chunk->start;
+#ifdef __SSE2__
+  // 64 bytes at a time. A prefix xor over the quote bits says which bytes are inside quotes, so the newlines can be
+  // counted without looking at the bytes one by one.
+  __m128i quote = _mm_set1_epi8('"');
+  __m128i newline = _mm_set1_epi8('\n');
+  for (; p + 64 <= chunk->end; p += 64) {
+    uint64_t quotes = 0;
+    uint64_t newlines = 0;
+    for (int i = 0; i < 4; i++) {
+      __m128i bytes = _mm_loadu_si128((__m128i *)(p + i * 16));
+      quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, quote)) << (i * 16);
+      newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (i * 16);
+    }
+    uint64_t inside = quotes;
+    for (int shift = 1; shift < 64; shift *= 2)
+      inside ^= inside << shift;
+    if (parity)
+      inside = ~inside;
+    uint64_t byParity[2] = {newlines & ~inside, newlines & inside};
+    for (int i = 0; i < 2; i++) {
+      if (byParity[i] && chunk->newlineCounts[i] == 0)
+        chunk->firstRecords[i] = p + __builtin_ctzll(byParity[i]) + 1;
+      chunk->newlineCounts[i] += __builtin_popcountll(byParity[i]);
+    }
+    parity ^= __builtin_popcountll(quotes) & 1;
+  }
+#endif
+  for (; p < chunk->end; p++) {
+    if (*p == '"') {
+      parity ^= 1;
+    }
+    else if (*p == '\n') {
+      if (chunk->newlineCounts[parity]++ == 0)
+        chunk->firstRecords[parity] = p + 1;
+    }
+  }
+  chunk->quoteParity = parity;
+}
+
+NumberLane *csvChunkLane(CsvChunk *chunk, int column) {
+  if (column >= chunk->laneCount) {
+    int laneCount = chunk->laneCount ? chunk->laneCount : 8;
+    while (laneCount <= column)
+      laneCount *= 2;
+    chunk->lanes = realloc(chunk->lanes, sizeof(NumberLane) * laneCount);
+    memset(chunk->lanes + chunk->laneCount, 0, sizeof(NumberLane) * (laneCount - chunk->laneCount));
+    chunk->laneCount = laneCount;
+  }
+  return &chunk->lanes[column];
+}
+
+void csvChunkParse(CsvImport *import, CsvChunk *chunk) {
+  char *fileEnd = import->data + import->size;
+  char *p = chunk->start;
+  chunk->cells = tileStoreNew(64);
+  chunk->formulaCells = dynamicIntArrayNew(16);
+  if (chunk != &import->chunks[0]) {
+    // Skip the tail of the record that started in the chunk before, which that chunk's thread may be unescaping right now
+    p = chunk->firstRecords[chunk->startsQuoted ? 1 : 0];
+    if (!p || p == fileEnd)
+      return;
+  }
+
+  int row = chunk->firstRow;
+  while (TRUE) {
+    int column = 0;
+    while (TRUE) {
+      String field = {0};
+      if (p < fileEnd && *p == '"') {
+        char *read = p + 1;
+        char *write = p + 1;
+        field.value = write;
+        while (read < fileEnd) {
+          if (*read == '"') {
+            if (read + 1 < fileEnd && read[1] == '"') {
+              *write++ = '"';
+              read += 2;
+              continue;
+            }
+            read++;
+            break;
+          }
+          // Only write when an escape has shifted things, so pages without escapes stay clean
+          if (write != read)
+            *write = *read;
+          write++;
+          read++;
+        }
+        field.length = write - field.value;
+        p = read;
+        while (p < fileEnd && *p != ',' && *p != '\n')
+          p++;
+      }
+      else {
+        field.value = p;
+        while (p < fileEnd && *p != ',' && *p != '\n')
+          p++;
+        field.length = p - field.value;
+        if (field.length && field.value[field.length - 1] == '\r' && (p == fileEnd || *p == '\n'))
+          field.length--;
+      }
+
+      if (field.length) {
+        tileAppendCell(tileStoreGetOrCreateTile(&chunk->cells, row >> TILE_SHIFT, column >> TILE_SHIFT), row & (TILE_SIZE - 1), column & (TILE_SIZE - 1), field);
+        double value;
+        if (isFormula(field)) {
+          dynamicIntArrayPush(&chunk->formulaCells, row);
+          dynamicIntArrayPush(&chunk->formulaCells, column);
+        }
+        else if (parseNumber(field, &value)) {
+          // The staging lanes are the thread's own, so no need for laneBlockSet's atomics
+          LaneBlock *block = laneGetOrCreateBlock(csvChunkLane(chunk, column), row);
+          block->values[row & (LANE_BLOCK_SIZE - 1)] = value;
+          block->numeric[(row & (LANE_BLOCK_SIZE - 1)) >> 6] |= ((uint64_t)1) << (row & 63);
+        }
+      }
+      column++;
+      if (p >= fileEnd || *p == '\n')
+        break;
+      p++;
+    }
+    if (column > chunk->columnCount)
+      chunk->columnCount = column;
+    row++;
+    // p is on the newline ending the record. The next record is ours if that newline is inside the chunk.
+    if (p >= chunk->end || p + 1 >= fileEnd)
+      break;
+    p++;
+  }
+  chunk->recordCount = row - chunk->firstRow;
+
+  for (int i = 0; i < chunk->cells.capacity; i++) {
+    if (chunk->cells.tiles[i])
+      tileRebuildCounts(chunk->cells.tiles[i]);
+  }
+}
+
+void csvImportWake(CsvImport *import) {
+  char byte = 0;
+  if (write(import->wakePipe[1], &byte, 1) < 0)
+    printf("csv import: couldn't wake the main thread\n");
+}
+
+void *csvCountWorker(void *argument) {
+  CsvImport *import = argument;
+  int chunk;
+  while ((chunk = __atomic_fetch_add(&import->nextChunk, 1, __ATOMIC_RELAXED)) < import->chunkCount) {
+    csvChunkCount(&import->chunks[chunk]);
+  }
+  return NULL;
+}
+
+// Chunks are taken in file order, so the rows near the top of the sheet are ready first
+void *csvParseWorker(void *argument) {
+  CsvImport *import = argument;
+  int chunk;
+  while ((chunk = __atomic_fetch_add(&import->nextChunk, 1, __ATOMIC_RELAXED)) < import->chunkCount) {
+    int64_t traceStart = traceBegin();
+    csvChunkParse(import, &import->chunks[chunk]);
+    traceEnd("csvChunkParse", traceStart);
+    __atomic_store_n(&import->chunks[chunk].done, TRUE, __ATOMIC_RELEASE);
+    csvImportWake(import);
+  }
+  return NULL;
+}
+
+void csvRunWorkers(CsvImport *import, void *(*worker)(void *), int firstChunk) {
+  import->nextChunk = firstChunk;
+  pthread_t *threads = malloc(sizeof(pthread_t) * import->threadCount);
+  for (int i = 0; i < import->threadCount; i++) {
+    pthread_create(&threads[i], NULL, worker, import);
+  }
+  for (int i = 0; i < import->threadCount; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+void *csvImportLoader(void *argument) {
+  CsvImport *import = argument;
+  // The first chunk starts outside quotes at row 0, so it can be parsed before anything else is counted. For that its
+  // last record mustn't run into the next chunk, so the chunk is cut short at its last newline outside quotes.
+  CsvChunk *first = &import->chunks[0];
+  char *lastNewline = NULL;
+  Boolean quoted = FALSE;
+  for (char *p = first->start; p < first->end; p++) {
+    if (*p == '"')
+      quoted = !quoted;
+    else if (*p == '\n' && !quoted)
+      lastNewline = p;
+  }
+  Boolean parseFirst = import->chunkCount == 1 || lastNewline;
+  if (import->chunkCount > 1 && lastNewline) {
+    first->end = lastNewline;
+    import->chunks[1].start = lastNewline;
+  }
+  csvChunkCount(first);
+  if (parseFirst) {
+    int64_t traceStart = traceBegin();
+    csvChunkParse(import, first);
+    traceEnd("csvChunkParse", traceStart);
+    __atomic_store_n(&first->done, TRUE, __ATOMIC_RELEASE);
+    csvImportWake(import);
+  }
+
+  csvRunWorkers(import, csvCountWorker, 1);
+  quoted = FALSE;
+  int row = 0;
+  for (int i = 0; i < import->chunkCount; i++) {
+    CsvChunk *chunk = &import->chunks[i];
+    // The first chunk may already be in the main thread's hands, and starts at row 0 outside quotes anyway
+    if (i > 0) {
+      chunk->startsQuoted = quoted;
+      chunk->firstRow = row;
+    }
+    row += (i == 0) + chunk->newlineCounts[quoted ? 1 : 0];
+    quoted ^= chunk->quoteParity;
+  }
+  // A newline at the very end of the file doesn't start another record
+  if (import->data[import->size - 1] == '\n' && !quoted)
+    row--;
+  import->rowCount = row;
+  __atomic_store_n(&import->counted, TRUE, __ATOMIC_RELEASE);
+  csvImportWake(import);
+
+  csvRunWorkers(import, csvParseWorker, parseFirst ? 1 : 0);
+  return NULL;
+}
+
+// Starts importing path into sheet, which has to be new. Returns FALSE if the file can't be read. The import runs in
+// the background and is handed over to the sheet bit by bit by csvImportPoll.
+Boolean csvImportStart(CsvImport *import, Sheet *sheet, char *path, int threadCount) {
+  CsvImport empty = {0};
+  *import = empty;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0 || fileStat.st_size == 0) {
+    close(fd);
+    return FALSE;
+  }
+  // Made before the mapping is lent to the sheet's text arena, which can't be taken back
+  if (pipe(import->wakePipe) < 0) {
+    close(fd);
+    return FALSE;
+  }
+  import->size = fileStat.st_size;
+  import->data = mmap(NULL, import->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (import->data == MAP_FAILED) {
+    close(import->wakePipe[0]);
+    close(import->wakePipe[1]);
+    return FALSE;
+  }
+  madvise(import->data, import->size, MADV_SEQUENTIAL);
+  textArenaBorrow(&sheet->textArena, import->data, import->size);
+
+  size_t chunkCount = 1;
+  if (import->size > CSV_FIRST_CHUNK_SIZE)
+    chunkCount += (import->size - CSV_FIRST_CHUNK_SIZE + CSV_CHUNK_SIZE - 1) / CSV_CHUNK_SIZE;
+  import->chunkCount = chunkCount;
+  import->chunks = calloc(chunkCount, sizeof(CsvChunk));
+  for (int i = 0; i < import->chunkCount; i++) {
+    size_t start = i == 0 ? 0 : CSV_FIRST_CHUNK_SIZE + (size_t)(i - 1) * CSV_CHUNK_SIZE;
+    size_t end = i == 0 ? CSV_FIRST_CHUNK_SIZE : start + CSV_CHUNK_SIZE;
+    import->chunks[i].start = import->data + start;
+    import->chunks[i].end = import->data + (end < import->size ? end : import->size);
+  }
+  import->threadCount = threadCount > 0 ? threadCount : 1;
+  fcntl(import->wakePipe[0], F_SETFL, O_NONBLOCK);
+  import->active = TRUE;
+  import->startTime = nowNanoseconds();
+  sheet->importing = TRUE;
+  pthread_create(&import->loader, NULL, csvImportLoader, import);
+  return TRUE;
+}
+
+// Grows a sheet whose rows and columns were never moved, so new rows and columns keep physical == visible
+void sheetGrow(Sheet *sheet, int rowCount, int columnCount) {
+  if (sheet->rowCount < rowCount)
+    sheetAppendRows(sheet, sheet->rowCount, rowCount - sheet->rowCount);
+  if (sheet->columnCount < columnCount)
+    sheetAppendColumns(sheet, sheet->columnCount, columnCount - sheet->columnCount);
+}
+
+// Loads a formula without recalculating anything, for when everything is recalculated afterwards
+void formulasLoad(Sheet *sheet, int physicalRow, int physicalColumn, String text) {
+  LaneBlock *block = laneGetOrCreateBlock(sheetGetOrCreateLane(sheet, physicalColumn), physicalRow);
+  laneBlockSet(block, physicalRow, 0, FALSE, FALSE);
+  int id = formulaAdd(sheet, physicalRow, physicalColumn);
+  formulaCompile(sheet, &sheet->formulas.formulas[id], text);
+  formulaLink(sheet, id);
+}
+
+// Hands whatever the loader has finished over to the sheet. Called from the main thread whenever wakePipe is readable.
+// Returns TRUE if the sheet changed.
+Boolean csvImportPoll(CsvImport *import, Sheet *sheet) {
+  if (!import->active)
+    return FALSE;
+  char bytes[64];
+  while (read(import->wakePipe[0], bytes, sizeof(bytes)) > 0) {
+  }
+  Boolean changed = FALSE;
+  if (__atomic_load_n(&import->counted, __ATOMIC_ACQUIRE) && sheet->rowCount < import->rowCount) {
+    sheetGrow(sheet, import->rowCount, sheet->columnCount);
+    changed = TRUE;
+  }
+  for (int i = 0; i < import->chunkCount; i++) {
+    CsvChunk *chunk = &import->chunks[i];
+    if (chunk->merged || !__atomic_load_n(&chunk->done, __ATOMIC_ACQUIRE))
+      continue;
+    // The first chunk is usually merged before the rows are counted, so it makes room for itself
+    sheetGrow(sheet, chunk->firstRow + chunk->recordCount, chunk->columnCount);
+    tileStoreMerge(&sheet->cells, &chunk->cells);
+    for (int column = 0; column < chunk->laneCount; column++) {
+      if (chunk->lanes[column].blockCount)
+        laneMerge(sheetGetOrCreateLane(sheet, column), &chunk->lanes[column]);
+    }
+    free(chunk->lanes);
+    chunk->merged = TRUE;
+    import->mergedCount++;
+    changed = TRUE;
+    if (i == 0)
+      import->firstChunkTime = nowNanoseconds() - import->startTime;
+  }
+  if (import->mergedCount < import->chunkCount || !__atomic_load_n(&import->counted, __ATOMIC_ACQUIRE))
+    return changed;
+
+  pthread_join(import->loader, NULL);
+  for (int i = 0; i < import->chunkCount; i++) {
+    CsvChunk *chunk = &import->chunks[i];
+    for (int j = 0; j < chunk->formulaCells.length; j += 2) {
+      int row = chunk->formulaCells.data[j];
+      int column = chunk->formulaCells.data[j + 1];
+      formulasLoad(sheet, row, column, tileStoreGet(&sheet->cells, row, column));
+    }
+    free(chunk->formulaCells.data);
+  }
+  formulasRecalculateAll(sheet);
+  close(import->wakePipe[0]);
+  close(import->wakePipe[1]);
+  free(import->chunks);
+  import->active = FALSE;
+  sheet->importing = FALSE;
+  printf("imported %d rows (%zu bytes) in %.1fms, first rows after %.1fms\n", import->rowCount, import->size, (nowNanoseconds() - import->startTime) / 1e6, import->firstChunkTime / 1e6);
+  return TRUE;
+}
+
+
+
+//******************************************//
+//               Workbook Files             //
+//******************************************//
+
+// The native file format, laid out so that a workbook can be opened by mmapping it without reading it. Everything the
+// sheet keeps is written as is: the row heights, column widths, row and column maps, then every tile (see Mapped Tiles
+// in the tile store) and every lane block, each with an index sorted for binary search. Opening copies the small
+// per row and per column tables and leaves the tiles in the file until render() or an edit first looks at them. Lane
+// blocks are used straight out of the mapping, the mapping being private so writes to them never reach the file.
+// Numbers are stored in the machine's own byte order.
+#define WORKBOOK_MAGIC "SPREADC1"
+#define WORKBOOK_VERSION 2
+
+typedef struct WorkbookHeader {
+  char magic[8];
+  int version;
+  int rowCount;
+  int columnCount;
+  int physicalRowCount;
+  int physicalColumnCount;
+  int freePhysicalRowCount;
+  int freePhysicalColumnCount;
+  int tileCount;
+  int laneBlockCount;
+  int formulaCount;
+  uint64_t snapshotId; // Different for every save, journals record which one they go on top of
+  uint64_t cellHeightsOffset;
+  uint64_t cellWidthsOffset;
+  uint64_t rowMapOffset;
+  uint64_t columnMapOffset;
+  uint64_t freePhysicalRowsOffset;
+  uint64_t freePhysicalColumnsOffset;
+  uint64_t formulasOffset; // Per formula its physical row, column, error and code length, then its code
+  uint64_t tileIndexOffset;
+  uint64_t laneIndexOffset;
+} WorkbookHeader;
+
+typedef struct WorkbookLaneEntry {
+  int physicalColumn;
+  int block;
+  uint64_t offset; // Aligned to 64 bytes, LaneBlocks are read in place
+} WorkbookLaneEntry;
+
+Boolean workbookWrite(FILE *file, void *data, size_t size, uint64_t *offset) {
+  *offset += size;
+  return fwrite(data, 1, size, file) == size;
+}
+
+// Pads the file with zeros up to a multiple of alignment
+Boolean workbookAlign(FILE *file, uint64_t alignment, uint64_t *offset) {
+  char zeros[64] = {0};
+  return workbookWrite(file, zeros, (alignment - *offset % alignment) % alignment, offset);
+}
+
+int compareMappedTileEntries(const void *a, const void *b) {
+  const MappedTileEntry *first = a;
+  const MappedTileEntry *second = b;
+  if (first->tileRow != second->tileRow)
+    return first->tileRow < second->tileRow ? -1 : 1;
+  return (first->tileColumn > second->tileColumn) - (first->tileColumn < second->tileColumn);
+}
+
+// Loads the formulas of an opened workbook and recalculates them, which is left until after the first frame. Until then
+// formula cells show their text.
+void workbookLoadFormulas(Sheet *sheet) {
+  if (!sheet->unloadedFormulaCount)
+    return;
+  int64_t start = nowNanoseconds();
+  int *record = sheet->unloadedFormulas;
+  for (int i = 0; i < sheet->unloadedFormulaCount; i++) {
+    LaneBlock *block = laneGetOrCreateBlock(sheetGetOrCreateLane(sheet, record[1]), record[0]);
+    laneBlockSet(block, record[0], 0, FALSE, FALSE);
+    int id = formulaAdd(sheet, record[0], record[1]);
+    Formula *formula = &sheet->formulas.formulas[id];
+    formula->error = record[2];
+    formula->code.length = 0;
+    for (int pc = 0; pc < record[3]; pc++)
+      dynamicIntArrayPush(&formula->code, record[4 + pc]);
+    formula->hasRanges = formulaCodeHasRanges(&formula->code);
+    formulaLink(sheet, id);
+    record += 4 + record[3];
+  }
+  printf("loaded %d formulas in %.1fms\n", sheet->unloadedFormulaCount, (nowNanoseconds() - start) / 1e6);
+  sheet->unloadedFormulaCount = 0;
+  formulasRecalculateAll(sheet);
+  sheet->structureChanged = TRUE;
+}
+
+
+// Writes the sheet to path.tmp and renames it over path once it is all on disk, so a crash mid save leaves the old file
+// alone. The old file may well be the one the sheet is mapped from, which keeps working after the rename.
+Boolean workbookSave(Sheet *sheet, char *path) {
+  workbookLoadFormulas(sheet);
+  tileStoreFaultAll(&sheet->cells);
+  char temporaryPath[4096];
+  snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+  FILE *file = fopen(temporaryPath, "wb");
+  if (!file)
+    return FALSE;
+
+  WorkbookHeader header = {0};
+  memcpy(header.magic, WORKBOOK_MAGIC, sizeof(header.magic));
+  header.version = WORKBOOK_VERSION;
+  header.rowCount = sheet->rowCount;
+  header.columnCount = sheet->columnCount;
+  header.physicalRowCount = sheet->physicalRowCount;
+  header.physicalColumnCount = sheet->physicalColumnCount;
+  header.freePhysicalRowCount = sheet->freePhysicalRows.length;
+  header.freePhysicalColumnCount = sheet->freePhysicalColumns.length;
+  header.snapshotId = nowNanoseconds();
+  uint64_t offset = 0;
+  Boolean ok = workbookWrite(file, &header, sizeof(header), &offset);
+  header.cellHeightsOffset = offset;
+  ok = ok && workbookWrite(file, sheet->cellHeights.data, sizeof(int) * sheet->rowCount, &offset);
+  header.cellWidthsOffset = offset;
+  ok = ok && workbookWrite(file, sheet->cellWidths.data, sizeof(int) * sheet->columnCount, &offset);
+  header.rowMapOffset = offset;
+  ok = ok && workbookWrite(file, sheet->rowMap.data, sizeof(int) * sheet->rowCount, &offset);
+  header.columnMapOffset = offset;
+  ok = ok && workbookWrite(file, sheet->columnMap.data, sizeof(int) * sheet->columnCount, &offset);
+  header.freePhysicalRowsOffset = offset;
+  ok = ok && workbookWrite(file, sheet->freePhysicalRows.data, sizeof(int) * sheet->freePhysicalRows.length, &offset);
+  header.freePhysicalColumnsOffset = offset;
+  ok = ok && workbookWrite(file, sheet->freePhysicalColumns.data, sizeof(int) * sheet->freePhysicalColumns.length, &offset);
+
+  header.formulasOffset = offset;
+  FormulaEngine *engine = &sheet->formulas;
+  for (int i = 0; i < engine->formulaCount && ok; i++) {
+    if (engine->formulas[i].physicalRow == -1)
+      continue;
+    // The compiled code is saved rather than recompiled from the cell's text on open, since the text still names the
+    // rows and columns the formula was typed against while the code follows them when rows and columns move
+    Formula *formula = &engine->formulas[i];
+    int record[4] = {formula->physicalRow, formula->physicalColumn, formula->code.length ? FORMULA_OK : formula->error, formula->code.length};
+    ok = workbookWrite(file, record, sizeof(record), &offset);
+    ok = ok && workbookWrite(file, formula->code.data, sizeof(int) * formula->code.length, &offset);
+    header.formulaCount++;
+  }
+
+  // Tiles, each followed by its text
+  TileStore *store = &sheet->cells;
+  MappedTileEntry *tileEntries = malloc(sizeof(MappedTileEntry) * (store->tileCount + 1));
+  MappedCell *cells = malloc(sizeof(MappedCell) * TILE_SIZE * TILE_SIZE);
+  for (int i = 0; i < store->capacity && ok; i++) {
+    Tile *tile = store->tiles[i];
+    if (!tile)
+      continue;
+    ok = workbookAlign(file, 8, &offset);
+    MappedTileEntry *entry = &tileEntries[header.tileCount++];
+    entry->tileRow = tile->tileRow;
+    entry->tileColumn = tile->tileColumn;
+    entry->offset = offset;
+    MappedTileHeader tileHeader = {0};
+    tileHeader.filledCellCount = tile->filledCellCount;
+    memcpy(tileHeader.occupied, tile->occupied, sizeof(tile->occupied));
+    memcpy(tileHeader.filledBeforeRow, tile->filledBeforeRow, sizeof(tile->filledBeforeRow));
+    uint64_t text = offset + sizeof(MappedTileHeader) + sizeof(MappedCell) * tile->filledCellCount;
+    for (int cell = 0; cell < tile->filledCellCount; cell++) {
+      MappedCell mappedCell = {text, tile->cells[cell].length, 0};
+      cells[cell] = mappedCell;
+      text += tile->cells[cell].length;
+    }
+    ok = ok && workbookWrite(file, &tileHeader, sizeof(tileHeader), &offset);
+    ok = ok && workbookWrite(file, cells, sizeof(MappedCell) * tile->filledCellCount, &offset);
+    for (int cell = 0; cell < tile->filledCellCount && ok; cell++) {
+      ok = workbookWrite(file, tile->cells[cell].value, tile->cells[cell].length, &offset);
+    }
+  }
+  free(cells);
+  qsort(tileEntries, header.tileCount, sizeof(MappedTileEntry), compareMappedTileEntries);
+  ok = ok && workbookAlign(file, 8, &offset);
+  header.tileIndexOffset = offset;
+  ok = ok && workbookWrite(file, tileEntries, sizeof(MappedTileEntry) * header.tileCount, &offset);
+  free(tileEntries);
+
+  // Lane blocks, aligned so they can be used in place
+  DynamicIntArray laneBlocks = dynamicIntArrayNew(64); // Pairs of physical column, block
+  for (int column = 0; column < sheet->laneCount; column++) {
+    for (int block = 0; block < sheet->lanes[column].blockCount; block++) {
+      if (!sheet->lanes[column].blocks[block])
+        continue;
+      dynamicIntArrayPush(&laneBlocks, column);
+      dynamicIntArrayPush(&laneBlocks, block);
+    }
+  }
+  header.laneBlockCount = laneBlocks.length / 2;
+  WorkbookLaneEntry *laneEntries = malloc(sizeof(WorkbookLaneEntry) * (header.laneBlockCount + 1));
+  for (int i = 0; i < header.laneBlockCount && ok; i++) {
+    ok = workbookAlign(file, 64, &offset);
+    laneEntries[i].physicalColumn = laneBlocks.data[i * 2];
+    laneEntries[i].block = laneBlocks.data[i * 2 + 1];
+    laneEntries[i].offset = offset;
+    ok = ok && workbookWrite(file, sheet->lanes[laneEntries[i].physicalColumn].blocks[laneEntries[i].block], sizeof(LaneBlock), &offset);
+  }
+  header.laneIndexOffset = offset;
+  ok = ok && workbookWrite(file, laneEntries, sizeof(WorkbookLaneEntry) * header.laneBlockCount, &offset);
+  free(laneEntries);
+  free(laneBlocks.data);
+
+  ok = ok && fseek(file, 0, SEEK_SET) == 0;
+  ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temporaryPath, path) < 0) {
+    unlink(temporaryPath);
+    return FALSE;
+  }
+  printf("saved %s (%zu bytes)\n", path, (size_t)offset);
+  // Everything in the journal is in the new snapshot
+  sheet->snapshotId = header.snapshotId;
+  if (sheet->journal)
+    journalReset(sheet->journal, sheet->snapshotId);
+  return TRUE;
+}
+
+Boolean workbookIsFile(char *path) {
+  char magic[8] = {0};
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  Boolean isWorkbook = read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, WORKBOOK_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  return isWorkbook;
+}
+
+// Fills a DynamicIntArray from a table in the file, leaving the usual room to grow
+DynamicIntArray workbookReadInts(char *data, uint64_t offset, int count, int spare) {
+  DynamicIntArray array = dynamicIntArrayNew(count + spare);
+  memcpy(array.data, data + offset, sizeof(int) * count);
+  array.length = count;
+  return array;
+}
+
+// Whether count items of itemSize at offset are inside the file and aligned
+Boolean workbookFits(size_t size, uint64_t offset, int64_t count, size_t itemSize, size_t alignment) {
+  return count >= 0 && offset % alignment == 0 && offset <= size && (uint64_t)count <= (size - offset) / itemSize;
+}
+
+Boolean workbookIntsBelow(char *data, uint64_t offset, int count, int limit) {
+  for (int i = 0; i < count; i++) {
+    int value;
+    memcpy(&value, data + offset + sizeof(int) * i, sizeof(int));
+    if (value < 0 || value >= limit)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Saved code is run as is, so it has to be what the parser could have made: whole instructions, references to physical
+// rows and columns that exist, and stacks that neither underflow nor go past FORMULA_MAX_STACK
+Boolean workbookFormulaCodeIsValid(int *code, int length, int physicalRowCount, int physicalColumnCount) {
+  int top = 0;
+  int aggregateTop = 0;
+  for (int pc = 0; pc < length; pc += formulaOpLength(code[pc])) {
+    int op = code[pc];
+    if (op < FORMULA_NUMBER || op > FORMULA_AGGREGATE_END || pc + formulaOpLength(op) > length)
+      return FALSE;
+    if (op == FORMULA_CELL || op == FORMULA_AGGREGATE_RANGE) {
+      for (int i = pc + 1; i < pc + formulaOpLength(op); i += 2) {
+        if (code[i] < 0 || code[i] >= physicalRowCount || code[i + 1] < 0 || code[i + 1] >= physicalColumnCount)
+          return FALSE;
+      }
+    }
+    if (op == FORMULA_AGGREGATE_BEGIN && (code[pc + 1] < FORMULA_SUM || code[pc + 1] > FORMULA_COUNT))
+      return FALSE;
+    int pops = 0;
+    int pushes = 0;
+    switch (op) {
+      case FORMULA_NUMBER: case FORMULA_CELL: pushes = 1; break;
+      case FORMULA_ADD: case FORMULA_SUBTRACT: case FORMULA_MULTIPLY: case FORMULA_DIVIDE: pops = 2; pushes = 1; break;
+      case FORMULA_NEGATE: pops = 1; pushes = 1; break;
+      case FORMULA_AGGREGATE_VALUE: pops = 1; break;
+      case FORMULA_AGGREGATE_END: pushes = 1; break;
+    }
+    if (op >= FORMULA_AGGREGATE_VALUE && aggregateTop < 1)
+      return FALSE;
+    if (op == FORMULA_AGGREGATE_BEGIN)
+      aggregateTop++;
+    if (op == FORMULA_AGGREGATE_END)
+      aggregateTop--;
+    if (top < pops || aggregateTop > FORMULA_MAX_STACK)
+      return FALSE;
+    top += pushes - pops;
+    if (top > FORMULA_MAX_STACK)
+      return FALSE;
+  }
+  return length == 0 || (top == 1 && aggregateTop == 0);
+}
+
+// Everything the header points at has to be inside the file, and every physical row and column it names has to exist,
+// since opening uses all of it in place or as an index. Tiles' cell text is checked when the cells are read instead.
+Boolean workbookIsValid(WorkbookHeader *header, char *data, size_t size) {
+  if (header->rowCount < 0 || header->columnCount < 0 || header->freePhysicalRowCount < 0 || header->freePhysicalColumnCount < 0 || header->tileCount < 0 || header->laneBlockCount < 0 || header->formulaCount < 0)
+    return FALSE;
+  // Every physical row is either a row or on the free list
+  if (header->physicalRowCount < 0 || header->physicalRowCount > (int64_t)header->rowCount + header->freePhysicalRowCount || header->physicalRowCount > INT_MAX - 1000)
+    return FALSE;
+  if (header->physicalColumnCount < 0 || header->physicalColumnCount > (int64_t)header->columnCount + header->freePhysicalColumnCount || header->physicalColumnCount > INT_MAX - 1000)
+    return FALSE;
+  if (!workbookFits(size, header->cellHeightsOffset, header->rowCount, sizeof(int), sizeof(int)) || !workbookFits(size, header->cellWidthsOffset, header->columnCount, sizeof(int), sizeof(int)))
+    return FALSE;
+  if (!workbookFits(size, header->rowMapOffset, header->rowCount, sizeof(int), sizeof(int)) || !workbookIntsBelow(data, header->rowMapOffset, header->rowCount, header->physicalRowCount))
+    return FALSE;
+  if (!workbookFits(size, header->columnMapOffset, header->columnCount, sizeof(int), sizeof(int)) || !workbookIntsBelow(data, header->columnMapOffset, header->columnCount, header->physicalColumnCount))
+    return FALSE;
+  if (!workbookFits(size, header->freePhysicalRowsOffset, header->freePhysicalRowCount, sizeof(int), sizeof(int)) || !workbookIntsBelow(data, header->freePhysicalRowsOffset, header->freePhysicalRowCount, header->physicalRowCount))
+    return FALSE;
+  if (!workbookFits(size, header->freePhysicalColumnsOffset, header->freePhysicalColumnCount, sizeof(int), sizeof(int)) || !workbookIntsBelow(data, header->freePhysicalColumnsOffset, header->freePhysicalColumnCount, header->physicalColumnCount))
+    return FALSE;
+
+  uint64_t offset = header->formulasOffset;
+  for (int i = 0; i < header->formulaCount; i++) {
+    if (!workbookFits(size, offset, 4, sizeof(int), sizeof(int)))
+      return FALSE;
+    int *record = (int *)(data + offset);
+    if (record[0] < 0 || record[0] >= header->physicalRowCount || record[1] < 0 || record[1] >= header->physicalColumnCount || record[2] < FORMULA_OK || record[2] > FORMULA_ERROR_CYCLE)
+      return FALSE;
+    if (!workbookFits(size, offset + sizeof(int) * 4, record[3], sizeof(int), sizeof(int)) || !workbookFormulaCodeIsValid(record + 4, record[3], header->physicalRowCount, header->physicalColumnCount))
+      return FALSE;
+    offset += sizeof(int) * (4 + (uint64_t)record[3]);
+  }
+
+  if (!workbookFits(size, header->tileIndexOffset, header->tileCount, sizeof(MappedTileEntry), 8))
+    return FALSE;
+  MappedTileEntry *tileEntries = (MappedTileEntry *)(data + header->tileIndexOffset);
+  for (int i = 0; i < header->tileCount; i++) {
+    MappedTileEntry *entry = &tileEntries[i];
+    if (entry->tileRow < 0 || entry->tileRow > header->physicalRowCount >> TILE_SHIFT || entry->tileColumn < 0 || entry->tileColumn > header->physicalColumnCount >> TILE_SHIFT)
+      return FALSE;
+    if (!workbookFits(size, entry->offset, 1, sizeof(MappedTileHeader), 8))
+      return FALSE;
+    MappedTileHeader *tileHeader = (MappedTileHeader *)(data + entry->offset);
+    if (!workbookFits(size, entry->offset + sizeof(MappedTileHeader), tileHeader->filledCellCount, sizeof(MappedCell), 8))
+      return FALSE;
+    // The cell lookups index the tile's cells with these
+    int filled = 0;
+    for (int row = 0; row < TILE_SIZE; row++) {
+      if (tileHeader->filledBeforeRow[row] != filled)
+        return FALSE;
+      filled += __builtin_popcountll(tileHeader->occupied[row]);
+    }
+    if (filled != tileHeader->filledCellCount)
+      return FALSE;
+  }
+
+  if (!workbookFits(size, header->laneIndexOffset, header->laneBlockCount, sizeof(WorkbookLaneEntry), 8))
+    return FALSE;
+  WorkbookLaneEntry *laneEntries = (WorkbookLaneEntry *)(data + header->laneIndexOffset);
+  int blockCount = (header->physicalRowCount + LANE_BLOCK_SIZE - 1) / LANE_BLOCK_SIZE;
+  for (int i = 0; i < header->laneBlockCount; i++) {
+    WorkbookLaneEntry *entry = &laneEntries[i];
+    if (entry->physicalColumn < 0 || entry->physicalColumn >= header->physicalColumnCount || entry->block < 0 || entry->block >= blockCount)
+      return FALSE;
+    if (!workbookFits(size, entry->offset, 1, sizeof(LaneBlock), 64))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Opens a workbook saved by workbookSave. The time this takes only depends on the number of rows, columns and tiles,
+// none of the cells are read. Returns FALSE if path isn't a workbook this version can read, or is damaged.
+Boolean workbookOpen(Sheet *sheet, char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return FALSE;
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) < 0 || (size_t)fileStat.st_size < sizeof(WorkbookHeader)) {
+    close(fd);
+    return FALSE;
+  }
+  size_t size = fileStat.st_size;
+  char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return FALSE;
+  WorkbookHeader *header = (WorkbookHeader *)data;
+  if (memcmp(header->magic, WORKBOOK_MAGIC, sizeof(header->magic)) != 0 || header->version != WORKBOOK_VERSION || !workbookIsValid(header, data, size)) {
+    munmap(data, size);
+    return FALSE;
+  }
+
+  *sheet = newSheet(0, 0);
+  free(sheet->cellHeights.data);
+  free(sheet->cellWidths.data);
+  free(sheet->rowMap.data);
+  free(sheet->columnMap.data);
+  free(sheet->freePhysicalRows.data);
+  free(sheet->freePhysicalColumns.data);
+  sheet->cellHeights = workbookReadInts(data, header->cellHeightsOffset, header->rowCount, 1000);
+  sheet->cellWidths = workbookReadInts(data, header->cellWidthsOffset, header->columnCount, 100);
+  sizeIndexInvalidate(&sheet->rowIndex, 0);
+  sizeIndexInvalidate(&sheet->columnIndex, 0);
+  sheet->rowMap = workbookReadInts(data, header->rowMapOffset, header->rowCount, 1000);
+  sheet->columnMap = workbookReadInts(data, header->columnMapOffset, header->columnCount, 100);
+  sheet->freePhysicalRows = workbookReadInts(data, header->freePhysicalRowsOffset, header->freePhysicalRowCount, 16);
+  sheet->freePhysicalColumns = workbookReadInts(data, header->freePhysicalColumnsOffset, header->freePhysicalColumnCount, 16);
+  sheet->rowCount = header->rowCount;
+  sheet->columnCount = header->columnCount;
+  sheet->physicalRowCount = header->physicalRowCount;
+  sheet->physicalColumnCount = header->physicalColumnCount;
+
+  // Physical rows and columns on the free lists are the ones without a row or column
+  free(sheet->rowOfPhysicalRow.data);
+  free(sheet->columnOfPhysicalColumn.data);
+  sheet->rowOfPhysicalRow = dynamicIntArrayNew(sheet->physicalRowCount + 1000);
+  sheet->rowOfPhysicalRow.length = sheet->physicalRowCount;
+  memset(sheet->rowOfPhysicalRow.data, 0xff, sizeof(int) * sheet->physicalRowCount);
+  for (int row = 0; row < sheet->rowCount; row++)
+    sheet->rowOfPhysicalRow.data[sheet->rowMap.data[row]] = row;
+  sheet->columnOfPhysicalColumn = dynamicIntArrayNew(sheet->physicalColumnCount + 100);
+  sheet->columnOfPhysicalColumn.length = sheet->physicalColumnCount;
+  memset(sheet->columnOfPhysicalColumn.data, 0xff, sizeof(int) * sheet->physicalColumnCount);
+  for (int column = 0; column < sheet->columnCount; column++)
+    sheet->columnOfPhysicalColumn.data[sheet->columnMap.data[column]] = column;
+
+  sheet->cells.mapped.data = data;
+  sheet->cells.mapped.size = size;
+  sheet->cells.mapped.entries = (MappedTileEntry *)(data + header->tileIndexOffset);
+  sheet->cells.mapped.count = header->tileCount;
+  sheet->cells.mapped.faulted = calloc(header->tileCount + 1, sizeof(Boolean));
+  textArenaBorrow(&sheet->textArena, data, size);
+
+  WorkbookLaneEntry *laneEntries = (WorkbookLaneEntry *)(data + header->laneIndexOffset);
+  for (int i = 0; i < header->laneBlockCount; i++) {
+    NumberLane *lane = sheetGetOrCreateLane(sheet, laneEntries[i].physicalColumn);
+    laneReserveBlock(lane, laneEntries[i].block);
+    lane->blocks[laneEntries[i].block] = (LaneBlock *)(data + laneEntries[i].offset);
+    lane->borrowedStart = data;
+    lane->borrowedSize = size;
+  }
+
+  sheet->unloadedFormulas = (int *)(data + header->formulasOffset);
+  sheet->unloadedFormulaCount = header->formulaCount;
+  sheet->path = path;
+  sheet->snapshotId = header->snapshotId;
+  return TRUE;
+}
+
+
+
+//******************************************//
+//               Journal                    //
+//******************************************//
+
+// Edits are appended to a journal next to the workbook (path.journal) as they happen, so nothing is lost if the program
+// dies between saves and autosaving never rewrites the sheet. Records are buffered and written out after every batch of
+// input, and a worker thread fdatasyncs the file at most every JOURNAL_SYNC_INTERVAL_MS, however many records came in.
+// On startup the journal is replayed on top of the workbook it was written against.
+// Once the journal passes JOURNAL_COMPACT_SIZE it is sealed (renamed to path.journal.sealed) and a fresh one started, and
+// the worker compacts the sealed journal into path.journal.base by dropping every record a later JOURNAL_SET_CELL of
+// the same cell makes redundant. Records carry increasing sequence numbers so a replay can skip any it has already seen,
+// which happens if a compaction is interrupted after writing the base and before removing the sealed journal.
+#define JOURNAL_MAGIC "SPRDJRN1"
+#define JOURNAL_SYNC_INTERVAL_MS 100
+#define JOURNAL_COMPACT_SIZE (4 * 1024 * 1024)
+
+typedef struct JournalHeader {
+  char magic[8];
+  uint64_t snapshotId; // The workbook the records go on top of
+} JournalHeader;
+
+typedef struct JournalRecord {
+  uint64_t sequence;
+  uint32_t checksum; // FNV-1a of the rest of the record and its text, so a torn write at the end isn't replayed
+  int type;
+  int row;
+  int column;
+  int index;
+  int length; // Bytes of text following the record
+} JournalRecord;
+
+uint32_t journalChecksum(JournalRecord *record, char *text) {
+  uint32_t hash = 2166136261u;
+  unsigned char *bytes = (unsigned char *)&record->type;
+  for (size_t i = 0; i < sizeof(JournalRecord) - offsetof(JournalRecord, type); i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  for (int i = 0; i < record->length; i++)
+    hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+  return hash;
+}
+
+void journalRecord(Journal *journal, JournalRecordType type, int row, int column, int index, char *text, int length) {
+  if (!journal)
+    return;
+  JournalRecord record = {0};
+  record.sequence = ++journal->sequence;
+  record.type = type;
+  record.row = row;
+  record.column = column;
+  record.index = index;
+  record.length = length;
+  record.checksum = journalChecksum(&record, text);
+  int needed = journal->bufferLength + sizeof(JournalRecord) + length;
+  if (needed > journal->bufferCapacity) {
+    journal->bufferCapacity = needed * 2;
+    journal->buffer = realloc(journal->buffer, journal->bufferCapacity);
+  }
+  memcpy(journal->buffer + journal->bufferLength, &record, sizeof(JournalRecord));
+  if (length)
+    memcpy(journal->buffer + journal->bufferLength + sizeof(JournalRecord), text, length);
+  journal->bufferLength = needed;
+}
+
+// Undo puts formulas back as they were compiled, which the journal can't get from the cell's text. The code goes in
+// with references as visible rows and columns, since replaying inserts doesn't always hand out the same physical ones.
+void journalRecordFormula(Sheet *sheet, int id) {
+  if (!sheet->journal)
+    return;
+  Formula *formula = &sheet->formulas.formulas[id];
+  int row = sheetRowOfPhysicalRow(sheet, formula->physicalRow);
+  int column = sheetColumnOfPhysicalColumn(sheet, formula->physicalColumn);
+  if (row == -1 || column == -1)
+    return;
+  DynamicIntArray code = dynamicIntArrayNew(formula->code.length + 1);
+  memcpy(code.data, formula->code.data, sizeof(int) * formula->code.length);
+  code.length = formula->code.length;
+  FormulaError error = formula->error;
+  if (!formulaCodeTranslate(sheet, &code, TRUE)) {
+    code.length = 0;
+    error = FORMULA_ERROR_REF;
+  }
+  journalRecord(sheet->journal, JOURNAL_SET_FORMULA, row, column, error, (char *)code.data, sizeof(int) * code.length);
+  free(code.data);
+}
+
+Boolean journalWriteAll(int fd, char *data, size_t size) {
+  while (size) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0)
+      return FALSE;
+    data += written;
+    size -= written;
+  }
+  return TRUE;
+}
+
+// Creates (or empties) a journal file and writes its header. Returns the fd, or -1.
+int journalCreate(char *path, uint64_t snapshotId) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  JournalHeader header = {0};
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.snapshotId = snapshotId;
+  if (fd >= 0 && !journalWriteAll(fd, (char *)&header, sizeof(header))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads a whole journal file. Returns NULL if there isn't one.
+char *journalReadFile(char *path, size_t *size, uint64_t *snapshotId) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat fileStat;
+  char *data = NULL;
+  if (fstat(fd, &fileStat) == 0 && (size_t)fileStat.st_size >= sizeof(JournalHeader)) {
+    *size = fileStat.st_size;
+    data = malloc(*size);
+    if (read(fd, data, *size) != (ssize_t)*size || memcmp(data, JOURNAL_MAGIC, 8) != 0) {
+      free(data);
+      data = NULL;
+    }
+    else {
+      *snapshotId = ((JournalHeader *)data)->snapshotId;
+    }
+  }
+  close(fd);
+  return data;
+}
+
+// The record at *offset, moving *offset past it. NULL at the end of the file or at a torn or corrupt record.
+JournalRecord *journalNextRecord(char *data, size_t size, size_t *offset) {
+  if (*offset + sizeof(JournalRecord) > size)
+    return NULL;
+  JournalRecord record;
+  memcpy(&record, data + *offset, sizeof(JournalRecord));
+  if (record.length < 0 || *offset + sizeof(JournalRecord) + record.length > size || record.checksum != journalChecksum(&record, data + *offset + sizeof(JournalRecord)))
+    return NULL;
+  JournalRecord *found = (JournalRecord *)(data + *offset);
+  *offset += sizeof(JournalRecord) + record.length;
+  return found;
+}
+
+// Merges the base and sealed journals into a new base, without the records later ones make redundant. Walking the
+// records backwards, a cell set in the current run of records (between row or column inserts and deletes, which move
+// cells around) makes every earlier record for that cell in the run redundant. Restored formula code only goes on top
+// of its cell's text, so it's dropped like an edit is.
+void journalCompact(Journal *journal) {
+  char *files[2] = {journal->basePath, journal->sealedPath};
+  char *data[2] = {NULL, NULL};
+  size_t sizes[2] = {0, 0};
+  uint64_t snapshotId = journal->snapshotId;
+  JournalRecord **records = NULL;
+  int recordCount = 0;
+  int recordCapacity = 0;
+  uint64_t lastSequence = 0;
+  for (int i = 0; i < 2; i++) {
+    uint64_t fileSnapshotId;
+    data[i] = journalReadFile(files[i], &sizes[i], &fileSnapshotId);
+    if (!data[i] || fileSnapshotId != snapshotId)
+      continue;
+    size_t offset = sizeof(JournalHeader);
+    JournalRecord *record;
+    while ((record = journalNextRecord(data[i], sizes[i], &offset))) {
+      if (record->sequence <= lastSequence)
+        continue;
+      lastSequence = record->sequence;
+      if (recordCount == recordCapacity) {
+        recordCapacity = recordCapacity ? recordCapacity * 2 : 1024;
+        records = realloc(records, sizeof(JournalRecord *) * recordCapacity);
+      }
+      records[recordCount++] = record;
+    }
+  }
+
+  Boolean *keep = malloc(sizeof(Boolean) * (recordCount + 1));
+  CellMap setInRun = cellMapNew(1024); // Cell -> the run it was last set in
+  int run = 0;
+  int kept = 0;
+  for (int i = recordCount - 1; i >= 0; i--) {
+    JournalRecord *record = records[i];
+    keep[i] = TRUE;
+    if (record->type >= JOURNAL_INSERT_ROW && record->type != JOURNAL_SET_FORMULA) {
+      run++;
+    }
+    else {
+      uint64_t key = cellKey(record->row, record->column);
+      keep[i] = cellMapGet(&setInRun, key) != run;
+      if (record->type == JOURNAL_SET_CELL)
+        cellMapPut(&setInRun, key, run);
+    }
+    kept += keep[i];
+  }
+
+  char temporaryPath[4096];
+  snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", journal->basePath);
+  int fd = journalCreate(temporaryPath, snapshotId);
+  Boolean ok = fd >= 0;
+  for (int i = 0; i < recordCount && ok; i++) {
+    if (keep[i])
+      ok = journalWriteAll(fd, (char *)records[i], sizeof(JournalRecord) + records[i]->length);
+  }
+  ok = ok && fdatasync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (ok && rename(temporaryPath, journal->basePath) == 0) {
+    unlink(journal->sealedPath);
+    printf("journal compacted: kept %d of %d records\n", kept, recordCount);
+  }
+  else {
+    unlink(temporaryPath);
+    printf("journal compaction failed, the sealed journal is kept\n");
+  }
+  free(keep);
+  free(setInRun.keys);
+  free(setInRun.values);
+  free(records);
+  free(data[0]);
+  free(data[1]);
+}
+
+void *journalWorker(void *argument) {
+  Journal *journal = argument;
+  pthread_mutex_lock(&journal->lock);
+  while (TRUE) {
+    if (journal->syncPending) {
+      journal->syncPending = FALSE;
+      int fd = journal->fd;
+      pthread_mutex_unlock(&journal->lock);
+      int64_t traceStart = traceBegin();
+      fdatasync(fd);
+      traceEnd("journal fdatasync", traceStart);
+      // Whatever is written meanwhile waits for the next sync, which is what batches the syncs
+      struct timespec pause = {0, JOURNAL_SYNC_INTERVAL_MS * 1000000L};
+      nanosleep(&pause, NULL);
+      pthread_mutex_lock(&journal->lock);
+    }
+    else if (journal->compactPending) {
+      pthread_mutex_unlock(&journal->lock);
+      int64_t traceStart = traceBegin();
+      journalCompact(journal);
+      traceEnd("journalCompact", traceStart);
+      pthread_mutex_lock(&journal->lock);
+      if (journal->sealedFd >= 0)
+        close(journal->sealedFd);
+      journal->sealedFd = -1;
+      journal->compactPending = FALSE;
+      pthread_cond_broadcast(&journal->wake);
+    }
+    else {
+      pthread_cond_wait(&journal->wake, &journal->lock);
+    }
+  }
+  return NULL;
+}
+
+// Writes out the records buffered since the last flush and asks the worker for a sync. Called after every batch of input.
+void journalFlush(Journal *journal) {
+  if (!journal || !journal->bufferLength)
+    return;
+  if (!journalWriteAll(journal->fd, journal->buffer, journal->bufferLength))
+    printf("couldn't write to the journal %s\n", journal->path);
+  journal->size += journal->bufferLength;
+  journal->bufferLength = 0;
+  pthread_mutex_lock(&journal->lock);
+  journal->syncPending = TRUE;
+  if (journal->size > JOURNAL_COMPACT_SIZE && !journal->compactPending && rename(journal->path, journal->sealedPath) == 0) {
+    journal->sealedFd = journal->fd;
+    journal->fd = journalCreate(journal->path, journal->snapshotId);
+    journal->size = sizeof(JournalHeader);
+    journal->compactPending = TRUE;
+  }
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// For when the program is about to die: gets everything buffered onto the disk without waiting for the worker
+void journalClose(Journal *journal) {
+  journalFlush(journal);
+  fdatasync(journal->fd);
+}
+
+// Starts the journal over once the sheet has been saved as snapshotId, which has everything the journal had
+void journalReset(Journal *journal, uint64_t snapshotId) {
+  journal->bufferLength = 0;
+  pthread_mutex_lock(&journal->lock);
+  while (journal->compactPending)
+    pthread_cond_wait(&journal->wake, &journal->lock);
+  journal->snapshotId = snapshotId;
+  unlink(journal->basePath);
+  unlink(journal->sealedPath);
+  // Emptied in place rather than recreated, the worker may be syncing the fd right now
+  JournalHeader header = {0};
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.snapshotId = snapshotId;
+  if (ftruncate(journal->fd, 0) < 0 || !journalWriteAll(journal->fd, (char *)&header, sizeof(header)))
+    printf("couldn't reset the journal %s\n", journal->path);
+  journal->size = sizeof(JournalHeader);
+  journal->syncPending = TRUE;
+  pthread_cond_signal(&journal->wake);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+void journalApply(Sheet *sheet, JournalRecord *record, char *text) {
+  Boolean cellInRange = record->row >= 0 && record->row < sheet->rowCount && record->column >= 0 && record->column < sheet->columnCount;
+  String string = {text, record->length};
+  switch (record->type) {
+    case JOURNAL_SET_CELL: {
+      if (!cellInRange)
+        break;
+      if (sheetIsEditing(sheet, record->row, record->column))
+        sheet->editing = FALSE;
+      sheetCommitCell(sheet, record->row, record->column, string);
+      break;
+    }
+    case JOURNAL_BEGIN_EDIT: {
+      if (cellInRange && !sheet->editing)
+        sheetBeginEdit(sheet, record->row, record->column);
+      break;
+    }
+    case JOURNAL_EDIT_APPEND: {
+      if (sheetIsEditing(sheet, record->row, record->column))
+        sheetCellAppend(sheet, record->row, record->column, text, record->length);
+      break;
+    }
+    case JOURNAL_EDIT_BACKSPACE: {
+      if (sheetIsEditing(sheet, record->row, record->column))
+        sheetCellBackSpace(sheet, record->row, record->column, record->index);
+      break;
+    }
+    case JOURNAL_INSERT_ROW: {
+      // Journals from before counts were recorded have 0 for one row
+      if (record->row >= 0 && record->row <= sheet->rowCount)
+        sheetAppendRows(sheet, record->row, clamp(record->index, 1, SHEET_MAX_COUNT));
+      break;
+    }
+    case JOURNAL_INSERT_COLUMN: {
+      if (record->column >= 0 && record->column <= sheet->columnCount)
+        sheetAppendColumns(sheet, record->column, clamp(record->index, 1, SHEET_MAX_COUNT));
+      break;
+    }
+    case JOURNAL_DELETE_ROW: {
+      if (record->row >= 0 && record->row < sheet->rowCount)
+        sheetDeleteRows(sheet, record->row, clamp(record->index, 1, SHEET_MAX_COUNT));
+      break;
+    }
+    case JOURNAL_DELETE_COLUMN: {
+      if (record->column >= 0 && record->column < sheet->columnCount)
+        sheetDeleteColumns(sheet, record->column, clamp(record->index, 1, SHEET_MAX_COUNT));
+      break;
+    }
+    case JOURNAL_SET_ROW_HEIGHT: {
+      if (record->row >= 0 && record->row < sheet->rowCount)
+        sheetSetRowHeight(sheet, record->row, record->index);
+      break;
+    }
+    case JOURNAL_SET_COLUMN_WIDTH: {
+      if (record->column >= 0 && record->column < sheet->columnCount)
+        sheetSetColumnWidth(sheet, record->column, record->index);
+      break;
+    }
+    case JOURNAL_SET_FORMULA: {
+      if (!cellInRange)
+        break;
+      int id = cellMapGet(&sheet->formulas.formulaAt, cellKey(sheet->rowMap.data[record->row], sheet->columnMap.data[record->column]));
+      if (id == -1)
+        break;
+      DynamicIntArray code = dynamicIntArrayNew(record->length / sizeof(int) + 1);
+      code.length = record->length / sizeof(int);
+      memcpy(code.data, text, sizeof(int) * code.length);
+      FormulaError error = record->index;
+      if (!formulaCodeTranslate(sheet, &code, FALSE)) {
+        code.length = 0;
+        error = FORMULA_ERROR_REF;
+      }
+      historySaveFormula(sheet, id);
+      formulaSetCode(sheet, id, &code, error);
+      DynamicIntArray roots = dynamicIntArrayNew(1);
+      dynamicIntArrayPush(&roots, id);
+      formulasRecalculate(sheet, &roots);
+      free(roots.data);
+      free(code.data);
+      break;
+    }
+  }
+}
+
+char *journalPath(char *path, char *suffix) {
+  char *joined = malloc(strlen(path) + strlen(suffix) + 1);
+  sprintf(joined, "%s%s", path, suffix);
+  return joined;
+}
+
+// Replays the journal of sheet->path onto the sheet, then starts logging the sheet's edits to it. Journals written
+// against another snapshot (the sheet was saved but the program died before the journal was reset) are moved aside.
+Boolean journalOpen(Journal *journal, Sheet *sheet) {
+  Journal empty = {0};
+  *journal = empty;
+  journal->path = journalPath(sheet->path, ".journal");
+  journal->sealedPath = journalPath(sheet->path, ".journal.sealed");
+  journal->basePath = journalPath(sheet->path, ".journal.base");
+  journal->snapshotId = sheet->snapshotId;
+  journal->sealedFd = -1;
+  pthread_mutex_init(&journal->lock, NULL);
+  pthread_cond_init(&journal->wake, NULL);
+
+  int64_t start = nowNanoseconds();
+  char *files[3] = {journal->basePath, journal->sealedPath, journal->path};
+  int replayed = 0;
+  size_t activeSize = 0;
+  for (int i = 0; i < 3; i++) {
+    size_t size;
+    uint64_t snapshotId;
+    char *data = journalReadFile(files[i], &size, &snapshotId);
+    if (!data)
+      continue;
+    if (snapshotId != sheet->snapshotId) {
+      char *stalePath = journalPath(files[i], ".stale");
+      printf("%s doesn't go with this workbook, moved to %s\n", files[i], stalePath);
+      rename(files[i], stalePath);
+      free(stalePath);
+      free(data);
+      continue;
+    }
+    size_t offset = sizeof(JournalHeader);
+    JournalRecord *record;
+    while ((record = journalNextRecord(data, size, &offset))) {
+      if (record->sequence <= journal->sequence)
+        continue;
+      // Edits can depend on formulas, so an opened workbook's have to be there first
+      if (replayed++ == 0)
+        workbookLoadFormulas(sheet);
+      journalApply(sheet, record, (char *)(record + 1));
+      journal->sequence = record->sequence;
+    }
+    if (i == 1)
+      journal->compactPending = TRUE;
+    if (i == 2)
+      activeSize = offset; // Anything after the last good record is a torn write, and is cut off
+    free(data);
+  }
+
+  if (activeSize) {
+    journal->fd = open(journal->path, O_WRONLY | O_APPEND);
+    if (journal->fd >= 0 && ftruncate(journal->fd, activeSize) < 0)
+      printf("couldn't cut the torn end off %s\n", journal->path);
+    journal->size = activeSize;
+  }
+  else {
+    journal->fd = journalCreate(journal->path, journal->snapshotId);
+    journal->size = sizeof(JournalHeader);
+  }
+  if (journal->fd < 0) {
+    printf("couldn't open the journal %s, edits won't be autosaved\n", journal->path);
+    return FALSE;
+  }
+  if (replayed)
+    printf("replayed %d edits from %s in %.1fms\n", replayed, journal->path, (nowNanoseconds() - start) / 1e6);
+  sheet->journal = journal;
+  // An edit that was still going when the program died is committed
+  sheetEndEdit(sheet);
+  sheet->insertMode = FALSE;
+  journalFlush(journal);
+  pthread_create(&journal->worker, NULL, journalWorker, journal);
+  return TRUE;
+}
+
+
+
+//******************************************//
+//               Undo History               //
+//******************************************//
+
+// Undo keeps the old versions of only what each step changed. Cells are copied on write into tiles of the step's own,
+// laid out like the sheet's: the first time a step changes a cell its old text goes into the step's tile for it, and the
+// tile's changed bitmap notes the cell as done, so later changes in the same step cost nothing. The step also keeps
+// formulas as they were compiled before it changed them, and its inserts, deletes and resizes as operations to reverse.
+// Undoing a step goes back through the usual editing functions, which record what they change into a new step, so that
+// step is exactly what redoing takes. Restoring only looks at changed cells, so undo and redo cost O(changed cells)
+// plus whatever shifting the rows and columns costs. Steps are forgotten oldest first once they take up maxBytes.
+
+History historyNew(size_t maxBytes) {
+  History history = {0};
+  history.maxBytes = maxBytes;
+  return history;
+}
+
+HistoryStep *historyStepNew(Sheet *sheet) {
+  HistoryStep *step = calloc(1, sizeof(HistoryStep));
+  step->tileAt = cellMapNew(16);
+  step->formulaAt = cellMapNew(16);
+  step->selectedRow = sheet->selectedRow;
+  step->selectedColumn = sheet->selectedColumn;
+  step->bytes = sizeof(HistoryStep);
+  sheet->history->bytes += step->bytes;
+  return step;
+}
+
+void historyStepFree(History *history, HistoryStep *step) {
+  for (int i = 0; i < step->tileCount; i++) {
+    for (int j = 0; j < step->tiles[i].tile.filledCellCount; j++) {
+      free(step->tiles[i].tile.cells[j].value);
+    }
+    free(step->tiles[i].tile.cells);
+  }
+  for (int i = 0; i < step->formulaCount; i++) {
+    free(step->formulas[i].code.data);
+  }
+  for (int i = 0; i < step->operationCount; i++) {
+    free(step->operations[i].physicals);
+    free(step->operations[i].sizes);
+  }
+  free(step->tiles);
+  free(step->formulas);
+  free(step->operations);
+  free(step->tileAt.keys);
+  free(step->tileAt.values);
+  free(step->formulaAt.keys);
+  free(step->formulaAt.values);
+  history->bytes -= step->bytes;
+  free(step);
+}
+
+void historyPush(HistoryStep ***steps, int *count, int *capacity, HistoryStep *step) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    *steps = realloc(*steps, sizeof(HistoryStep *) * *capacity);
+  }
+  (*steps)[(*count)++] = step;
+}
+
+// The step edits are going into, started by the first edit since the last checkpoint. NULL when there's no history.
+HistoryStep *historyStep(Sheet *sheet) {
+  History *history = sheet->history;
+  if (!history)
+    return NULL;
+  if (!history->current) {
+    // A new edit takes away what could have been redone
+    for (int i = 0; i < history->redoCount; i++) {
+      historyStepFree(history, history->redo[i]);
+    }
+    history->redoCount = 0;
+    history->current = historyStepNew(sheet);
+  }
+  return history->current;
+}
+
+// Called before a cell's text changes. Only the first change in a step keeps the text.
+void historySaveCell(Sheet *sheet, int physicalRow, int physicalColumn) {
+  HistoryStep *step = historyStep(sheet);
+  if (!step)
+    return;
+  int tileRow = physicalRow >> TILE_SHIFT;
+  int tileColumn = physicalColumn >> TILE_SHIFT;
+  int index = cellMapGet(&step->tileAt, cellKey(tileRow, tileColumn));
+  if (index == -1) {
+    if (step->tileCount == step->tileCapacity) {
+      step->tileCapacity = step->tileCapacity ? step->tileCapacity * 2 : 8;
+      step->tiles = realloc(step->tiles, sizeof(HistoryTile) * step->tileCapacity);
+    }
+    index = step->tileCount++;
+    cellMapPut(&step->tileAt, cellKey(tileRow, tileColumn), index);
+    memset(&step->tiles[index], 0, sizeof(HistoryTile));
+    step->tiles[index].tile.tileRow = tileRow;
+    step->tiles[index].tile.tileColumn = tileColumn;
+    step->bytes += sizeof(HistoryTile);
+    sheet->history->bytes += sizeof(HistoryTile);
+  }
+  HistoryTile *saved = &step->tiles[index];
+  int row = physicalRow & (TILE_SIZE - 1);
+  int column = physicalColumn & (TILE_SIZE - 1);
+  if ((saved->changed[row] >> column) & 1)
+    return;
+  saved->changed[row] |= ((uint64_t)1) << column;
+  String old = tileStoreGet(&sheet->cells, physicalRow, physicalColumn);
+  if (old.length) {
+    String copy = {malloc(old.length), old.length};
+    memcpy(copy.value, old.value, old.length);
+    tileSetCell(&saved->tile, row, column, copy);
+    step->bytes += sizeof(String) + old.length;
+    sheet->history->bytes += sizeof(String) + old.length;
+  }
+}
+
+// Called before a row is emptied, for the cells in it that are filled
+void historySaveRow(Sheet *sheet, int physicalRow) {
+  if (!sheet->history)
+    return;
+  for (int tileColumn = 0; tileColumn <= (sheet->physicalColumnCount - 1) >> TILE_SHIFT; tileColumn++) {
+    Tile *tile = tileStoreGetTile(&sheet->cells, physicalRow >> TILE_SHIFT, tileColumn);
+    if (!tile)
+      continue;
+    uint64_t filled = tile->occupied[physicalRow & (TILE_SIZE - 1)];
+    while (filled) {
+      historySaveCell(sheet, physicalRow, (tileColumn << TILE_SHIFT) + __builtin_ctzll(filled));
+      filled &= filled - 1;
+    }
+  }
+}
+
+void historySaveColumn(Sheet *sheet, int physicalColumn) {
+  if (!sheet->history)
+    return;
+  for (int tileRow = 0; tileRow <= (sheet->physicalRowCount - 1) >> TILE_SHIFT; tileRow++) {
+    Tile *tile = tileStoreGetTile(&sheet->cells, tileRow, physicalColumn >> TILE_SHIFT);
+    if (!tile)
+      continue;
+    for (int row = 0; row < TILE_SIZE; row++) {
+      if (tileCellFilled(tile, row, physicalColumn & (TILE_SIZE - 1)))
+        historySaveCell(sheet, (tileRow << TILE_SHIFT) + row, physicalColumn);
+    }
+  }
+}
+
+// Called before a formula is recompiled, removed, or has its references rewritten
+void historySaveFormula(Sheet *sheet, int id) {
+  HistoryStep *step = historyStep(sheet);
+  if (!step)
+    return;
+  Formula *formula = &sheet->formulas.formulas[id];
+  uint64_t key = cellKey(formula->physicalRow, formula->physicalColumn);
+  if (cellMapGet(&step->formulaAt, key) != -1)
+    return;
+  if (step->formulaCount == step->formulaCapacity) {
+    step->formulaCapacity = step->formulaCapacity ? step->formulaCapacity * 2 : 8;
+    step->formulas = realloc(step->formulas, sizeof(HistoryFormula) * step->formulaCapacity);
+  }
+  cellMapPut(&step->formulaAt, key, step->formulaCount);
+  HistoryFormula *saved = &step->formulas[step->formulaCount++];
+  saved->physicalRow = formula->physicalRow;
+  saved->physicalColumn = formula->physicalColumn;
+  saved->code = dynamicIntArrayNew(formula->code.length + 1);
+  memcpy(saved->code.data, formula->code.data, sizeof(int) * formula->code.length);
+  saved->code.length = formula->code.length;
+  saved->error = formula->error;
+  size_t bytes = sizeof(HistoryFormula) + sizeof(int) * saved->code.capacity;
+  step->bytes += bytes;
+  sheet->history->bytes += bytes;
+}
+
+// Called after rows or columns are inserted, and before they are deleted or resized. physicals can be NULL.
+void historyRecordOperation(Sheet *sheet, JournalRecordType type, int index, int count, int *physicals, int *sizes) {
+  HistoryStep *step = historyStep(sheet);
+  if (!step)
+    return;
+  if (step->operationCount == step->operationCapacity) {
+    step->operationCapacity = step->operationCapacity ? step->operationCapacity * 2 : 4;
+    step->operations = realloc(step->operations, sizeof(HistoryOperation) * step->operationCapacity);
+  }
+  HistoryOperation *operation = &step->operations[step->operationCount++];
+  operation->type = type;
+  operation->index = index;
+  operation->count = count;
+  operation->physicals = NULL;
+  if (physicals) {
+    operation->physicals = malloc(sizeof(int) * count);
+    memcpy(operation->physicals, physicals, sizeof(int) * count);
+  }
+  operation->sizes = malloc(sizeof(int) * count);
+  memcpy(operation->sizes, sizes, sizeof(int) * count);
+  size_t bytes = sizeof(HistoryOperation) + sizeof(int) * count * (physicals ? 2 : 1);
+  step->bytes += bytes;
+  sheet->history->bytes += bytes;
+}
+
+// Ends the current step, so the edits after this are undone separately
+void historyCheckpoint(Sheet *sheet) {
+  History *history = sheet->history;
+  if (!history || !history->current)
+    return;
+  historyPush(&history->undo, &history->undoCount, &history->undoCapacity, history->current);
+  history->current = NULL;
+  // The newest step is always kept, however big
+  int forgotten = 0;
+  while (history->bytes > history->maxBytes && forgotten < history->undoCount - 1) {
+    historyStepFree(history, history->undo[forgotten++]);
+  }
+  if (forgotten) {
+    memmove(history->undo, history->undo + forgotten, sizeof(HistoryStep *) * (history->undoCount - forgotten));
+    history->undoCount -= forgotten;
+  }
+}
+
+// Puts back everything the step changed, and returns the step that puts it all back again
+HistoryStep *historyApply(Sheet *sheet, HistoryStep *step) {
+  History *history = sheet->history;
+  history->current = historyStepNew(sheet);
+
+  // Rows and columns first, newest first, so the cells and formulas below go back into the rows and columns they were in
+  for (int i = step->operationCount - 1; i >= 0; i--) {
+    HistoryOperation *operation = &step->operations[i];
+    switch (operation->type) {
+      case JOURNAL_INSERT_ROW: sheetDeleteRows(sheet, operation->index, operation->count); break;
+      case JOURNAL_INSERT_COLUMN: sheetDeleteColumns(sheet, operation->index, operation->count); break;
+      case JOURNAL_DELETE_ROW: sheetInsertRows(sheet, operation->index, operation->count, operation->physicals, operation->sizes); break;
+      case JOURNAL_DELETE_COLUMN: sheetInsertColumns(sheet, operation->index, operation->count, operation->physicals, operation->sizes); break;
+      case JOURNAL_SET_ROW_HEIGHT: sheetSetRowHeight(sheet, operation->index, operation->sizes[0]); break;
+      case JOURNAL_SET_COLUMN_WIDTH: sheetSetColumnWidth(sheet, operation->index, operation->sizes[0]); break;
+      default: break;
+    }
+  }
+
+  for (int i = 0; i < step->tileCount; i++) {
+    HistoryTile *saved = &step->tiles[i];
+    for (int tileRow = 0; tileRow < TILE_SIZE; tileRow++) {
+      uint64_t changed = saved->changed[tileRow];
+      while (changed) {
+        int tileColumn = __builtin_ctzll(changed);
+        changed &= changed - 1;
+        int physicalRow = (saved->tile.tileRow << TILE_SHIFT) + tileRow;
+        int physicalColumn = (saved->tile.tileColumn << TILE_SHIFT) + tileColumn;
+        String old = tileCellText(&saved->tile, tileRow, tileColumn);
+        String now = tileStoreGet(&sheet->cells, physicalRow, physicalColumn);
+        if (old.length == now.length && (!old.length || !memcmp(old.value, now.value, old.length)))
+          continue;
+        // Cells of rows and columns that are deleted now were empty before the step, as physical rows and columns are
+        // emptied when they're deleted
+        int row = sheetRowOfPhysicalRow(sheet, physicalRow);
+        int column = sheetColumnOfPhysicalColumn(sheet, physicalColumn);
+        if (row == -1 || column == -1)
+          continue;
+        sheetCommitCell(sheet, row, column, old);
+        sheetCellChanged(sheet, row, column);
+      }
+    }
+  }
+
+  DynamicIntArray roots = dynamicIntArrayNew(8);
+  for (int i = 0; i < step->formulaCount; i++) {
+    HistoryFormula *saved = &step->formulas[i];
+    int id = cellMapGet(&sheet->formulas.formulaAt, cellKey(saved->physicalRow, saved->physicalColumn));
+    if (id == -1)
+      continue;
+    historySaveFormula(sheet, id);
+    formulaSetCode(sheet, id, &saved->code, saved->error);
+    // Replaying the journal's deletes and inserts doesn't bring the old code back by itself
+    journalRecordFormula(sheet, id);
+    dynamicIntArrayPush(&roots, id);
+  }
+  if (roots.length)
+    formulasRecalculate(sheet, &roots);
+  free(roots.data);
+
+  sheet->selectedRow = clamp(step->selectedRow, 0, sheet->rowCount - 1);
+  sheet->selectedColumn = clamp(step->selectedColumn, 0, sheet->columnCount - 1);
+  HistoryStep *inverse = history->current;
+  history->current = NULL;
+  return inverse;
+}
+
+Boolean historyUndo(Sheet *sheet) {
+  History *history = sheet->history;
+  if (!history || !history->undoCount)
+    return FALSE;
+  int64_t start = traceBegin();
+  HistoryStep *step = history->undo[--history->undoCount];
+  historyPush(&history->redo, &history->redoCount, &history->redoCapacity, historyApply(sheet, step));
+  historyStepFree(history, step);
+  traceEnd("historyUndo", start);
+  return TRUE;
+}
+
+Boolean historyRedo(Sheet *sheet) {
+  History *history = sheet->history;
+  if (!history || !history->redoCount)
+    return FALSE;
+  int64_t start = traceBegin();
+  HistoryStep *step = history->redo[--history->redoCount];
+  historyPush(&history->undo, &history->undoCount, &history->undoCapacity, historyApply(sheet, step));
+  historyStepFree(history, step);
+  traceEnd("historyRedo", start);
+  return TRUE;
+}
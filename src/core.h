@@ -0,0 +1,776 @@
+#ifndef CORE_H
+#define CORE_H
+
+// The spreadsheet itself: cells, formulas, editing, CSV import, workbook files and the journal. Nothing in here knows
+// about windows or fonts so it builds without X11, pango or cairo, for the GUI in linux.c and the benchmarks in bench.c.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <limits.h>
+
+typedef char Boolean;
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+typedef struct String {
+  char *value;
+  int length;
+} String;
+
+// Text with a gap at the cursor so inserting and deleting at the cursor is amortized O(1)
+typedef struct GapBuffer {
+  char *data;
+  int capacity;
+  int gapStart;
+  int gapEnd;
+} GapBuffer;
+
+
+
+//******************************************//
+//                   Util                   //
+//******************************************//
+
+char keyToUpper(char key);
+int intToStringInto(int number, char *buffer);
+int intToLettersInto(int number, char *buffer);
+String intToString(int number);
+String intToLetters(int number);
+int clamp(int number, int lower, int higher);
+Boolean stringsEqual(char *str, int strLength, char *otherStr);
+uint64_t hashKey(uint64_t key);
+int64_t nowNanoseconds();
+
+
+
+//******************************************//
+//                  Trace                   //
+//******************************************//
+
+extern Boolean traceEnabled;
+int64_t traceBegin();
+void traceEnd(char *name, int64_t start);
+Boolean traceDump(char *path);
+
+
+
+//******************************************//
+//                  String                  //
+//******************************************//
+
+GapBuffer gapBufferNew(int capacity);
+int gapBufferLength(GapBuffer *buffer);
+void gapBufferClear(GapBuffer *buffer);
+void gapBufferMoveGap(GapBuffer *buffer, int position);
+void gapBufferInsert(GapBuffer *buffer, int position, char *text, int length);
+void gapBufferDelete(GapBuffer *buffer, int position);
+String gapBufferContents(GapBuffer *buffer);
+void gapBufferSet(GapBuffer *buffer, String string);
+
+
+
+//******************************************//
+//               String Array               //
+//******************************************//
+
+typedef struct DynamicStringArray {
+  int length;
+  int capacity;
+  String *data;
+} DynamicStringArray;
+
+DynamicStringArray dynamicStringArrayNew(int capacity);
+void dynamicStringArrayInsert(DynamicStringArray *array, String element, int index);
+void dynamicStringArrayRemove(DynamicStringArray *array, int element, int index);
+
+
+
+//******************************************//
+//               Int Array               //
+//******************************************//
+
+typedef struct DynamicIntArray {
+  int length;
+  int capacity;
+  int *data;
+} DynamicIntArray;
+
+DynamicIntArray dynamicIntArrayNew(int capacity);
+void dynamicIntArrayInsert(DynamicIntArray *array, int element, int index);
+void dynamicIntArrayInsertRepeated(DynamicIntArray *array, int element, int index, int count);
+void dynamicIntArrayRemove(DynamicIntArray *array, int element, int index);
+void dynamicIntArrayRemoveRange(DynamicIntArray *array, int index, int count);
+void dynamicIntArrayPush(DynamicIntArray *array, int element);
+void dynamicIntArrayRemoveValue(DynamicIntArray *array, int element);
+
+
+
+//******************************************//
+//               Cell Map                   //
+//******************************************//
+
+// Open addressing hash map from a 64 bit key (usually a packed row and column, see cellKey) to a non-negative int
+typedef struct CellMap {
+  int count;
+  int capacity; // Must be a power of two
+  uint64_t *keys;
+  int *values; // -1 for empty slots
+} CellMap;
+
+uint64_t cellKey(int row, int column);
+CellMap cellMapNew(int capacity);
+int cellMapFindSlot(CellMap *map, uint64_t key);
+int cellMapGet(CellMap *map, uint64_t key);
+void cellMapPut(CellMap *map, uint64_t key, int value);
+void cellMapRemove(CellMap *map, uint64_t key);
+void cellMapClear(CellMap *map);
+
+
+
+//******************************************//
+//               Size Index                 //
+//******************************************//
+
+typedef struct SizeIndex {
+  int64_t *tree; // 1 based, tree[i] is the sum of the (i & -i) sizes up to and including size i - 1
+  int count;
+  int capacity;
+  int staleFrom; // Sizes from here on were inserted, removed or moved since the tree was built
+} SizeIndex;
+
+void sizeIndexRebuild(SizeIndex *index, DynamicIntArray *sizes, int from);
+void sizeIndexInvalidate(SizeIndex *index, int from);
+void sizeIndexUpdate(SizeIndex *index, DynamicIntArray *sizes);
+void sizeIndexAdd(SizeIndex *index, int i, int delta);
+int64_t sizeIndexOffset(SizeIndex *index, int i);
+int sizeIndexFind(SizeIndex *index, int64_t position, int64_t unit, int64_t extra);
+
+
+
+//******************************************//
+//               Text Arena                 //
+//******************************************//
+
+#define TEXT_ARENA_CLASS_COUNT 9 // 16 bytes up to 4KB
+
+typedef struct TextArena {
+  char *freeLists[TEXT_ARENA_CLASS_COUNT]; // A free block starts with a pointer to the next free block
+  char *slabs; // A slab starts with a pointer to the previous slab
+  char *slabNext; // Unused part of the newest slab
+  char *slabEnd;
+  size_t bytesInUse; // Size of all blocks handed out and not yet freed, including blocks from malloc
+  size_t bytesReserved; // Size of all slabs plus blocks from malloc
+  // Memory the arena doesn't own but cells may point into, like an imported file. Text in there is never freed.
+  char **borrowedStarts;
+  size_t *borrowedSizes;
+  int borrowedCount;
+} TextArena;
+
+int textArenaSizeClass(int length);
+char *textArenaAlloc(TextArena *arena, int length);
+void textArenaFree(TextArena *arena, char *text, int length);
+void textArenaBorrow(TextArena *arena, char *start, size_t size);
+String textArenaCopy(TextArena *arena, char *text, int length);
+
+
+
+//******************************************//
+//               Tile Store                 //
+//******************************************//
+
+// Cells are stored sparsely in TILE_SIZE x TILE_SIZE tiles that are only allocated once something is written into them,
+// so empty parts of a sheet cost nothing. Tiles are found through an open addressing hash map keyed on the tile's row and column.
+// Inside a tile only the filled cells are stored, packed in row major order, with a bitmap saying which cells they are.
+// That keeps a tile holding a single column of values down to a few hundred bytes.
+#define TILE_SIZE 64 // One uint64_t of the occupancy bitmap per row of the tile, so this has to stay at 64
+
+typedef struct Tile {
+  int tileRow;
+  int tileColumn;
+  int filledCellCount;
+  int capacity;
+  uint64_t occupied[TILE_SIZE]; // Bit c of occupied[r] is set when cell (r, c) of the tile is filled
+  uint16_t filledBeforeRow[TILE_SIZE]; // How many filled cells there are in the rows before r
+  String *cells; // The filled cells, row major
+} Tile;
+
+// Tiles can also live in a mapped workbook file (see Workbook Files) until they are first looked at. In the file a tile is
+// a MappedTileHeader followed by a MappedCell per filled cell and then the cells' text, and the tiles are found through
+// an index of MappedTileEntry sorted by tile row and column.
+typedef struct MappedTileEntry {
+  int tileRow;
+  int tileColumn;
+  uint64_t offset;
+} MappedTileEntry;
+
+typedef struct MappedTiles {
+  char *data;
+  size_t size;
+  MappedTileEntry *entries;
+  int count;
+  Boolean *faulted; // Set once the tile has been copied into the store, after which the store's copy is the only one
+} MappedTiles;
+
+typedef struct TileStore {
+  int tileCount;
+  int capacity; // Must be a power of two
+  Tile **tiles; // NULL for empty slots
+  Tile *lastTile; // Neighbouring cells are usually read together so remember the last tile found
+  MappedTiles mapped;
+} TileStore;
+
+int tileCellIndex(Tile *tile, int row, int column);
+Boolean tileCellFilled(Tile *tile, int row, int column);
+void tileSetCell(Tile *tile, int row, int column, String string);
+void tileFree(Tile *tile);
+uint64_t tileKeyHash(int tileRow, int tileColumn);
+TileStore tileStoreNew(int capacity);
+int tileStoreFindSlot(TileStore *store, int tileRow, int tileColumn);
+void tileStoreGrow(TileStore *store);
+void tileStoreInsert(TileStore *store, Tile *tile);
+int mappedTilesFind(MappedTiles *mapped, int tileRow, int tileColumn);
+Tile *tileStoreFault(TileStore *store, int index);
+void tileStoreFaultAll(TileStore *store);
+Tile *tileStoreGetTile(TileStore *store, int tileRow, int tileColumn);
+Tile *tileStoreGetOrCreateTile(TileStore *store, int tileRow, int tileColumn);
+void tileStoreRemoveTile(TileStore *store, Tile *tile);
+String tileCellText(Tile *tile, int row, int column);
+String tileStoreGet(TileStore *store, int row, int column);
+String tileStoreGetShared(TileStore *store, int row, int column);
+void tileStoreSet(TileStore *store, int row, int column, String string);
+void tileStoreClearRow(TileStore *store, TextArena *arena, int row, int columnCount);
+void tileStoreClearColumn(TileStore *store, TextArena *arena, int column, int rowCount);
+size_t tileStoreMemoryUsage(TileStore *store);
+
+
+
+//******************************************//
+//               Number Lanes               //
+//******************************************//
+
+// Numbers are parsed once when a cell is committed and kept per physical column in a lane of doubles, next to a bitmap of
+// which cells hold a number, so aggregates run over plain arrays instead of reparsing text. Lanes are split into blocks
+// of LANE_BLOCK_SIZE physical rows that are only allocated once something numeric (or a formula) lands in them.
+#define LANE_BLOCK_SIZE 4096
+
+typedef struct LaneBlock {
+  double values[LANE_BLOCK_SIZE]; // 0 where the cell isn't a number
+  uint64_t numeric[LANE_BLOCK_SIZE / 64]; // Validity bitmap: bit set when the cell is a number or a formula that evaluated to one
+  uint64_t failed[LANE_BLOCK_SIZE / 64]; // Bit set when the cell is a formula that evaluated to an error
+} LaneBlock;
+
+typedef struct NumberLane {
+  LaneBlock **blocks; // NULL for blocks with nothing in them
+  int blockCount;
+  char *borrowedStart; // Blocks in here are in a mapped workbook file rather than malloced
+  size_t borrowedSize;
+} NumberLane;
+
+typedef struct LaneTotals {
+  double sum;
+  double min;
+  double max;
+  int count;
+  Boolean failed;
+} LaneTotals;
+
+typedef void (*LaneKernel)(const double *values, LaneTotals *totals);
+
+LaneBlock *laneGetBlock(NumberLane *lane, int row);
+void laneReserveBlock(NumberLane *lane, int block);
+LaneBlock *laneGetOrCreateBlock(NumberLane *lane, int row);
+void laneBlockSet(LaneBlock *block, int row, double value, Boolean numeric, Boolean failed);
+void laneClearRow(NumberLane *lane, int row);
+void laneFree(NumberLane *lane);
+void laneKernelScalar(const double *values, LaneTotals *totals);
+#if defined(__x86_64__) || defined(__i386__)
+void laneKernelSse2(const double *values, LaneTotals *totals);
+void laneKernelAvx2(const double *values, LaneTotals *totals);
+#endif
+extern LaneKernel laneKernel;
+extern char *laneKernelName;
+void laneKernelSelect();
+void laneBlockAggregate(LaneBlock *block, int start, int end, LaneTotals *totals);
+
+
+
+//******************************************//
+//               Formulas                   //
+//******************************************//
+
+// Cells whose text starts with '=' are formulas, e.g. =A1+B2*3 or =SUM(A1:C10, 2). They are compiled into bytecode for a
+// small stack machine. References are compiled to physical rows and columns, so they keep pointing at the same cells
+// when rows and columns are inserted or deleted around them.
+//
+// Each formula is a node in a dependency graph. A cell's dependents are the formulas that reference it directly
+// (looked up in dependents) or through a range (looked up in the range index). When a cell changes only the formulas
+// reachable from it are recalculated, in topological order. Formulas that are left over in a cycle get #CYCLE!.
+typedef enum FormulaOp {
+  FORMULA_NUMBER, // Followed by the low and high halves of a double
+  FORMULA_CELL, // Followed by a physical row and column
+  FORMULA_ADD,
+  FORMULA_SUBTRACT,
+  FORMULA_MULTIPLY,
+  FORMULA_DIVIDE,
+  FORMULA_NEGATE,
+  FORMULA_AGGREGATE_BEGIN, // Followed by a FormulaFunction
+  FORMULA_AGGREGATE_VALUE, // Adds the value on top of the stack to the current aggregate
+  FORMULA_AGGREGATE_RANGE, // Followed by the physical row and column of the top left and bottom right corners
+  FORMULA_AGGREGATE_END, // Pushes the result of the current aggregate
+} FormulaOp;
+
+typedef enum FormulaFunction {
+  FORMULA_SUM,
+  FORMULA_AVERAGE,
+  FORMULA_MIN,
+  FORMULA_MAX,
+  FORMULA_COUNT,
+} FormulaFunction;
+
+typedef enum FormulaError {
+  FORMULA_OK,
+  FORMULA_ERROR_PARSE,
+  FORMULA_ERROR_VALUE,
+  FORMULA_ERROR_REF,
+  FORMULA_ERROR_DIVIDE_BY_ZERO,
+  FORMULA_ERROR_CYCLE,
+} FormulaError;
+
+typedef struct Formula {
+  int physicalRow; // -1 when this slot is free
+  int physicalColumn;
+  DynamicIntArray code;
+  Boolean hasRanges;
+  double value;
+  FormulaError error;
+  char display[32]; // value or error as text, for rendering
+
+  // Scratch state for recalculation
+  int visited; // Equal to FormulaEngine.generation when the formula is in the current dirty set
+  int pending; // Precedents in the dirty set that are not evaluated yet
+  int edgeStart; // This formula's dependents in the dirty set are edges[edgeStart .. edgeStart + edgeCount]
+  int edgeCount;
+} Formula;
+
+typedef struct FormulaEngine {
+  Formula *formulas;
+  int formulaCount; // Slots used, including free ones
+  int formulaCapacity;
+  DynamicIntArray freeFormulas;
+  CellMap formulaAt; // Physical cell -> formula in that cell
+  CellMap dependentsAt; // Physical cell -> index into dependentLists of the formulas referencing it directly
+  DynamicIntArray *dependentLists;
+  int dependentListCount;
+  int dependentListCapacity;
+  // Range index: the sheet is split into TILE_SIZE x TILE_SIZE buckets of visible rows and columns, and every formula
+  // with a range is listed in each bucket its range overlaps. Rebuilt when rows or columns move.
+  DynamicIntArray rangeFormulas;
+  CellMap rangeBuckets; // Bucket -> index into rangeBucketLists
+  DynamicIntArray *rangeBucketLists;
+  int rangeBucketListCount;
+  int rangeBucketListCapacity;
+  Boolean rangeIndexStale;
+
+  // Scratch space for recalculation
+  int generation;
+  DynamicIntArray dirty;
+  DynamicIntArray edges;
+  DynamicIntArray ready;
+  int recalculatedCount; // Formulas evaluated by the last recalculation
+  int threadCount; // Threads used to evaluate big recalculations, including the calling one
+} FormulaEngine;
+
+extern char *formulaErrorText[];
+FormulaEngine formulaEngineNew();
+void formulaListAdd(CellMap *map, DynamicIntArray **lists, int *listCount, int *listCapacity, uint64_t key, int formula);
+void formulaEmitNumber(DynamicIntArray *code, double number);
+double formulaReadNumber(int *code);
+int formulaOpLength(int op);
+Boolean parseNumber(String string, double *number);
+Boolean isFormula(String string);
+
+
+
+//******************************************//
+//               Sheet                      //
+//******************************************//
+
+typedef struct Journal Journal;
+typedef struct History History;
+
+// A rectangle of cells, inclusive of its last row and column
+typedef struct CellRange {
+  int top;
+  int left;
+  int bottom;
+  int right;
+} CellRange;
+
+typedef struct Sheet {
+  DynamicIntArray cellWidths; // In characters
+  DynamicIntArray cellHeights; // In lines
+  SizeIndex columnIndex; // Over cellWidths and cellHeights, see sheetColumnOffset and sheetRowOffset
+  SizeIndex rowIndex;
+  // Cells are stored at physical rows and columns which never move. rowMap and columnMap translate the rows and columns
+  // the user sees into physical ones, so inserting or deleting a row or column only shifts one of these maps.
+  TileStore cells;
+  DynamicIntArray rowMap;
+  DynamicIntArray columnMap;
+  int physicalRowCount; // Physical rows and columns handed out so far
+  int physicalColumnCount;
+  DynamicIntArray freePhysicalRows; // Physical rows and columns of deleted rows and columns, already emptied, for reuse
+  DynamicIntArray freePhysicalColumns;
+  DynamicIntArray rowOfPhysicalRow; // Inverse of rowMap and columnMap, -1 for deleted rows and columns
+  DynamicIntArray columnOfPhysicalColumn;
+  int columnCount;
+  int rowCount;
+  int selectedRow;
+  int selectedColumn;
+  // The other corner of a range selected with the mouse, the selected cell being the corner that moves. -1 when only
+  // the selected cell is selected.
+  int anchorRow;
+  int anchorColumn;
+  Boolean insertMode;
+  int count; // Typed so far before a command, like the 5000 of 5000o. 0 when none has been.
+  int lastCount; // Of the command . repeats
+  Boolean importing; // Rows are still arriving from a CSV import, so only moving around is allowed
+  // While in insert mode the selected cell's text lives in editBuffer, and is copied into textArena when the edit ends
+  GapBuffer editBuffer;
+  Boolean editing;
+  int editRow;
+  int editColumn;
+  TextArena textArena;
+  NumberLane *lanes; // Numeric values of the cells, per physical column
+  int laneCount;
+  FormulaEngine formulas;
+  // Formulas of an opened workbook that are still to be loaded, as they are laid out in the mapped file
+  int *unloadedFormulas;
+  int unloadedFormulaCount;
+  char *path; // Where w saves the workbook
+  uint64_t snapshotId; // Of the workbook the sheet was opened from or last saved to, 0 if there isn't one
+  Journal *journal; // Where edits are logged, NULL while they shouldn't be (importing, replaying, benchmarks)
+  History *history; // Where edits are kept for undo, NULL the same way as journal
+  int verticalPadding;
+  int horizontalPadding;
+
+  // Viewport: the first row and column drawn, and how many rows and columns fully fit in the window.
+  // The visible counts are measured by render() since they depend on the window and font.
+  // Scrolling with the mouse wheel can leave the first row and column partly scrolled off, by the pixel counts.
+  int scrollRow;
+  int scrollColumn;
+  int scrollRowPixels;
+  int scrollColumnPixels;
+  int visibleRowCount;
+  int visibleColumnCount;
+
+  // Edits since the last frame, drained by render() to invalidate anything it cached for those cells.
+  // Stored as pairs of row, column.
+  DynamicIntArray changedCells;
+  Boolean structureChanged;
+} Sheet;
+
+#define SHEET_MAX_COUNT 10000000 // The most times over a command can be done with a count
+
+extern const int TEMP_CELL_WIDTH;
+extern const int TEMP_CELL_HEIGHT;
+Sheet newSheet(int rowCount, int columnCount);
+String sheetGetCell(Sheet *sheet, int row, int column);
+void sheetSetCell(Sheet *sheet, int row, int column, String string);
+NumberLane *sheetGetLane(Sheet *sheet, int physicalColumn);
+NumberLane *sheetGetOrCreateLane(Sheet *sheet, int physicalColumn);
+void sheetUpdateLane(Sheet *sheet, int physicalRow, int physicalColumn, String text);
+void sheetCellChanged(Sheet *sheet, int row, int column);
+int sheetRowHeight(Sheet *sheet, int row, int lineHeight);
+int sheetColumnWidth(Sheet *sheet, int column, int charWidth);
+int64_t sheetRowOffset(Sheet *sheet, int row, int lineHeight);
+int64_t sheetColumnOffset(Sheet *sheet, int column, int charWidth);
+int sheetRowAtOffset(Sheet *sheet, int64_t offset, int lineHeight);
+int sheetColumnAtOffset(Sheet *sheet, int64_t offset, int charWidth);
+CellRange sheetSelection(Sheet *sheet);
+
+
+
+//******************************************//
+//               Formula Engine             //
+//******************************************//
+
+int sheetRowOfPhysicalRow(Sheet *sheet, int physicalRow);
+int sheetColumnOfPhysicalColumn(Sheet *sheet, int physicalColumn);
+Boolean formulaCodeHasRanges(DynamicIntArray *code);
+void formulaCompile(Sheet *sheet, Formula *formula, String text);
+FormulaError formulaCellValue(Sheet *sheet, int physicalRow, int physicalColumn, double *value, Boolean *isNumber);
+void formulaStoreResult(Sheet *sheet, Formula *formula);
+void formulaEvaluate(Sheet *sheet, Formula *formula);
+void formulaIndexRanges(Sheet *sheet, int id);
+void formulaRebuildRangeIndex(Sheet *sheet);
+void formulaLink(Sheet *sheet, int id);
+void formulaUnlink(Sheet *sheet, int id);
+void formulaSetCode(Sheet *sheet, int id, DynamicIntArray *code, FormulaError error);
+Boolean formulaCodeTranslate(Sheet *sheet, DynamicIntArray *code, Boolean toVisible);
+Boolean formulaRangeContains(Sheet *sheet, Formula *formula, int row, int column);
+void formulaDependents(Sheet *sheet, int physicalRow, int physicalColumn, DynamicIntArray *dependents);
+void *recalcWorkerRun(void *argument);
+int formulasEvaluateParallel(Sheet *sheet);
+void formulasRecalculate(Sheet *sheet, DynamicIntArray *roots);
+void formulaRemove(Sheet *sheet, int id);
+int formulaAdd(Sheet *sheet, int physicalRow, int physicalColumn);
+void formulasRecalculateAll(Sheet *sheet);
+void formulasCellChanged(Sheet *sheet, int physicalRow, int physicalColumn, String text);
+void formulasBeforeDelete(Sheet *sheet, Boolean column, int index, int count, DynamicIntArray *roots);
+String sheetGetCellDisplay(Sheet *sheet, int row, int column);
+
+
+
+//******************************************//
+//               Sheet Editing              //
+//******************************************//
+
+// Every edit is logged to the sheet's journal (see Journal) as it is made
+typedef enum JournalRecordType {
+  JOURNAL_SET_CELL = 1, // The cell's text is replaced by the record's text
+  JOURNAL_BEGIN_EDIT,
+  JOURNAL_EDIT_APPEND, // Text typed into the cell being edited
+  JOURNAL_EDIT_BACKSPACE, // The character at index deleted from the cell being edited
+  JOURNAL_INSERT_ROW, // index rows
+  JOURNAL_INSERT_COLUMN, // index columns
+  JOURNAL_DELETE_ROW,
+  JOURNAL_DELETE_COLUMN,
+  JOURNAL_SET_ROW_HEIGHT, // To index lines
+  JOURNAL_SET_COLUMN_WIDTH, // To index characters
+  JOURNAL_SET_FORMULA, // The cell's formula gets the record's code (references as visible rows and columns), error index
+} JournalRecordType;
+
+void sheetScrollToSelection(Sheet *sheet);
+void sheetUpdateViewport(Sheet *sheet, int width, int height, int charWidth, int lineHeight);
+void sheetScrollByPixels(Sheet *sheet, int x, int y, int width, int height, int charWidth, int lineHeight);
+int sheetNewPhysicalRow(Sheet *sheet);
+int sheetNewPhysicalColumn(Sheet *sheet);
+void sheetReindexRows(Sheet *sheet, int row);
+void sheetReindexColumns(Sheet *sheet, int column);
+void sheetInsertRows(Sheet *sheet, int row, int count, int *physicals, int *heights);
+void sheetInsertColumns(Sheet *sheet, int column, int count, int *physicals, int *widths);
+void sheetAppendRows(Sheet *sheet, int row, int count);
+void sheetAppendColumns(Sheet *sheet, int column, int count);
+void sheetAppendRow(Sheet *sheet, int row);
+void sheetAppendColumn(Sheet *sheet, int column);
+void sheetSetRowHeight(Sheet *sheet, int row, int lines);
+void sheetSetColumnWidth(Sheet *sheet, int column, int characters);
+void sheetDeleteRows(Sheet *sheet, int row, int count);
+void sheetDeleteColumns(Sheet *sheet, int column, int count);
+void sheetDeleteRow(Sheet *sheet, int row);
+void sheetDeleteColumn(Sheet *sheet, int column);
+void sheetCommitCell(Sheet *sheet, int row, int column, String string);
+void sheetBeginEdit(Sheet *sheet, int row, int column);
+void sheetEndEdit(Sheet *sheet);
+Boolean sheetIsEditing(Sheet *sheet, int row, int column);
+void sheetCellBackSpace(Sheet *sheet, int row, int column, int stringIndex);
+void sheetCellAppend(Sheet *sheet, int row, int column, char* valueToInsert, int valueToInsertLength);
+#define KEY_CONTROL(key) ((key) & 0x1f) // What handleNormalModeInput is given for a key pressed with control held down
+char handleNormalModeInput(Sheet *sheet, char charKeyPressed, Boolean useRecordedCommand, char lastCharKeyPressed, String text);
+
+
+
+//******************************************//
+//               CSV Import                 //
+//******************************************//
+
+typedef struct CsvChunk {
+  char *start; // Records starting after a newline in [start, end) belong to the chunk, as does the first record for the first chunk
+  char *end;
+  int quoteParity;
+  int newlineCounts[2]; // Newlines outside quotes, counted as if the chunk started outside quotes [0] or inside them [1]
+  char *firstRecords[2]; // Where the first record starting in the chunk is, the same way round. NULL if there is none.
+  Boolean startsQuoted;
+  int firstRow;
+
+  // Filled in by the thread parsing the chunk, and only looked at by anybody else once done is set
+  int recordCount;
+  TileStore cells;
+  NumberLane *lanes;
+  int laneCount;
+  DynamicIntArray formulaCells; // Pairs of row, column of the cells starting with '='
+  int columnCount;
+  int done;
+  Boolean merged;
+} CsvChunk;
+
+typedef struct CsvImport {
+  char *data;
+  size_t size;
+  CsvChunk *chunks;
+  int chunkCount;
+  int threadCount;
+  pthread_t loader;
+  int nextChunk;
+  int counted; // Set once every chunk knows its first row, rowCount is valid from then on
+  int rowCount;
+  int mergedCount;
+  int wakePipe[2]; // The loader writes a byte here whenever there is something to merge
+  Boolean active;
+  int64_t startTime;
+  int64_t firstChunkTime;
+} CsvImport;
+
+void tileAppendCell(Tile *tile, int row, int column, String string);
+void tileRebuildCounts(Tile *tile);
+void tileStoreMerge(TileStore *store, TileStore *source);
+void laneMerge(NumberLane *lane, NumberLane *source);
+void csvChunkCount(CsvChunk *chunk);
+NumberLane *csvChunkLane(CsvChunk *chunk, int column);
+void csvChunkParse(CsvImport *import, CsvChunk *chunk);
+void csvImportWake(CsvImport *import);
+void *csvCountWorker(void *argument);
+void *csvParseWorker(void *argument);
+void csvRunWorkers(CsvImport *import, void *(*worker)(void *), int firstChunk);
+void *csvImportLoader(void *argument);
+Boolean csvImportStart(CsvImport *import, Sheet *sheet, char *path, int threadCount);
+void sheetGrow(Sheet *sheet, int rowCount, int columnCount);
+void formulasLoad(Sheet *sheet, int physicalRow, int physicalColumn, String text);
+Boolean csvImportPoll(CsvImport *import, Sheet *sheet);
+
+
+
+//******************************************//
+//               Workbook Files             //
+//******************************************//
+
+Boolean workbookWrite(FILE *file, void *data, size_t size, uint64_t *offset);
+Boolean workbookAlign(FILE *file, uint64_t alignment, uint64_t *offset);
+int compareMappedTileEntries(const void *a, const void *b);
+void workbookLoadFormulas(Sheet *sheet);
+Boolean workbookSave(Sheet *sheet, char *path);
+Boolean workbookIsFile(char *path);
+DynamicIntArray workbookReadInts(char *data, uint64_t offset, int count, int spare);
+Boolean workbookOpen(Sheet *sheet, char *path);
+
+
+
+//******************************************//
+//               Journal                    //
+//******************************************//
+
+struct Journal {
+  char *path;
+  char *sealedPath;
+  char *basePath;
+  int fd;
+  uint64_t snapshotId;
+  uint64_t sequence; // Of the last record
+  char *buffer; // Records not written to the file yet
+  int bufferLength;
+  int bufferCapacity;
+  size_t size; // Of the file
+  pthread_t worker;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // Protected by lock
+  Boolean syncPending;
+  Boolean compactPending;
+  int sealedFd; // Kept open until the compaction, the worker may still be syncing it
+};
+
+void journalRecord(Journal *journal, JournalRecordType type, int row, int column, int index, char *text, int length);
+void journalRecordFormula(Sheet *sheet, int id);
+Boolean journalWriteAll(int fd, char *data, size_t size);
+int journalCreate(char *path, uint64_t snapshotId);
+char *journalReadFile(char *path, size_t *size, uint64_t *snapshotId);
+void journalCompact(Journal *journal);
+void *journalWorker(void *argument);
+void journalFlush(Journal *journal);
+void journalClose(Journal *journal);
+void journalReset(Journal *journal, uint64_t snapshotId);
+char *journalPath(char *path, char *suffix);
+Boolean journalOpen(Journal *journal, Sheet *sheet);
+
+
+
+//******************************************//
+//               Undo History               //
+//******************************************//
+
+// The cells of a tile a step changed, as they were before it. The text is the step's own copy, since the sheet frees its
+// copy when the cell changes again.
+typedef struct HistoryTile {
+  Tile tile; // Just the changed cells that weren't empty
+  uint64_t changed[TILE_SIZE]; // The cells the step changed, the only ones undoing it looks at
+} HistoryTile;
+
+// A formula as it was compiled before a step changed it. Its text alone isn't enough to get it back, since the references
+// it compiled to follow rows and columns around and deleting rows or columns rewrites them.
+typedef struct HistoryFormula {
+  int physicalRow;
+  int physicalColumn;
+  DynamicIntArray code;
+  FormulaError error;
+} HistoryFormula;
+
+// Rows or columns inserted, deleted or resized. Uses the journal's record types.
+typedef struct HistoryOperation {
+  JournalRecordType type;
+  int index;
+  int count;
+  int *physicals; // Of the rows or columns inserted or deleted
+  int *sizes; // Their sizes, or the size before resizing for JOURNAL_SET_ROW_HEIGHT and JOURNAL_SET_COLUMN_WIDTH
+} HistoryOperation;
+
+typedef struct HistoryStep {
+  HistoryTile *tiles;
+  int tileCount;
+  int tileCapacity;
+  CellMap tileAt; // Tile row and column -> index into tiles
+  HistoryFormula *formulas;
+  int formulaCount;
+  int formulaCapacity;
+  CellMap formulaAt; // Physical cell -> index into formulas
+  HistoryOperation *operations;
+  int operationCount;
+  int operationCapacity;
+  int selectedRow; // When the step started, where undoing it leaves the selection
+  int selectedColumn;
+  size_t bytes;
+} HistoryStep;
+
+struct History {
+  HistoryStep **undo; // Oldest first
+  int undoCount;
+  int undoCapacity;
+  HistoryStep **redo; // Most recently undone last
+  int redoCount;
+  int redoCapacity;
+  HistoryStep *current; // Collecting the edits since the last checkpoint, NULL until something is edited
+  size_t bytes; // Of every step
+  size_t maxBytes; // The oldest steps are forgotten past this
+};
+
+History historyNew(size_t maxBytes);
+HistoryStep *historyStepNew(Sheet *sheet);
+void historyStepFree(History *history, HistoryStep *step);
+void historyPush(HistoryStep ***steps, int *count, int *capacity, HistoryStep *step);
+HistoryStep *historyStep(Sheet *sheet);
+void historySaveCell(Sheet *sheet, int physicalRow, int physicalColumn);
+void historySaveRow(Sheet *sheet, int physicalRow);
+void historySaveColumn(Sheet *sheet, int physicalColumn);
+void historySaveFormula(Sheet *sheet, int id);
+void historyRecordOperation(Sheet *sheet, JournalRecordType type, int index, int count, int *physicals, int *sizes);
+void historyCheckpoint(Sheet *sheet);
+HistoryStep *historyApply(Sheet *sheet, HistoryStep *step);
+Boolean historyUndo(Sheet *sheet);
+Boolean historyRedo(Sheet *sheet);
+
+#endif
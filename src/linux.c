@@ -4,20 +4,20 @@
 #include "pango/pango-layout.h"
 #include "pango/pango-renderer.h"
 #include <X11/X.h>
-#include <stdint.h>
-#include <stdlib.h>
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
-#include <unistd.h>
-#include <stdio.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
 #include <cairo/cairo-xlib.h>
+#include "core.h"
+#include <signal.h>
 // I have manually copied pango into /usr/include/. The same may have to be done for glib. It seems that xlibs font rendering uses X's core font rendering (at least by default) which is not modern and doesn't do things like anti-aliasing (I think) and which is why I am looking to pango. Pango builds on Xft which is also apparently not that modern. Sounds like pango is the go to low level library for font rendering.
 
-typedef char Boolean;
 typedef struct Color {
   double red;
   double blue;
@@ -25,26 +25,73 @@ typedef struct Color {
   double alpha;
 } Color;
 
-typedef struct String {
-  char *value;
-  int length;
-} String;
+typedef struct LayoutCache LayoutCache;
+typedef struct HeaderLabels HeaderLabels;
+typedef struct AsciiGlyphs AsciiGlyphs;
+
+// Where everything is on screen this frame. Computed once per frame and shared by every region that gets repainted.
+typedef struct Frame {
+  int width;
+  int height;
+  float textScale;
+  int textScaledWidthPixels;
+  int textScaledHeightPixels;
+  PangoRectangle logicalRectPangoUnits;
+  int rowNumberColumnWidth;
+  int columnNumberRowHeight;
+  int xoffset;
+  int yoffset;
+  int firstRow;
+  int firstColumn;
+  int64_t firstRowOffset; // Of firstRow and firstColumn from the top left of the sheet, in pixels
+  int64_t firstColumnOffset;
+  int endRow;
+  int endColumn;
+} Frame;
 
 typedef struct Program {
   Display *display;
   Window window;
+  Visual *visual;
+  int depth;
   GC gc;
-  cairo_surface_t *surface;
+  Pixmap backBuffer;
+  int windowWidth; // As of the last ConfigureNotify, or whatever size a headless program is given
+  int windowHeight;
+  int backBufferWidth;
+  int backBufferHeight;
+  cairo_surface_t *surface; // Draws into backBuffer, or shmImage's memory
   cairo_t *cr;
+  // With --shm the back buffer is an image in memory shared with the X server instead of a pixmap, see shmBackBufferCreate
+  Boolean useShm;
+  XShmSegmentInfo shmInfo;
+  XImage *shmImage;
+  int shmCompletionEvent;
+  int shmPending; // XShmPutImages the server hasn't finished reading yet. Nothing is drawn until they're done.
   PangoFontDescription *font;
   XColor background;
   XColor highlight;
   XColor foreground;
   Color text;
+  LayoutCache *layoutCache;
+  HeaderLabels *headerLabels;
+  AsciiGlyphs *asciiGlyphs;
+  Boolean pangoOnly; // Every cell is shaped by pango, skipping the ASCII fast path. For comparing the two in benchmarks.
+  Frame lastFrame;
+  CellRange lastSelection;
+  // Dragging out a range with the mouse. Motion only records where the pointer is, and is applied once per batch of input.
+  Boolean dragging;
+  Boolean dragMoved;
+  int dragX;
+  int dragY;
+  // Pixels the wheel has scrolled by since the last batch of input, applied along with the drag
+  int wheelX;
+  int wheelY;
 
   Boolean shiftDown;
+  Boolean controlDown;
   char lastCharKeyPressed;
-  String lastTextInserted;
+  GapBuffer lastTextInserted;
 } Program;
 
 
@@ -53,539 +100,1085 @@ typedef struct Program {
 //                   Util                   //
 //******************************************//
 
-char keyToUpper(char key) {
-  if (key > 96 && key < 123) {
-    return key - 32;
-  }
-  return key; // TODO
+
+char keyPressedToChar(char *keyPressed) {
+  if (stringsEqual("period", 6, keyPressed)) return '.';
+  if (stringsEqual("equal", 5, keyPressed)) return '=';
+  if (stringsEqual("minus", 5, keyPressed)) return '-';
+  if (stringsEqual("bracketleft", 11, keyPressed)) return '[';
+  if (stringsEqual("bracketright", 12, keyPressed)) return ']';
+  return keyPressed[0];
 }
 
-String intToString(int number) {
-  String string = {0};
-  string.length = 1;
-  int a = number;
-  while (a > 9) {
-    string.length++;
-    a /= 10;
-  }
-  string.value = malloc(sizeof(char) * string.length);
-  for (int i = string.length - 1; i >= 0; i--) {
-    char character = number % 10;
-    character += 48;
-    string.value[i] = character;
-    number /= 10;
-  }
-  return string;
+
+
+//******************************************//
+//               Layout Cache               //
+//******************************************//
+
+// Shaped layouts for cell text, so a cell is only reshaped by pango after it is edited.
+// Direct mapped on the cell's row and column; a collision just evicts the older cell.
+#define LAYOUT_CACHE_SIZE 4096 // Must be a power of two
+
+typedef struct LayoutCacheEntry {
+  int row; // -1 when the entry is empty
+  int column;
+  PangoLayout *layout;
+} LayoutCacheEntry;
+
+typedef struct LayoutCache {
+  LayoutCacheEntry entries[LAYOUT_CACHE_SIZE];
+  int hits;
+  int misses;
+} LayoutCache;
+
+// Printed with the trace on T or SIGUSR1, since the counts only mean something over a stretch of frames
+void layoutCachePrintStats(LayoutCache *cache) {
+  int lookups = cache->hits + cache->misses;
+  printf("layout cache: %d hits, %d misses (%.1f%% hits)\n", cache->hits, cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0);
 }
 
-String intToLetters(int number) {
-  String string = {0};
-  string.length = 1;
-  int a = number;
-  while (a > 25) {
-    string.length++;
-    a /= 26;
+LayoutCache *layoutCacheNew() {
+  LayoutCache *cache = calloc(1, sizeof(LayoutCache));
+  for (int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+    cache->entries[i].row = -1;
   }
-  string.value = malloc(sizeof(char) * string.length);
-  for (int i = string.length - 1; i >= 0; i--) {
-    char character = number % 26;
-    character += 65;
-    string.value[i] = character;
-    number /= 26;
+  return cache;
+}
+
+LayoutCacheEntry *layoutCacheEntry(LayoutCache *cache, int row, int column) {
+  // Rows and columns on screen are small and consecutive, so mixing them like this spreads the visible cells over the whole cache
+  int slot = (row * 61 + column) & (LAYOUT_CACHE_SIZE - 1);
+  return &cache->entries[slot];
+}
+
+void layoutCacheInvalidate(LayoutCache *cache, int row, int column) {
+  LayoutCacheEntry *entry = layoutCacheEntry(cache, row, column);
+  if (entry->row == row && entry->column == column)
+    entry->row = -1;
+}
+
+// Keeps the PangoLayout objects around so they can be reused for the next cells that land in their entries
+void layoutCacheInvalidateAll(LayoutCache *cache) {
+  for (int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+    cache->entries[i].row = -1;
   }
-  return string;
 }
 
-int clamp(int number, int lower, int higher) {
-  if (number < lower) {
-    return lower;
+// Invalidate the entries of every cell edited since the last frame
+void layoutCacheApplySheetChanges(LayoutCache *cache, Sheet *sheet) {
+  if (sheet->structureChanged) {
+    layoutCacheInvalidateAll(cache);
   }
-  if (number > higher) {
-    return higher;
+  else {
+    for (int i = 0; i < sheet->changedCells.length; i += 2) {
+      layoutCacheInvalidate(cache, sheet->changedCells.data[i], sheet->changedCells.data[i + 1]);
+    }
   }
-  return number;
+  sheet->changedCells.length = 0;
+  sheet->structureChanged = FALSE;
 }
 
-Boolean stringsEqual(char *str, int strLength, char *otherStr) {
-  for (int i = 0; i < strLength; i++) {
-    if (otherStr[i] == '\0')
-      return FALSE;
-    if (str[i] != otherStr[i])
-      return FALSE;
+// The layout is widthCharacters wide and heightLines tall, the size of the cell
+PangoLayout *layoutCacheGet(LayoutCache *cache, cairo_t *cr, PangoFontDescription *font, PangoRectangle logicalRectPangoUnits, String string, int row, int column, int widthCharacters, int heightLines) {
+  LayoutCacheEntry *entry = layoutCacheEntry(cache, row, column);
+  if (entry->row == row && entry->column == column) {
+    cache->hits++;
+    return entry->layout;
   }
-  return TRUE;
-}
+  cache->misses++;
 
-char keyPressedToChar(char *keyPressed) {
-  if (stringsEqual("period", 6, keyPressed)) return '.';
-  return keyPressed[0];
+  if (!entry->layout) {
+    entry->layout = pango_cairo_create_layout(cr);
+    pango_layout_set_font_description(entry->layout, font);
+    pango_layout_set_wrap(entry->layout, PANGO_WRAP_WORD_CHAR);
+    pango_layout_set_ellipsize(entry->layout, PANGO_ELLIPSIZE_END);
+  }
+  pango_layout_set_width(entry->layout, widthCharacters * logicalRectPangoUnits.width + 2); // TODO: why +2. Is this because padding is 4 and maybe borders are 2?
+  pango_layout_set_height(entry->layout, heightLines * logicalRectPangoUnits.height + 2);
+  pango_layout_set_text(entry->layout, string.value, string.length);
+  pango_cairo_update_layout(cr, entry->layout);
+  entry->row = row;
+  entry->column = column;
+  return entry->layout;
 }
 
+
+
 //******************************************//
-//                  String                  //
+//               Header Labels              //
 //******************************************//
 
-String stringInsertChar(String s, char c, int i) {
-  String newString = {0};
-  newString.length = s.length + 1;
-  newString.value = malloc(sizeof(char) * newString.length);
-  for (int oldStringIndex, newStringIndex = 0; newStringIndex < newString.length; newStringIndex++ && oldStringIndex++) {
-    if (i == newStringIndex) {
-      newString.value[newStringIndex] = c;
-      oldStringIndex--;
-      continue;
-    }
-    newString.value[newStringIndex] = s.value[oldStringIndex];
+// Row numbers and column letters are drawn from a glyph atlas: each digit and letter is rasterized once into an alpha
+// mask, and a label is put together from those the first time it's needed. Finished labels are cached per row and
+// column the way layouts are, so drawing a header label is a single mask blit.
+#define HEADER_GLYPHS "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define HEADER_GLYPH_COUNT 36
+#define HEADER_LABEL_CACHE_SIZE 1024 // Must be a power of two
+
+typedef struct HeaderLabel {
+  int index; // Row or column, -1 when the entry is empty
+  cairo_surface_t *mask;
+} HeaderLabel;
+
+typedef struct HeaderLabels {
+  cairo_surface_t *atlas; // Every glyph side by side, with a pixel between them
+  int glyphX[HEADER_GLYPH_COUNT];
+  int glyphWidths[HEADER_GLYPH_COUNT];
+  int height;
+  float textScale; // The atlas was rasterized at, 0 before it's built
+  HeaderLabel rows[HEADER_LABEL_CACHE_SIZE];
+  HeaderLabel columns[HEADER_LABEL_CACHE_SIZE];
+} HeaderLabels;
+
+HeaderLabels *headerLabelsNew() {
+  HeaderLabels *labels = calloc(1, sizeof(HeaderLabels));
+  for (int i = 0; i < HEADER_LABEL_CACHE_SIZE; i++) {
+    labels->rows[i].index = -1;
+    labels->columns[i].index = -1;
   }
-  return newString;
+  return labels;
 }
 
+void headerLabelsBuildAtlas(HeaderLabels *labels, PangoFontDescription *font, float textScale) {
+  cairo_surface_t *scratch = cairo_image_surface_create(CAIRO_FORMAT_A8, 1, 1);
+  cairo_t *scratchCr = cairo_create(scratch);
+  PangoLayout *layout = pango_cairo_create_layout(scratchCr);
+  pango_layout_set_font_description(layout, font);
+  int width = 0;
+  labels->height = 0;
+  for (int i = 0; i < HEADER_GLYPH_COUNT; i++) {
+    PangoRectangle logicalRect;
+    pango_layout_set_text(layout, &HEADER_GLYPHS[i], 1);
+    pango_layout_get_extents(layout, NULL, &logicalRect);
+    labels->glyphX[i] = width;
+    labels->glyphWidths[i] = ceil((double)logicalRect.width / PANGO_SCALE * textScale);
+    width += labels->glyphWidths[i] + 1;
+    labels->height = clamp(ceil((double)logicalRect.height / PANGO_SCALE * textScale), labels->height, INT_MAX);
+  }
+
+  if (labels->atlas)
+    cairo_surface_destroy(labels->atlas);
+  labels->atlas = cairo_image_surface_create(CAIRO_FORMAT_A8, width, labels->height);
+  cairo_t *cr = cairo_create(labels->atlas);
+  pango_cairo_update_layout(cr, layout);
+  for (int i = 0; i < HEADER_GLYPH_COUNT; i++) {
+    pango_layout_set_text(layout, &HEADER_GLYPHS[i], 1);
+    cairo_save(cr);
+    cairo_translate(cr, labels->glyphX[i], 0);
+    cairo_scale(cr, textScale, textScale);
+    pango_cairo_show_layout(cr, layout);
+    cairo_restore(cr);
+  }
+  cairo_destroy(cr);
+  g_object_unref(layout);
+  cairo_destroy(scratchCr);
+  cairo_surface_destroy(scratch);
+  labels->textScale = textScale;
+
+  // Labels put together from the old atlas
+  for (int i = 0; i < HEADER_LABEL_CACHE_SIZE; i++) {
+    labels->rows[i].index = -1;
+    labels->columns[i].index = -1;
+  }
+}
+
+// The label of a row (its number) or column (its letters) as an alpha mask, to be drawn with cairo_mask_surface
+cairo_surface_t *headerLabelGet(HeaderLabels *labels, Boolean column, int index) {
+  HeaderLabel *entry = column ? &labels->columns[index & (HEADER_LABEL_CACHE_SIZE - 1)] : &labels->rows[index & (HEADER_LABEL_CACHE_SIZE - 1)];
+  if (entry->index == index)
+    return entry->mask;
+
+  char text[16];
+  int length = column ? intToLettersInto(index, text) : intToStringInto(index + 1, text);
+  int width = 0;
+  for (int i = 0; i < length; i++) {
+    int glyph = text[i] <= '9' ? text[i] - '0' : text[i] - 'A' + 10;
+    width += labels->glyphWidths[glyph];
+  }
+  if (entry->mask)
+    cairo_surface_destroy(entry->mask);
+  entry->mask = cairo_image_surface_create(CAIRO_FORMAT_A8, width, labels->height);
+  cairo_t *cr = cairo_create(entry->mask);
+  int x = 0;
+  for (int i = 0; i < length; i++) {
+    int glyph = text[i] <= '9' ? text[i] - '0' : text[i] - 'A' + 10;
+    cairo_set_source_surface(cr, labels->atlas, x - labels->glyphX[glyph], 0);
+    cairo_rectangle(cr, x, 0, labels->glyphWidths[glyph], labels->height);
+    cairo_fill(cr);
+    x += labels->glyphWidths[glyph];
+  }
+  cairo_destroy(cr);
+  entry->index = index;
+  return entry->mask;
+}
+
+
+
 //******************************************//
-//               String Array               //
+//               ASCII Glyphs               //
 //******************************************//
 
-typedef struct DynamicStringArray {
+// Most cells are short numbers and codes, and in a monospace font those don't need shaping: every printable ASCII
+// character is one glyph with the same advance. The glyphs are looked up once from a pango layout of all of them, then
+// a cell that is plain ASCII and fits on its first line is drawn by placing its glyphs at fixed steps. The glyphs for
+// every such cell in every region repainted this frame are gathered up and shown with one cairo_show_glyphs once the
+// regions are done. Anything else goes through pango.
+#define ASCII_GLYPH_FIRST 32
+#define ASCII_GLYPH_COUNT 95 // ' ' to '~'
+#define ASCII_GLYPH_REGIONS 32 // At least MAX_DAMAGE_RECTANGLES
+
+typedef struct AsciiGlyphs {
+  Boolean built;
+  Boolean usable; // FALSE when the font isn't monospace or pango didn't map each character to its own glyph
+  unsigned long glyphs[ASCII_GLYPH_COUNT];
+  double advance; // In pango's unscaled pixels, like the baseline
+  double baseline;
+  cairo_scaled_font_t *font;
+  cairo_glyph_t *buffer; // The glyphs being gathered for this frame
   int length;
   int capacity;
-  String *data;
-} DynamicStringArray;
-
-DynamicStringArray dynamicStringArrayNew(int capacity) {
-  DynamicStringArray array = {0};
-  array.length = 0;
-  array.capacity = capacity;
-  array.data = malloc(sizeof(String) * array.capacity);
-  return array;
-}
-void dynamicStringArrayInsert(DynamicStringArray *array, String element, int index) {
-  int oldLength = array->length;
-  int newLength = array->length + 1;
-  if (newLength > array->capacity) {
-    String *arrayData = array->data;
-    array->capacity *= 2;
-    array->data = malloc(sizeof(String) * array->capacity);
-    for (int i = 0; i < oldLength; i++) {
-      array->data[i] = arrayData[i];
-    }
-    free(arrayData);
-  }
-  for (int i = newLength; i > index; i--) {
-    array->data[i] = array->data[i-1];
-  }
-  array->data[index] = element;
-  array->length = newLength;
-}
-void dynamicStringArrayRemove(DynamicStringArray *array, int element, int index) {
-  int oldLength = array->length;
-  int newLength = array->length - 1;
-  if (newLength < array->capacity/4) {
-    String *arrayData = array->data;
-    array->capacity /= 2;
-    array->data = malloc(sizeof(String) * array->capacity);
-    for (int i = 0; i < oldLength; i++) {
-      array->data[i] = arrayData[i];
-    }
-    for (int i = index; i < newLength; i++) {
-      array->data[i] = array->data[i+1];
+  // The cells visited by each region gathered so far this frame. Damage rectangles can overlap, and a cell an earlier
+  // region gathered would be drawn twice, smudging its antialiased edges.
+  CellRange regions[ASCII_GLYPH_REGIONS];
+  int regionCount;
+} AsciiGlyphs;
+
+AsciiGlyphs *asciiGlyphsNew() {
+  AsciiGlyphs *glyphs = calloc(1, sizeof(AsciiGlyphs));
+  glyphs->capacity = 4096;
+  glyphs->buffer = malloc(glyphs->capacity * sizeof(cairo_glyph_t));
+  return glyphs;
+}
+
+void asciiGlyphsBuild(AsciiGlyphs *glyphs, cairo_t *cr, PangoFontDescription *font) {
+  glyphs->built = TRUE;
+  char text[ASCII_GLYPH_COUNT];
+  for (int i = 0; i < ASCII_GLYPH_COUNT; i++)
+    text[i] = ASCII_GLYPH_FIRST + i;
+  PangoLayout *layout = pango_cairo_create_layout(cr);
+  pango_layout_set_font_description(layout, font);
+  pango_layout_set_text(layout, text, ASCII_GLYPH_COUNT);
+
+  // All in one run means no character fell back to another font, and a glyph per character means nothing was combined
+  PangoLayoutLine *line = pango_layout_get_line_readonly(layout, 0);
+  if (!line || !line->runs || line->runs->next) {
+    printf("ascii glyphs: the font needs more than one run, drawing every cell with pango\n");
+    g_object_unref(layout);
+    return;
+  }
+  PangoLayoutRun *run = line->runs->data;
+  if (run->glyphs->num_glyphs != ASCII_GLYPH_COUNT) {
+    printf("ascii glyphs: %d glyphs for %d characters, drawing every cell with pango\n", run->glyphs->num_glyphs, ASCII_GLYPH_COUNT);
+    g_object_unref(layout);
+    return;
+  }
+  int advance = run->glyphs->glyphs[0].geometry.width;
+  for (int i = 0; i < ASCII_GLYPH_COUNT; i++) {
+    PangoGlyphInfo info = run->glyphs->glyphs[i];
+    if ((info.glyph & PANGO_GLYPH_UNKNOWN_FLAG) || info.geometry.width != advance || info.geometry.x_offset || info.geometry.y_offset) {
+      printf("ascii glyphs: '%c' doesn't have a plain glyph or the font isn't monospace, drawing every cell with pango\n", text[i]);
+      g_object_unref(layout);
+      return;
     }
+    glyphs->glyphs[i] = info.glyph;
   }
-  array->length = newLength;
+  glyphs->advance = (double)advance / PANGO_SCALE;
+  glyphs->baseline = (double)pango_layout_get_baseline(layout) / PANGO_SCALE;
+  glyphs->font = cairo_scaled_font_reference(pango_cairo_font_get_scaled_font((PangoCairoFont *)run->item->analysis.font));
+  glyphs->usable = glyphs->font != NULL;
+  g_object_unref(layout);
 }
 
+// Whether a cell's text can be drawn from the glyphs: all printable ASCII and short enough to fit on a line of widthCharacters
+Boolean asciiGlyphsFit(String string, int widthCharacters) {
+  if (string.length > widthCharacters)
+    return FALSE;
+  for (int i = 0; i < string.length; i++) {
+    unsigned char c = string.value[i];
+    if (c < ASCII_GLYPH_FIRST || c >= ASCII_GLYPH_FIRST + ASCII_GLYPH_COUNT)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+// Gathers the glyphs of a cell's text, which asciiGlyphsFit, with its top left corner at x, y (in the scaled space cell
+// layouts are drawn in)
+void asciiGlyphsAdd(AsciiGlyphs *glyphs, String string, double x, double y) {
+  if (glyphs->length + string.length > glyphs->capacity) {
+    glyphs->capacity = (glyphs->length + string.length) * 2;
+    glyphs->buffer = realloc(glyphs->buffer, glyphs->capacity * sizeof(cairo_glyph_t));
+  }
+  for (int i = 0; i < string.length; i++) {
+    if (string.value[i] == ' ') continue; // Nothing to draw
+    cairo_glyph_t *glyph = &glyphs->buffer[glyphs->length++];
+    glyph->index = glyphs->glyphs[string.value[i] - ASCII_GLYPH_FIRST];
+    glyph->x = x + i * glyphs->advance;
+    glyph->y = y + glyphs->baseline;
+  }
+}
+
+Boolean asciiGlyphsGathered(AsciiGlyphs *glyphs, int row, int column) {
+  for (int i = 0; i < glyphs->regionCount; i++) {
+    CellRange region = glyphs->regions[i];
+    if (row >= region.top && row <= region.bottom && column >= region.left && column <= region.right)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+void asciiGlyphsAddRegion(AsciiGlyphs *glyphs, CellRange region) {
+  if (glyphs->regionCount < ASCII_GLYPH_REGIONS)
+    glyphs->regions[glyphs->regionCount++] = region;
+}
+
+// Draws everything gathered since the last flush with the current source and clip
+void asciiGlyphsFlush(AsciiGlyphs *glyphs, cairo_t *cr, float textScale) {
+  glyphs->regionCount = 0;
+  if (!glyphs->length)
+    return;
+  cairo_save(cr);
+  cairo_scale(cr, textScale, textScale);
+  cairo_set_scaled_font(cr, glyphs->font);
+  cairo_show_glyphs(cr, glyphs->buffer, glyphs->length);
+  cairo_restore(cr);
+  glyphs->length = 0;
+}
+
+
 
 
 //******************************************//
-//               Int Array               //
+//               Render                     //
 //******************************************//
 
-typedef struct DynamicIntArray {
-  int length;
-  int capacity;
-  int *data;
-} DynamicIntArray;
-
-DynamicIntArray dynamicIntArrayNew(int capacity) {
-  DynamicIntArray array = {0};
-  array.length = 0;
-  array.capacity = capacity;
-  array.data = malloc(sizeof(int) * array.capacity);
-  return array;
-}
-void dynamicIntArrayInsert(DynamicIntArray *array, int element, int index) {
-  int oldLength = array->length;
-  int newLength = array->length + 1;
-  if (newLength > array->capacity) {
-    int *arrayData = array->data;
-    array->capacity *= 2;
-    array->data = malloc(sizeof(int) * array->capacity);
-    for (int i = 0; i < oldLength; i++) {
-      array->data[i] = arrayData[i];
-    }
-    free(arrayData);
-  }
-  for (int i = newLength; i > index; i--) {
-    array->data[i] = array->data[i-1];
-  }
-  array->data[index] = element;
-  array->length = newLength;
-}
-void dynamicIntArrayRemove(DynamicIntArray *array, int element, int index) {
-  int oldLength = array->length;
-  int newLength = array->length - 1;
-  if (newLength < array->capacity/4) {
-    int *arrayData = array->data;
-    array->capacity /= 2;
-    array->data = malloc(sizeof(int) * array->capacity);
-    for (int i = 0; i < oldLength; i++) {
-      array->data[i] = arrayData[i];
+#define MAX_DAMAGE_RECTANGLES 32
+
+typedef struct Damage {
+  Boolean full;
+  Boolean scrolled; // The back buffer's contents were moved, so all of it has to be copied to the window
+  int count;
+  XRectangle rectangles[MAX_DAMAGE_RECTANGLES];
+} Damage;
+
+void damageAdd(Damage *damage, Frame *frame, int x, int y, int width, int height) {
+  if (damage->full)
+    return;
+  int x2 = clamp(x + width, 0, frame->width);
+  int y2 = clamp(y + height, 0, frame->height);
+  x = clamp(x, 0, frame->width);
+  y = clamp(y, 0, frame->height);
+  if (x2 <= x || y2 <= y)
+    return;
+  if (damage->count == MAX_DAMAGE_RECTANGLES) {
+    damage->full = TRUE;
+    return;
+  }
+  XRectangle rectangle = {x, y, x2 - x, y2 - y};
+  damage->rectangles[damage->count++] = rectangle;
+}
+
+// Where a row or column starts on screen this frame. Rows and columns far off screen are kept far off screen without
+// overflowing anything adding to them.
+int frameRowY(Frame *frame, Sheet *sheet, int row) {
+  int64_t y = frame->yoffset + sheetRowOffset(sheet, row, frame->textScaledHeightPixels) - frame->firstRowOffset;
+  return y < INT_MIN / 2 ? INT_MIN / 2 : y > INT_MAX / 2 ? INT_MAX / 2 : y;
+}
+
+int frameColumnX(Frame *frame, Sheet *sheet, int column) {
+  int64_t x = frame->xoffset + sheetColumnOffset(sheet, column, frame->textScaledWidthPixels) - frame->firstColumnOffset;
+  return x < INT_MIN / 2 ? INT_MIN / 2 : x > INT_MAX / 2 ? INT_MAX / 2 : x;
+}
+
+// The cell under a point in the window, found with the size indexes rather than by walking the rows and columns.
+// Points past the cells on screen resolve to at most one row or column past the edge, so dragging out of the window
+// scrolls along a cell at a time instead of jumping to wherever the pointer went.
+void frameCellAt(Frame *frame, Sheet *sheet, int x, int y, int *row, int *column) {
+  *row = sheetRowAtOffset(sheet, frame->firstRowOffset + y - frame->yoffset, frame->textScaledHeightPixels);
+  *row = clamp(*row, clamp(frame->firstRow - 1, 0, INT_MAX), clamp(frame->endRow, 0, sheet->rowCount - 1));
+  *column = sheetColumnAtOffset(sheet, frame->firstColumnOffset + x - frame->xoffset, frame->textScaledWidthPixels);
+  *column = clamp(*column, clamp(frame->firstColumn - 1, 0, INT_MAX), clamp(frame->endColumn, 0, sheet->columnCount - 1));
+}
+
+// +1 so the grid lines on the right and bottom edges of the cell are repainted too
+void damageAddCell(Damage *damage, Frame *frame, Sheet *sheet, int row, int column) {
+  if (damage->full || row >= sheet->rowCount || column >= sheet->columnCount)
+    return;
+  int x = frameColumnX(frame, sheet, column);
+  int y = frameRowY(frame, sheet, row);
+  damageAdd(damage, frame, x, y, sheetColumnWidth(sheet, column, frame->textScaledWidthPixels) + 1, sheetRowHeight(sheet, row, frame->textScaledHeightPixels) + 1);
+}
+
+// Cut down to the cells on screen first, so a range of a million rows costs the same as one that fits
+void damageAddRange(Damage *damage, Frame *frame, Sheet *sheet, int top, int left, int bottom, int right) {
+  top = top > frame->firstRow ? top : frame->firstRow;
+  left = left > frame->firstColumn ? left : frame->firstColumn;
+  bottom = bottom < frame->endRow - 1 ? bottom : frame->endRow - 1;
+  right = right < frame->endColumn - 1 ? right : frame->endColumn - 1;
+  if (damage->full || top > bottom || left > right)
+    return;
+  int x = frameColumnX(frame, sheet, left);
+  int y = frameRowY(frame, sheet, top);
+  damageAdd(damage, frame, x, y, frameColumnX(frame, sheet, right + 1) - x + 1, frameRowY(frame, sheet, bottom + 1) - y + 1);
+}
+
+// Damages the cells that are in one range but not the other. Dragging out a range only changes a band along the edges
+// that moved, so that's all that gets repainted.
+void damageAddSelectionChange(Damage *damage, Frame *frame, Sheet *sheet, CellRange a, CellRange b) {
+  for (int side = 0; side < 2; side++) {
+    if (a.top > b.bottom || a.bottom < b.top || a.left > b.right || a.right < b.left) {
+      damageAddRange(damage, frame, sheet, a.top, a.left, a.bottom, a.right);
     }
-    for (int i = index; i < newLength; i++) {
-      array->data[i] = array->data[i+1];
+    else {
+      // What's left of a once b is taken out: the bands above and below b, then the bands either side of it
+      int top = a.top > b.top ? a.top : b.top;
+      int bottom = a.bottom < b.bottom ? a.bottom : b.bottom;
+      if (a.top < b.top)
+        damageAddRange(damage, frame, sheet, a.top, a.left, b.top - 1, a.right);
+      if (a.bottom > b.bottom)
+        damageAddRange(damage, frame, sheet, b.bottom + 1, a.left, a.bottom, a.right);
+      if (a.left < b.left)
+        damageAddRange(damage, frame, sheet, top, a.left, bottom, b.left - 1);
+      if (a.right > b.right)
+        damageAddRange(damage, frame, sheet, top, b.right + 1, bottom, a.right);
     }
+    CellRange swap = a;
+    a = b;
+    b = swap;
   }
-  array->length = newLength;
 }
 
+void cairoSetSourceXColor(cairo_t *cr, XColor color) {
+  cairo_set_source_rgb(cr, (double)color.red / (double)0xffff, (double)color.green / (double)0xffff, (double)color.blue / (double)0xffff);
+}
 
+// With --shm on a local display, cairo draws the back buffer in memory with its image backend rather than sending
+// drawing requests over the socket, and a frame goes to the window with one XShmPutImage that the server reads straight
+// out of the shared memory.
+Boolean shmError;
 
-//******************************************//
-//               Sheet                      //
-//******************************************//
+int handleShmError(Display *display, XErrorEvent *error) {
+  shmError = TRUE;
+  return 0;
+}
 
-typedef struct Sheet {
-  DynamicIntArray cellWidths;
-  DynamicIntArray cellHeights;
-  DynamicStringArray strings;
-  int columnCount;
-  int rowCount;
-  int selectedCell;
-  Boolean insertMode;
-  int verticalPadding;
-  int horizontalPadding;
-} Sheet;
-
-const int TEMP_CELL_WIDTH = 15;
-const int TEMP_CELL_HEIGHT = 3;
-
-Sheet newSheet(int rowCount, int columnCount) {
-  Sheet sheet = {0};
-  int cellCount = columnCount * rowCount;
-  sheet.cellWidths = dynamicIntArrayNew(columnCount + 100);
-  sheet.cellHeights = dynamicIntArrayNew(rowCount + 1000);
-  sheet.strings = dynamicStringArrayNew(cellCount + 1000);
-  for (int i = 0; i < cellCount; i++) {
-    String string = {0};
-    dynamicStringArrayInsert(&sheet.strings, string, i);
-  }
-  for (int i = 0; i < columnCount; i++) {
-    dynamicIntArrayInsert(&sheet.cellWidths, TEMP_CELL_WIDTH, i);
-  }
-  for (int i = 0; i < rowCount; i++) {
-    dynamicIntArrayInsert(&sheet.cellHeights, TEMP_CELL_HEIGHT, i);
-  }
-  sheet.verticalPadding = 4;
-  sheet.horizontalPadding = 4;
-  sheet.columnCount = columnCount;
-  sheet.rowCount = rowCount;
-  return sheet;
-}
-
-// TODO: Make this function like sheetInsertRow and rename both this and sheetAppendColumn
-void sheetAppendRow(Sheet *sheet, int cellIndex) { // TODO: test
-  int selectedRow = cellIndex / sheet->columnCount;
-  int startCellOfNewRow = selectedRow * sheet->columnCount;
-  int startCellOfNextRow = startCellOfNewRow + sheet->columnCount;
-  dynamicIntArrayInsert(&sheet->cellHeights, TEMP_CELL_HEIGHT, selectedRow);
-  for (int i = startCellOfNewRow; i < startCellOfNextRow; i++) {
-    String string = {0};
-    dynamicStringArrayInsert(&sheet->strings, string, i);
-  }
-  sheet->rowCount++;
-}
-
-void sheetAppendColumn(Sheet *sheet, int cellIndex) { // TODO: debug
-  int selectedColumn = cellIndex % sheet->columnCount;
-  dynamicIntArrayInsert(&sheet->cellWidths, TEMP_CELL_WIDTH, selectedColumn); // TODO: is this insertion correct, same for sheetAppendRow
-  sheet->columnCount++;
-  for (int row = 0; row < sheet->rowCount; row++) {
-    String string = {0};
-    dynamicStringArrayInsert(&sheet->strings, string, row * sheet->columnCount + selectedColumn);
-  }
-}
-
-void sheetCellBackSpace(Sheet sheet, int cellIndex, int stringIndex) {
-  for (int i = stringIndex; i < sheet.strings.data[cellIndex].length; i++) {
-    if (i + 1 >= sheet.strings.data[cellIndex].length)
-      break;
-    sheet.strings.data[cellIndex].value[i] = sheet.strings.data[cellIndex].value[i + 1];
-  }
-  sheet.strings.data[cellIndex].length--;
-}
-
-void sheetCellAppend(Sheet sheet, int cellIndex, char* valueToInsert, int valueToInsertLength) {
-  String str = {0};
-  str.value = malloc(sizeof(char) * valueToInsertLength + sizeof(char) * sheet.strings.data[cellIndex].length);
-  for (int i = 0; i < sheet.strings.data[cellIndex].length; i++)
-    str.value[i] = sheet.strings.data[cellIndex].value[i];
-  for (int i = 0; i < valueToInsertLength; i++)
-    str.value[sheet.strings.data[cellIndex].length + i] = valueToInsert[i];
-  str.length = sheet.strings.data[cellIndex].length + valueToInsertLength;
-
-  sheet.strings.data[cellIndex] = str;
-}
-
-char handleNormalModeInput(Sheet *sheet, char charKeyPressed, Boolean useRecordedCommand, char lastCharKeyPressed, String text) {
-  switch (charKeyPressed) {
-    case 'h': {
-      sheet->selectedCell -= 1;
-      break;
-    }
-    case 'j': {
-      sheet->selectedCell += sheet->columnCount;
-      break;
+// Returns FALSE, leaving nothing behind, when the server can't share memory with us (a remote display) or its pixels
+// aren't laid out like cairo's
+Boolean shmBackBufferCreate(Program *program, int width, int height) {
+  Display *display = program->display;
+  XImage *image = XShmCreateImage(display, program->visual, program->depth, ZPixmap, NULL, &program->shmInfo, width, height);
+  if (!image)
+    return FALSE;
+  uint32_t one = 1;
+  int nativeByteOrder = *(char *)&one ? LSBFirst : MSBFirst;
+  if (image->bits_per_pixel != 32 || image->byte_order != nativeByteOrder || image->red_mask != 0xff0000 || image->green_mask != 0xff00 || image->blue_mask != 0xff) {
+    XDestroyImage(image);
+    return FALSE;
+  }
+  program->shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+  if (program->shmInfo.shmid < 0) {
+    XDestroyImage(image);
+    return FALSE;
+  }
+  program->shmInfo.shmaddr = image->data = shmat(program->shmInfo.shmid, NULL, 0);
+  // Marked for removal straight away so it goes however the program exits. It lives on while it's attached.
+  shmctl(program->shmInfo.shmid, IPC_RMID, NULL);
+  if (image->data == (char *)-1) {
+    image->data = NULL;
+    XDestroyImage(image);
+    return FALSE;
+  }
+  program->shmInfo.readOnly = False;
+  // Attaching fails with an X error rather than a return value, so it has to be waited for
+  shmError = FALSE;
+  XErrorHandler oldHandler = XSetErrorHandler(handleShmError);
+  XShmAttach(display, &program->shmInfo);
+  XSync(display, False);
+  XSetErrorHandler(oldHandler);
+  if (shmError) {
+    shmdt(program->shmInfo.shmaddr);
+    image->data = NULL;
+    XDestroyImage(image);
+    return FALSE;
+  }
+  program->shmImage = image;
+  program->surface = cairo_image_surface_create_for_data((unsigned char *)image->data, CAIRO_FORMAT_RGB24, width, height, image->bytes_per_line);
+  return TRUE;
+}
+
+void shmBackBufferDestroy(Program *program) {
+  cairo_surface_destroy(program->surface);
+  XShmDetach(program->display, &program->shmInfo);
+  program->shmImage->data = NULL; // Not XDestroyImage's to free
+  XDestroyImage(program->shmImage);
+  shmdt(program->shmInfo.shmaddr);
+  program->shmImage = NULL;
+}
+
+// The back buffer is a pixmap the size of the window. Frames are drawn into it and then copied to the window, so the window never shows a half drawn frame.
+// A headless program (no display, see benchRender) draws into an image surface in memory instead, and so does --shm.
+void backBufferResize(Program *program, int width, int height) {
+  program->backBufferWidth = width;
+  program->backBufferHeight = height;
+  if (program->display && program->useShm) {
+    Boolean first = !program->cr;
+    if (program->cr) {
+      cairo_destroy(program->cr);
+      program->cr = NULL;
+      shmBackBufferDestroy(program);
     }
-    case 'k': {
-      sheet->selectedCell -= sheet->columnCount;
-      break;
+    if (shmBackBufferCreate(program, width, height)) {
+      if (first)
+        printf("back buffer: shared memory, presented with XShmPutImage\n");
+      program->cr = cairo_create(program->surface);
+      layoutCacheInvalidateAll(program->layoutCache);
+      return;
     }
-    case 'l': {
-      sheet->selectedCell += 1;
-      break;
+    printf("back buffer: couldn't share memory with the X server, drawing into a pixmap instead\n");
+    program->useShm = FALSE;
+  }
+  if (program->display) {
+    // Pixmaps can't be resized, but the cairo surface and context can move over to a new one, which keeps the cached
+    // layouts valid
+    Pixmap oldBackBuffer = program->backBuffer;
+    program->backBuffer = XCreatePixmap(program->display, program->window, width, height, program->depth);
+    if (oldBackBuffer) {
+      cairo_xlib_surface_set_drawable(program->surface, program->backBuffer, width, height);
+      XFreePixmap(program->display, oldBackBuffer);
+      return;
     }
-    case 'i': {
-      if (useRecordedCommand && text.length) {
-        sheetCellAppend(*sheet, sheet->selectedCell, text.value, text.length);
-      }
-      else {
-        sheet->insertMode = TRUE;
-      }
-      lastCharKeyPressed = 'i';
-      // INSERT MODE AT THE START OF THE STRING. Maybe ii does this, i puts you in "normal text mode" as opposed to "normal sheet mode"
-      break;
+    program->surface = cairo_xlib_surface_create(program->display, program->backBuffer, program->visual, width, height);
+  }
+  else {
+    if (program->cr) {
+      cairo_destroy(program->cr);
+      cairo_surface_destroy(program->surface);
     }
-    /* case 'I': { */
-    /*   sheet->insertMode = TRUE; */
-    /*   // INSERT MODE AT THE END OF THE STRING */
-    /*   break; */
-    /* } */
-    case 'a': {
-      sheetAppendColumn(sheet, sheet->selectedCell + 1);
-      int selectedRow = sheet->selectedCell / (sheet->columnCount - 1);
-      sheet->selectedCell += selectedRow + 1; // sheetAppendColumn will add insert a cell for each row
-      lastCharKeyPressed = 'a';
-      break;
+    program->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+  }
+  program->cr = cairo_create(program->surface);
+  // The cached layouts were shaped against the old cairo context
+  layoutCacheInvalidateAll(program->layoutCache);
+}
+
+// Moves the pixels in a rectangle of the back buffer by dx, dy, for scrolling what's already been drawn
+void backBufferMove(Program *program, int x, int y, int width, int height, int dx, int dy) {
+  if (width <= 0 || height <= 0)
+    return;
+  int64_t traceStart = traceBegin();
+  cairo_surface_flush(program->surface);
+  if (program->display && !program->shmImage) {
+    XCopyArea(program->display, program->backBuffer, program->backBuffer, program->gc, x, y, width, height, x + dx, y + dy);
+  }
+  else {
+    unsigned char *data = cairo_image_surface_get_data(program->surface);
+    int stride = cairo_image_surface_get_stride(program->surface);
+    // Rows are copied away from the direction they move in so none is overwritten before it's copied
+    for (int i = 0; i < height; i++) {
+      int row = dy > 0 ? y + height - 1 - i : y + i;
+      memmove(data + (row + dy) * stride + (x + dx) * 4, data + row * stride + x * 4, width * 4);
     }
-    case 'A': {
-      // INSERT NEW COLUMN
-      sheetAppendColumn(sheet, sheet->selectedCell);
-      int selectedRow = sheet->selectedCell / (sheet->columnCount - 1);
-      sheet->selectedCell += selectedRow; // sheetAppendColumn will add insert a cell for each row
-      lastCharKeyPressed = 'A';
-      break;
+  }
+  cairo_surface_mark_dirty(program->surface);
+  traceEnd("backBufferMove", traceStart);
+}
+
+void presentBackBuffer(Program *program, int x, int y, int width, int height) {
+  int64_t traceStart = traceBegin();
+  cairo_surface_flush(program->surface);
+  if (program->shmImage) {
+    // The server reads the pixels some time after this returns, and says when with a completion event
+    XShmPutImage(program->display, program->window, program->gc, program->shmImage, x, y, x, y, width, height, True);
+    program->shmPending++;
+  }
+  else if (program->display) {
+    XCopyArea(program->display, program->backBuffer, program->window, program->gc, x, y, width, height, x, y);
+  }
+  traceEnd("presentBackBuffer", traceStart);
+}
+
+// Scrolling by less than the window moves the pixels still on screen and damages only the strips scrolled into view.
+// Rows move with their numbers under the column letters, and columns with their letters beside the row numbers. The
+// first line of pixels under or beside the headers is always repainted since it holds the header's border.
+void damageScroll(Damage *damage, Program *program, Frame *frame, Frame *lastFrame) {
+  int64_t dy = frame->firstRowOffset - lastFrame->firstRowOffset;
+  int64_t dx = frame->firstColumnOffset - lastFrame->firstColumnOffset;
+  int top = frame->yoffset + 1;
+  int left = frame->xoffset + 1;
+  if (llabs(dy) >= frame->height - top || llabs(dx) >= frame->width - left) {
+    damage->full = TRUE;
+    return;
+  }
+  if (dy) {
+    backBufferMove(program, 0, dy > 0 ? top + dy : top, frame->width, frame->height - top - llabs(dy), 0, -dy);
+    damageAdd(damage, frame, 0, frame->yoffset, frame->width, 1);
+    if (dy > 0)
+      damageAdd(damage, frame, 0, frame->height - dy, frame->width, dy);
+    else
+      damageAdd(damage, frame, 0, top, frame->width, -dy);
+  }
+  if (dx) {
+    backBufferMove(program, dx > 0 ? left + dx : left, 0, frame->width - left - llabs(dx), frame->height, -dx, 0);
+    damageAdd(damage, frame, frame->xoffset, 0, 1, frame->height);
+    if (dx > 0)
+      damageAdd(damage, frame, frame->width - dx, 0, dx, frame->height);
+    else
+      damageAdd(damage, frame, left, 0, -dx, frame->height);
+  }
+  damage->scrolled = TRUE;
+}
+
+// Repaint everything inside a rectangle of the back buffer. Only the rows and columns that intersect the rectangle are visited.
+// Plain ASCII cell text is only gathered, and drawn for every region at once by renderAsciiGlyphs.
+void renderRegion(Program *program, Sheet *sheet, Frame *frame, int regionX, int regionY, int regionWidth, int regionHeight) {
+  int64_t traceStart = traceBegin();
+  cairo_t *cr = program->cr;
+  cairo_save(cr);
+  cairo_rectangle(cr, regionX, regionY, regionWidth, regionHeight);
+  cairo_clip(cr);
+
+  cairoSetSourceXColor(cr, program->background);
+  cairo_rectangle(cr, regionX, regionY, regionWidth, regionHeight);
+  cairo_fill(cr);
+
+  int lineHeight = frame->textScaledHeightPixels;
+  int charWidth = frame->textScaledWidthPixels;
+  int firstRow = clamp(sheetRowAtOffset(sheet, frame->firstRowOffset + regionY - frame->yoffset, lineHeight), frame->firstRow, INT_MAX);
+  int endRow = clamp(sheetRowAtOffset(sheet, frame->firstRowOffset + regionY + regionHeight - frame->yoffset, lineHeight) + 1, 0, frame->endRow);
+  int firstColumn = clamp(sheetColumnAtOffset(sheet, frame->firstColumnOffset + regionX - frame->xoffset, charWidth), frame->firstColumn, INT_MAX);
+  int endColumn = clamp(sheetColumnAtOffset(sheet, frame->firstColumnOffset + regionX + regionWidth - frame->xoffset, charWidth) + 1, 0, frame->endColumn);
+
+  // The first row and column can be partly scrolled under the headers, so cells are kept out of them
+  cairo_save(cr);
+  cairo_rectangle(cr, frame->xoffset, frame->yoffset, frame->width - frame->xoffset, frame->height - frame->yoffset);
+  cairo_clip(cr);
+
+  // Highlight the selected Cells, only as far as they're in the region
+  { // Use braces here to make it clear that the variables defined are only used here and not lower in the function
+    CellRange selection = sheetSelection(sheet);
+    int top = selection.top > firstRow ? selection.top : firstRow;
+    int left = selection.left > firstColumn ? selection.left : firstColumn;
+    int bottom = selection.bottom < endRow - 1 ? selection.bottom : endRow - 1;
+    int right = selection.right < endColumn - 1 ? selection.right : endColumn - 1;
+    if (top <= bottom && left <= right) {
+      int x = frameColumnX(frame, sheet, left);
+      int y = frameRowY(frame, sheet, top);
+      cairoSetSourceXColor(cr, program->highlight);
+      cairo_rectangle(cr, x, y, frameColumnX(frame, sheet, right + 1) - x, frameRowY(frame, sheet, bottom + 1) - y);
+      cairo_fill(cr);
     }
-    case 'o': {
-      sheetAppendRow(sheet, sheet->selectedCell + sheet->columnCount);
-      sheet->selectedCell += sheet->columnCount;
-      lastCharKeyPressed = 'o';
-      break;
+  }
+
+  // Render text for each visible cell. Plain ASCII is gathered into one run of glyphs for the frame, anything else is laid
+  // out by pango.
+  int64_t phaseStart = traceBegin();
+  cairo_set_source_rgba(cr, program->text.red, program->text.green, program->text.blue, program->text.alpha);
+  AsciiGlyphs *asciiGlyphs = program->asciiGlyphs;
+  if (!asciiGlyphs->built)
+    asciiGlyphsBuild(asciiGlyphs, cr, program->font);
+  Boolean fastPath = asciiGlyphs->usable && !program->pangoOnly;
+  for (int row = firstRow; row < endRow; row++) {
+    for (int column = firstColumn; column < endColumn; column++) {
+      String string = sheetGetCellDisplay(sheet, row, column);
+      if (string.length == 0) continue;
+
+      if (fastPath && asciiGlyphsFit(string, sheet->cellWidths.data[column])) {
+        if (!asciiGlyphsGathered(asciiGlyphs, row, column)) {
+          double x = (frameColumnX(frame, sheet, column) + sheet->horizontalPadding) / frame->textScale;
+          double y = (frameRowY(frame, sheet, row) + sheet->verticalPadding) / frame->textScale;
+          asciiGlyphsAdd(asciiGlyphs, string, x, y);
+        }
+        continue;
+      }
+
+      PangoLayout *cellLayout = layoutCacheGet(program->layoutCache, cr, program->font, frame->logicalRectPangoUnits, string, row, column, sheet->cellWidths.data[column], sheet->cellHeights.data[row]);
+
+      int x = frameColumnX(frame, sheet, column) + sheet->horizontalPadding;
+      int y = frameRowY(frame, sheet, row) + sheet->verticalPadding;
+      cairo_save(cr);
+      cairo_translate(cr, x, y);
+      cairo_scale(cr, frame->textScale, frame->textScale);
+      pango_cairo_show_layout(cr, cellLayout);
+      cairo_restore(cr);
     }
-    case 'O': {
-      sheetAppendRow(sheet, sheet->selectedCell);
-      lastCharKeyPressed = 'O';
-      break;
+  }
+  CellRange visited = {firstRow, firstColumn, endRow - 1, endColumn - 1};
+  asciiGlyphsAddRegion(asciiGlyphs, visited);
+  cairo_restore(cr);
+  traceEnd("render cells", phaseStart);
+
+  // Render text for row numbering & column lettering
+  phaseStart = traceBegin();
+  if (program->headerLabels->textScale != frame->textScale)
+    headerLabelsBuildAtlas(program->headerLabels, program->font, frame->textScale);
+  cairo_set_source_rgba(cr, program->text.red, program->text.green, program->text.blue, program->text.alpha);
+  if (regionY < frame->yoffset) {
+    cairo_save(cr);
+    cairo_rectangle(cr, frame->xoffset, 0, frame->width - frame->xoffset, frame->yoffset);
+    cairo_clip(cr);
+    for (int column = firstColumn; column < endColumn; column++) {
+      int x = frameColumnX(frame, sheet, column) + sheet->horizontalPadding;
+      int y = frame->yoffset + sheet->verticalPadding - frame->textScaledHeightPixels - 2 * sheet->verticalPadding;
+      cairo_mask_surface(cr, headerLabelGet(program->headerLabels, TRUE, column), x, y);
     }
-    case '.': { // TODO
-      handleNormalModeInput(sheet, lastCharKeyPressed, TRUE, 0, text);
-      break;
+    cairo_restore(cr);
+  }
+  if (regionX < frame->xoffset) {
+    cairo_save(cr);
+    cairo_rectangle(cr, 0, frame->yoffset, frame->xoffset, frame->height - frame->yoffset);
+    cairo_clip(cr);
+    for (int row = firstRow; row < endRow; row++) {
+      int x = frame->xoffset + sheet->horizontalPadding - frame->rowNumberColumnWidth;
+      int y = frameRowY(frame, sheet, row) + sheet->verticalPadding;
+      cairo_mask_surface(cr, headerLabelGet(program->headerLabels, FALSE, row), x, y);
     }
-    /* case '$': { // TODO */
-    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
-    /*   break; */
-    /* } */
-    /* case 'e': { // TODO */
-    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
-    /*   break; */
-    /* } */
-    /* case 'Input.CTRL_E': { // TODO */
-    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
-    /*   break; */
-    /* } */
-    /* case 'y???': { // TODO */
-    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
-    /*   break; */
-    /* } */
-    /* case 'Input.CTRL_Y': { // TODO */
-    /*   sheetAppendRow(&sheet, sheet->selectedCell); */
-    /*   break; */
-    /* } */
-  }
-  printf("lastCharKeyPressed: %c\n", lastCharKeyPressed);
-  return lastCharKeyPressed;
+    cairo_restore(cr);
+  }
+  traceEnd("render headers", phaseStart);
+
+
+
+  // Draw the Rows and Columns. Lines are drawn on the half pixel so they are 1 pixel wide.
+  // Row lines run through the row numbers but not the column letters, and column lines the other way around. The
+  // borders of the headers are drawn on their own since the row or column that starts there may be scrolled under them.
+  phaseStart = traceBegin();
+  cairoSetSourceXColor(cr, program->foreground);
+  cairo_set_line_width(cr, 1);
+  cairo_save(cr);
+  cairo_rectangle(cr, regionX, frame->yoffset, regionWidth, frame->height - frame->yoffset);
+  cairo_clip(cr);
+  for (int row = firstRow - 1; row < endRow; row++) {
+    double y = frameRowY(frame, sheet, row + 1) + 0.5;
+    cairo_move_to(cr, regionX, y);
+    cairo_line_to(cr, regionX + regionWidth, y);
+  }
+  cairo_move_to(cr, regionX, frame->yoffset + 0.5);
+  cairo_line_to(cr, regionX + regionWidth, frame->yoffset + 0.5);
+  cairo_stroke(cr);
+  cairo_restore(cr);
+  cairo_save(cr);
+  cairo_rectangle(cr, frame->xoffset, regionY, frame->width - frame->xoffset, regionHeight);
+  cairo_clip(cr);
+  for (int column = firstColumn - 1; column < endColumn; column++) {
+    double x = frameColumnX(frame, sheet, column + 1) + 0.5;
+    cairo_move_to(cr, x, regionY);
+    cairo_line_to(cr, x, regionY + regionHeight);
+  }
+  cairo_move_to(cr, frame->xoffset + 0.5, regionY);
+  cairo_line_to(cr, frame->xoffset + 0.5, regionY + regionHeight);
+  cairo_stroke(cr);
+  cairo_restore(cr);
+  traceEnd("render grid", phaseStart);
+
+  cairo_restore(cr);
+  traceEnd("renderRegion", traceStart);
 }
 
+// Draws the glyphs renderRegion gathered for every damaged rectangle in one go, clipped to the rectangles so cells
+// poking out of them aren't drawn over what's already there
+void renderAsciiGlyphs(Program *program, Frame *frame, Damage *damage) {
+  int64_t traceStart = traceBegin();
+  cairo_t *cr = program->cr;
+  cairo_save(cr);
+  if (!damage->full) {
+    for (int i = 0; i < damage->count; i++) {
+      XRectangle r = damage->rectangles[i];
+      cairo_rectangle(cr, r.x, r.y, r.width, r.height);
+    }
+    cairo_clip(cr);
+  }
+  cairo_rectangle(cr, frame->xoffset, frame->yoffset, frame->width - frame->xoffset, frame->height - frame->yoffset);
+  cairo_clip(cr);
+  cairo_set_source_rgba(cr, program->text.red, program->text.green, program->text.blue, program->text.alpha);
+  asciiGlyphsFlush(program->asciiGlyphs, cr, frame->textScale);
+  cairo_restore(cr);
+  traceEnd("render ascii glyphs", traceStart);
+}
 
+void render(Program *program, Sheet *sheet) {
+  int64_t traceStart = traceBegin();
+  // The window's size is tracked from ConfigureNotify events, so nothing here waits on the X server
+  int width = program->windowWidth;
+  int height = program->windowHeight;
 
-//******************************************//
-//               Render                     //
-//******************************************//
+  Damage damage = {0};
+  if (!program->cr || program->backBufferWidth != width || program->backBufferHeight != height) {
+    backBufferResize(program, width, height);
+    damage.full = TRUE;
+  }
 
-void render(Program program, Sheet sheet) {
-  XWindowAttributes winAttribs = {0};
-  XGetWindowAttributes(program.display, program.window, &winAttribs);
+  Frame frame = {0};
+  frame.width = width;
+  frame.height = height;
 
-  PangoLayout *layout = pango_cairo_create_layout(program.cr);
-  pango_layout_set_font_description(layout, program.font);
+  int64_t phaseStart = traceBegin();
+  PangoLayout *layout = pango_cairo_create_layout(program->cr);
+  pango_layout_set_font_description(layout, program->font);
   pango_layout_set_text(layout, "a", -1);
-  float textScale = 0.5;
+  frame.textScale = 0.5;
   PangoRectangle logicalRectPixels;
   pango_layout_get_pixel_extents(layout, NULL, &logicalRectPixels);
-  int textScaledHeightPixels = textScale * logicalRectPixels.height;
-  int textScaledWidthPixels = textScale * logicalRectPixels.width;
-
-  int cellWidth = TEMP_CELL_WIDTH * textScaledWidthPixels + 2 * sheet.horizontalPadding;
-  int cellHeight = TEMP_CELL_HEIGHT * textScaledHeightPixels + 2 * sheet.verticalPadding;
-  int sheetWidth = sheet.columnCount * cellWidth;
-  int sheetHeight = sheet.rowCount * cellHeight;
-
-  int rowNumberColumnWidth = 0;
-  int columnNumberRowHeight = textScaledHeightPixels + 2 * sheet.verticalPadding;
-  {
-    int maxRowsOnScreen = (winAttribs.height - cellHeight) / cellHeight;
-    int rowsOnScreen = maxRowsOnScreen > sheet.rowCount ? sheet.rowCount : maxRowsOnScreen;
-    rowNumberColumnWidth = intToString(rowsOnScreen).length * textScaledWidthPixels + 2 * sheet.horizontalPadding;
+  pango_layout_get_extents(layout, NULL, &frame.logicalRectPangoUnits);
+  g_object_unref(layout);
+  frame.textScaledHeightPixels = frame.textScale * logicalRectPixels.height;
+  frame.textScaledWidthPixels = frame.textScale * logicalRectPixels.width;
+  traceEnd("render measure font", phaseStart);
+
+  int64_t sheetWidth = sheetColumnOffset(sheet, sheet->columnCount, frame.textScaledWidthPixels);
+  int64_t sheetHeight = sheetRowOffset(sheet, sheet->rowCount, frame.textScaledHeightPixels);
+
+  // Size the row number column for the largest row number so it doesn't jump around while scrolling
+  char rowNumber[16];
+  frame.rowNumberColumnWidth = intToStringInto(sheet->rowCount, rowNumber) * frame.textScaledWidthPixels + 2 * sheet->horizontalPadding;
+  frame.columnNumberRowHeight = frame.textScaledHeightPixels + 2 * sheet->verticalPadding;
+  // Centred while the whole sheet fits in the window
+  frame.xoffset = sheetWidth < frame.width ? clamp((frame.width - sheetWidth) / 2 - sheet->horizontalPadding, frame.rowNumberColumnWidth, INT_MAX) : frame.rowNumberColumnWidth;
+  frame.yoffset = sheetHeight < frame.height ? clamp((frame.height - sheetHeight) / 2 - sheet->verticalPadding, frame.columnNumberRowHeight, INT_MAX) : frame.columnNumberRowHeight;
+
+  // Work out the viewport. Only rows and columns from the scroll origin up to the edge of the window are visited when drawing.
+  sheetUpdateViewport(sheet, frame.width - frame.xoffset, frame.height - frame.yoffset, frame.textScaledWidthPixels, frame.textScaledHeightPixels);
+  frame.firstRow = sheet->scrollRow;
+  frame.firstColumn = sheet->scrollColumn;
+  frame.firstRowOffset = sheetRowOffset(sheet, frame.firstRow, frame.textScaledHeightPixels) + sheet->scrollRowPixels;
+  frame.firstColumnOffset = sheetColumnOffset(sheet, frame.firstColumn, frame.textScaledWidthPixels) + sheet->scrollColumnPixels;
+  // +1 to include the partially visible row and column at the edge of the window
+  frame.endRow = clamp(frame.firstRow + sheet->visibleRowCount + 1, 0, sheet->rowCount);
+  frame.endColumn = clamp(frame.firstColumn + sheet->visibleColumnCount + 1, 0, sheet->columnCount);
+
+  // Work out what has to be repainted since the last frame
+  if (sheet->structureChanged || frame.xoffset != program->lastFrame.xoffset || frame.yoffset != program->lastFrame.yoffset || frame.textScaledWidthPixels != program->lastFrame.textScaledWidthPixels || frame.textScaledHeightPixels != program->lastFrame.textScaledHeightPixels) {
+    damage.full = TRUE;
   }
-  int xoffset = clamp((winAttribs.width - sheetWidth) / 2 - sheet.horizontalPadding, rowNumberColumnWidth, INT_MAX);
-  int yoffset = clamp((winAttribs.height - sheetHeight) / 2 - sheet.verticalPadding, columnNumberRowHeight, INT_MAX);
-
-
+  else if (!damage.full && (frame.firstRowOffset != program->lastFrame.firstRowOffset || frame.firstColumnOffset != program->lastFrame.firstColumnOffset)) {
+    damageScroll(&damage, program, &frame, &program->lastFrame);
+  }
+  for (int i = 0; i < sheet->changedCells.length; i += 2) {
+    damageAddCell(&damage, &frame, sheet, sheet->changedCells.data[i], sheet->changedCells.data[i + 1]);
+  }
+  CellRange selection = sheetSelection(sheet);
+  if (memcmp(&selection, &program->lastSelection, sizeof(CellRange)))
+    damageAddSelectionChange(&damage, &frame, sheet, program->lastSelection, selection);
+  layoutCacheApplySheetChanges(program->layoutCache, sheet);
+  program->lastFrame = frame;
+  program->lastSelection = selection;
+
+  if (damage.full) {
+    renderRegion(program, sheet, &frame, 0, 0, frame.width, frame.height);
+    renderAsciiGlyphs(program, &frame, &damage);
+    presentBackBuffer(program, 0, 0, frame.width, frame.height);
+  }
+  else if (damage.count || damage.scrolled) {
+    // Repaint each damaged rectangle, then copy their bounding box to the window in one go
+    int x1 = damage.scrolled ? 0 : INT_MAX, y1 = damage.scrolled ? 0 : INT_MAX;
+    int x2 = damage.scrolled ? frame.width : 0, y2 = damage.scrolled ? frame.height : 0;
+    for (int i = 0; i < damage.count; i++) {
+      XRectangle r = damage.rectangles[i];
+      renderRegion(program, sheet, &frame, r.x, r.y, r.width, r.height);
+      x1 = r.x < x1 ? r.x : x1;
+      y1 = r.y < y1 ? r.y : y1;
+      x2 = r.x + r.width > x2 ? r.x + r.width : x2;
+      y2 = r.y + r.height > y2 ? r.y + r.height : y2;
+    }
+    renderAsciiGlyphs(program, &frame, &damage);
+    presentBackBuffer(program, x1, y1, x2 - x1, y2 - y1);
+  }
+  traceEnd("render", traceStart);
 
-  XClearWindow(program.display, program.window);
+  // XFlush(program->display);
+}
 
-  XSetForeground(program.display, program.gc, program.background.pixel);
-  XFillRectangle(program.display, program.window, program.gc, 0, 0, winAttribs.width, winAttribs.height);
 
-  // Highlight the selected Cell
-  { // Use braces here to make it clear that the variables defined are only used here and not lower in the function
-    int row = sheet.selectedCell / sheet.columnCount;
-    int column = sheet.selectedCell % sheet.columnCount;
-    int x = TEMP_CELL_WIDTH * textScaledWidthPixels * column + xoffset + 2 * column * sheet.horizontalPadding;
-    int y = TEMP_CELL_HEIGHT * textScaledHeightPixels * row + yoffset + 2 * row * sheet.verticalPadding;
-    XSetForeground(program.display, program.gc, program.highlight.pixel);
-    XFillRectangle(program.display, program.window, program.gc, x, y, cellWidth, cellHeight);
-  }
 
-  PangoRectangle logicalRectPangoUnits;
-  pango_layout_get_extents(layout, NULL, &logicalRectPangoUnits);
-  // int textScaledHeightPangoUnits = textScale * logicalRectPangoUnits.height;
-  // int textScaledWidthPangoUnits = textScale * logicalRectPangoUnits.width;
-
-  // Render text for each cell
-  for (int i = 0; i < sheet.columnCount * sheet.rowCount; i++) {
-    cairo_save(program.cr);
-
-    if (sheet.strings.data[i].length == 0) continue;
-    pango_layout_set_text(layout, sheet.strings.data[i].value, sheet.strings.data[i].length);
-    pango_layout_set_width(layout, TEMP_CELL_WIDTH * logicalRectPangoUnits.width + 2); // TODO: why +2. Is this because padding is 4 and maybe borders are 2?
-    pango_layout_set_height(layout, TEMP_CELL_HEIGHT * logicalRectPangoUnits.height + 2);
-    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-    pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
-    pango_cairo_update_layout(program.cr, layout);
-
-    int column = i % sheet.columnCount;
-    int row = i / sheet.columnCount;
-    int x = xoffset + column * TEMP_CELL_WIDTH * textScaledWidthPixels + 2 * column * sheet.horizontalPadding + sheet.horizontalPadding;
-    int y = yoffset + row * TEMP_CELL_HEIGHT * textScaledHeightPixels + 2 * row * sheet.verticalPadding + sheet.verticalPadding;
-    cairo_translate(program.cr, x, y);
-    cairo_scale(program.cr, textScale, textScale);
-    cairo_set_source_rgba(program.cr, program.text.red, program.text.green, program.text.blue, program.text.alpha);
-
-    pango_cairo_show_layout(program.cr, layout);
-
-    cairo_restore(program.cr);
-  }
-  
-  // Render text for row numbering & column lettering
-  for (int column = 0; column < sheet.columnCount; column++) {
-    cairo_save(program.cr);
+//******************************************//
+//               Benchmarks                 //
+//******************************************//
 
-    String string = intToLetters(column);
-    pango_layout_set_text(layout, string.value, string.length);
-    pango_layout_set_width(layout, TEMP_CELL_WIDTH * logicalRectPangoUnits.width + 2);
-    pango_layout_set_height(layout, TEMP_CELL_HEIGHT * logicalRectPangoUnits.height + 2);
-    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-    pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
-    pango_cairo_update_layout(program.cr, layout);
+#define RENDER_BENCH_FRAMES 200
 
-    int x = xoffset + column * TEMP_CELL_WIDTH * textScaledWidthPixels + 2 * column * sheet.horizontalPadding + sheet.horizontalPadding;
-    int y = yoffset + sheet.verticalPadding - textScaledHeightPixels - 2 * sheet.verticalPadding;
-    cairo_translate(program.cr, x, y);
-    cairo_scale(program.cr, textScale, textScale);
-    cairo_set_source_rgba(program.cr, program.text.red, program.text.green, program.text.blue, program.text.alpha);
+int compareInt64(const void *a, const void *b) {
+  int64_t x = *(int64_t *)a;
+  int64_t y = *(int64_t *)b;
+  return (x > y) - (x < y);
+}
 
-    pango_cairo_show_layout(program.cr, layout);
+// Renders frames of a sheet a few ways, printing a line of timings for each:
+// redraw repaints everything with an empty layout cache, like after rows or columns move,
+// scroll moves down a row per frame, like holding j, so only the row scrolled into view is drawn,
+// smooth scrolls down a few pixels per frame, like the mouse wheel or a trackpad.
+// redraw and scroll are run again with every cell shaped by pango (redraw-pango, scroll-pango) to compare against the
+// ASCII fast path.
+#define BENCH_REDRAW 0
+#define BENCH_SCROLL 1
+#define BENCH_SMOOTH 2
+
+void benchRenderSheet(Program *program, char *name, Sheet *sheet, char *pngPrefix) {
+  char *modeNames[] = {"redraw", "scroll", "smooth", "redraw-pango", "scroll-pango"};
+  int modeKinds[] = {BENCH_REDRAW, BENCH_SCROLL, BENCH_SMOOTH, BENCH_REDRAW, BENCH_SCROLL};
+  int64_t times[RENDER_BENCH_FRAMES];
+  for (int mode = 0; mode < 5; mode++) {
+    program->pangoOnly = mode >= 3;
+    sheet->selectedRow = 0;
+    sheet->scrollRow = 0;
+    sheet->scrollRowPixels = 0;
+    sheet->structureChanged = TRUE;
+    render(program, sheet);
+    int hits = program->layoutCache->hits;
+    int misses = program->layoutCache->misses;
+    int64_t start = nowNanoseconds();
+    for (int i = 0; i < RENDER_BENCH_FRAMES; i++) {
+      int64_t frameStart = nowNanoseconds();
+      if (modeKinds[mode] == BENCH_REDRAW) {
+        sheet->structureChanged = TRUE;
+      }
+      else if (modeKinds[mode] == BENCH_SCROLL) {
+        sheet->selectedRow = (i + 1) % sheet->rowCount;
+        sheet->scrollRow = sheet->selectedRow;
+      }
+      else {
+        Frame *frame = &program->lastFrame;
+        sheetScrollByPixels(sheet, 0, 4, frame->width - frame->xoffset, frame->height - frame->yoffset, frame->textScaledWidthPixels, frame->textScaledHeightPixels);
+      }
+      render(program, sheet);
+      times[i] = nowNanoseconds() - frameStart;
+    }
+    int64_t total = nowNanoseconds() - start;
+    qsort(times, RENDER_BENCH_FRAMES, sizeof(int64_t), compareInt64);
+    printf("%s\t%s\t%d\t%d\t%d\t%.1f\t%.2f\t%.2f\t%d\t%d\n", name, modeNames[mode], program->backBufferWidth, program->backBufferHeight, RENDER_BENCH_FRAMES,
+           RENDER_BENCH_FRAMES / (total / 1e9), times[RENDER_BENCH_FRAMES / 2] / 1e6, times[RENDER_BENCH_FRAMES * 99 / 100] / 1e6,
+           program->layoutCache->hits - hits, program->layoutCache->misses - misses);
+  }
+  program->pangoOnly = FALSE;
+  // Written after a frame starting from the top of the sheet, so runs can be diffed against each other
+  if (pngPrefix) {
+    sheet->selectedRow = 0;
+    sheet->scrollRow = 0;
+    sheet->scrollRowPixels = 0;
+    sheet->structureChanged = TRUE;
+    render(program, sheet);
+    char *path = malloc(strlen(pngPrefix) + strlen(name) + 6);
+    sprintf(path, "%s-%s.png", pngPrefix, name);
+    if (cairo_surface_write_to_png(program->surface, path) != CAIRO_STATUS_SUCCESS)
+      printf("couldn't write %s\n", path);
+    free(path);
+  }
+}
 
-    cairo_restore(program.cr);
+// Renders small, large and text heavy sheets into a 1920x1080 image surface, without a window or X server, and prints
+// frames per second and the median and 99th percentile frame times. With pngPrefix, a frame of each sheet is saved as
+// pngPrefix-small.png etc. for comparing by eye.
+void benchRender(char *pngPrefix) {
+  Program program = {0};
+  program.font = pango_font_description_from_string("Liberation Mono 20");
+  // The same colours main allocates from the X server
+  program.foreground.red = 0x1d1d;
+  program.foreground.green = 0x3b3b;
+  program.foreground.blue = 0x5353;
+  program.background.green = 0x1515;
+  program.background.blue = 0x2626;
+  program.highlight.green = 0x2515;
+  program.highlight.blue = 0x3626;
+  program.text.red = ((double)0xd6d6 / (double)0xffff);
+  program.text.green = ((double)0xdede / (double)0xffff);
+  program.text.blue = ((double)0xebeb / (double)0xffff);
+  program.text.alpha = 1.0;
+  program.layoutCache = layoutCacheNew();
+  program.headerLabels = headerLabelsNew();
+  program.asciiGlyphs = asciiGlyphsNew();
+  program.lastTextInserted = gapBufferNew(64);
+  program.windowWidth = 1920;
+  program.windowHeight = 1080;
+
+  printf("sheet\tmode\twidth\theight\tframes\tfps\tp50Ms\tp99Ms\tlayoutHits\tlayoutMisses\n");
+  char text[64];
+
+  Sheet small = newSheet(10, 5);
+  for (int row = 0; row < small.rowCount; row++) {
+    for (int column = 0; column < small.columnCount; column++) {
+      String string = {text, snprintf(text, sizeof(text), "%d", row * 10 + column)};
+      sheetCommitCell(&small, row, column, string);
+    }
   }
-  for (int row = 0; row < sheet.rowCount; row++) {
-    cairo_save(program.cr);
+  benchRenderSheet(&program, "small", &small, pngPrefix);
 
-    String string = intToString(row + 1);
-    pango_layout_set_text(layout, string.value, string.length);
-    pango_layout_set_width(layout, TEMP_CELL_WIDTH * logicalRectPangoUnits.width + 2);
-    pango_layout_set_height(layout, TEMP_CELL_HEIGHT * logicalRectPangoUnits.height + 2);
-    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-    pango_layout_set_ellipsize(layout, PANGO_ELLIPSIZE_END);
-    pango_cairo_update_layout(program.cr, layout);
+  Sheet large = newSheet(100000, 50);
+  for (int row = 0; row < large.rowCount; row++) {
+    for (int column = 0; column < large.columnCount; column++) {
+      String string = {text, snprintf(text, sizeof(text), "%.2f", row * 1.5 + column)};
+      sheetCommitCell(&large, row, column, string);
+    }
+  }
+  benchRenderSheet(&program, "large", &large, pngPrefix);
+
+  // Long text that wraps over every line of its cell and gets ellipsized
+  Sheet textHeavy = newSheet(1000, 20);
+  for (int row = 0; row < textHeavy.rowCount; row++) {
+    for (int column = 0; column < textHeavy.columnCount; column++) {
+      String string = {text, snprintf(text, sizeof(text), "row %d column %d the quick brown fox jumps over the lazy dog", row, column)};
+      sheetCommitCell(&textHeavy, row, column, string);
+    }
+  }
+  benchRenderSheet(&program, "text", &textHeavy, pngPrefix);
+}
 
-    int x = xoffset + sheet.horizontalPadding - rowNumberColumnWidth;
-    int y = yoffset + row * TEMP_CELL_HEIGHT * textScaledHeightPixels + 2 * row * sheet.verticalPadding + sheet.verticalPadding;
-    cairo_translate(program.cr, x, y);
-    cairo_scale(program.cr, textScale, textScale);
-    cairo_set_source_rgba(program.cr, program.text.red, program.text.green, program.text.blue, program.text.alpha);
 
-    pango_cairo_show_layout(program.cr, layout);
 
-    cairo_restore(program.cr);
-  }
+//******************************************//
+//               Main                       //
+//******************************************//
 
-  /*
-  pango_font_description_free(desc);
-  g_object_unref(layout);
-  cairo_destroy(program.cr);
-  */
+#define FRAME_INTERVAL_NS (1000000000 / 60) // Frames are rendered at most this often
+#define WHEEL_SCROLL_PIXELS 8 // Per click of the mouse wheel
 
+// Pressing T or sending SIGUSR1 writes the spans traced so far here, see Trace
+#define TRACE_PATH "trace.json"
 
+// The handler can't do much safely, so it just wakes the event loop up to dump the trace
+int traceSignalPipe[2];
 
-  // Draw the Rows and Columns
-  XSetForeground(program.display, program.gc, program.foreground.pixel);
-  XDrawLine(program.display, program.window, program.gc, winAttribs.x, winAttribs.y + yoffset, winAttribs.x + winAttribs.width, winAttribs.y + yoffset);
-  for (int i = 0; i < sheet.rowCount; i++) {
-    int y = winAttribs.y + yoffset + cellHeight;
-    int x1 = winAttribs.x;
-    int x2 = winAttribs.x + winAttribs.width;
-    XDrawLine(program.display, program.window, program.gc, x1, y, x2, y);
-    yoffset += cellHeight;
-  }
+void handleTraceSignal(int number) {
+  char byte = 0;
+  write(traceSignalPipe[1], &byte, 1);
+}
 
-  XDrawLine(program.display, program.window, program.gc, winAttribs.x + xoffset, winAttribs.y, winAttribs.x + xoffset, winAttribs.y + winAttribs.height);
-  for (int i = 0; i < sheet.columnCount; i++) {
-    int x = winAttribs.x + xoffset + cellWidth;
-    int y1 = winAttribs.y;
-    int y2 = winAttribs.y + winAttribs.height;
-    XDrawLine(program.display, program.window, program.gc, x, y1, x , y2);
-    xoffset += cellWidth;
-  }
+// Xlib exits the program once this returns, so it's the last chance to get the journal onto the disk
+Journal *ioErrorJournal = NULL;
 
-  // XFlush(program.display);
+int handleIOError(Display *display) {
+  printf("lost the connection to the X server\n");
+  if (ioErrorJournal)
+    journalClose(ioErrorJournal);
+  return 0;
 }
 
+int main(int argc, char **argv) {
+  laneKernelSelect();
+  int threadCount = 0;
+  int historyMegabytes = 64;
+  Boolean useShm = FALSE;
+  char *csvPath = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (stringsEqual("--threads", 9, argv[i]) && i + 1 < argc)
+      threadCount = atoi(argv[++i]);
+    else if (stringsEqual("--history-mb", 12, argv[i]) && i + 1 < argc)
+      historyMegabytes = atoi(argv[++i]);
+    else if (stringsEqual("--shm", 5, argv[i]))
+      useShm = TRUE;
+    else if (argv[i][0] != '-')
+      csvPath = argv[i];
+  }
+  if (threadCount <= 0)
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+  // Needs pango and cairo, so it lives here rather than with the benchmarks in bench.c
+  if (argc > 1 && stringsEqual("--bench-render", 14, argv[1])) {
+    benchRender(csvPath);
+    return 0;
+  }
 
 
-//******************************************//
-//               Main                       //
-//******************************************//
+  traceEnabled = TRUE;
+  pipe(traceSignalPipe);
+  signal(SIGUSR1, handleTraceSignal);
 
-int main() {
   Display* display = XOpenDisplay(NULL);
   int screen_number = XDefaultScreen(display);
   Window root = XRootWindow(display, screen_number);
@@ -598,7 +1191,9 @@ int main() {
   Window window = XCreateWindow(display, root, 0, 0, 100, 100, 10, XDefaultDepth(display, screen_number), CopyFromParent, CopyFromParent, valueMask, &windowAttributes);
   */
   Window window = XCreateSimpleWindow(display, XDefaultRootWindow(display), 0, 0, 100, 100, 0, 0, UINT32_MAX);
-  XSelectInput(display, window, KeyPressMask | KeyReleaseMask | ButtonPressMask | ExposureMask);
+  XSelectInput(display, window, KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask | Button1MotionMask | ExposureMask | StructureNotifyMask);
+  // Frames are copied in from the back buffer, so stop the server clearing the window to white first
+  XSetWindowBackgroundPixmap(display, window, None);
 
   /*
 
@@ -678,132 +1273,323 @@ int main() {
   }
   */
 
-  Sheet sheet = newSheet(3, 3);
-  sheetCellAppend(sheet, 0, "helyo", 5);
-  sheetCellAppend(sheet, 10, "helyo", 5);
-  sheetCellAppend(sheet, 20, "helyo", 5);
-  sheetCellAppend(sheet, 21, "helyo", 5);
-  sheet.selectedCell = 11;
-
-  Screen *screen = XScreenOfDisplay(display, screen_number);
-  int width = XWidthOfScreen(screen);
-  int height = XHeightOfScreen(screen);
-  cairo_surface_t *surface = cairo_xlib_surface_create(display, window, XDefaultVisual(display, screen_number), width, height);
-  cairo_t *cr = cairo_create(surface);
+  Sheet sheet;
+  CsvImport import = {0};
+  // Without a file the workbook w saves to is opened if there is one, the example sheet is only for a first run
+  char *workbookPath = csvPath ? csvPath : "sheet.spc";
+  if (workbookIsFile(workbookPath)) {
+    if (!workbookOpen(&sheet, workbookPath)) {
+      printf("couldn't open %s\n", workbookPath);
+      return 1;
+    }
+  }
+  else if (csvPath) {
+    sheet = newSheet(1, 1);
+    if (!csvImportStart(&import, &sheet, csvPath, threadCount))
+      printf("couldn't open %s\n", csvPath);
+    // Saving an imported CSV file writes a workbook next to it rather than over it
+    sheet.path = malloc(strlen(csvPath) + 5);
+    sprintf(sheet.path, "%s.spc", csvPath);
+  }
+  else {
+    sheet = newSheet(3, 3);
+    sheetCellAppend(&sheet, 0, 0, "helyo", 5);
+    sheetCellAppend(&sheet, 1, 1, "helyo", 5);
+    sheetCellAppend(&sheet, 2, 2, "helyo", 5);
+    sheetCellAppend(&sheet, 2, 1, "helyo", 5);
+    sheet.selectedRow = 1;
+    sheet.selectedColumn = 2;
+    sheet.path = "sheet.spc";
+  }
+  sheet.formulas.threadCount = threadCount;
+  // An import's edits can only be replayed once the import is done, and only after that is there anything to undo
+  Journal journal = {0};
+  ioErrorJournal = &journal;
+  XSetIOErrorHandler(handleIOError);
+  History history = historyNew((size_t)historyMegabytes * 1024 * 1024);
+  if (!import.active) {
+    journalOpen(&journal, &sheet);
+    sheet.history = &history;
+  }
 
   PangoFontDescription *desc = pango_font_description_from_string("Liberation Mono 20");
 
   Program program = {0};
   program.display = display;
   program.window = window;
+  program.windowWidth = 100; // Until the first ConfigureNotify says what the window manager made of it
+  program.windowHeight = 100;
+  program.visual = XDefaultVisual(display, screen_number);
+  program.depth = XDefaultDepth(display, screen_number);
   program.gc = gc;
-  program.surface = surface;
-  program.cr = cr;
+  if (useShm && !XShmQueryExtension(display))
+    printf("back buffer: the X server doesn't have MIT-SHM, drawing into a pixmap instead\n");
+  else if (useShm) {
+    program.useShm = TRUE;
+    program.shmCompletionEvent = XShmGetEventBase(display) + ShmCompletion;
+  }
   program.font = desc;
   program.background = background;
   program.highlight = highlight;
   program.foreground = foreground;
   program.text = text;
+  program.layoutCache = layoutCacheNew();
+  program.headerLabels = headerLabelsNew();
+  program.asciiGlyphs = asciiGlyphsNew();
+  program.lastTextInserted = gapBufferNew(64);
 
+  // Input is handled in batches: everything queued is applied, then one frame is rendered for the lot, at most once every
+  // FRAME_INTERVAL_NS. So a held down key or pasted text doesn't queue up frames nobody gets to see.
   XEvent event = {0};
+  Boolean needsRender = FALSE;
+  int64_t lastRenderTime = 0;
+  int exposeX1 = INT_MAX, exposeY1 = INT_MAX, exposeX2 = 0, exposeY2 = 0;
   while (TRUE) {
-    XNextEvent(display, &event);
-
-    switch (event.type) {
-      case Expose: {
-        render(program, sheet);
-        break;
-
-        /*
-        XTextItem textItem = {0};
-        textItem.chars = "hi";
-        textItem.nchars = 2;
-        XFontStruct *fontStruct = XLoadQueryFont(display, "r14");
-        if (!fontStruct) {
-          printf("error");
-          return 1;
+    // Wait on the X connection, SIGUSR1 and, while importing, the importer so rows show as they arrive.
+    // poll skips the importer's entry once it's done since its fd is -1. With a frame to render, only wait until it's due.
+    if (!XPending(display)) {
+      int timeout = -1;
+      if (needsRender && !program.shmPending)
+        timeout = clamp((lastRenderTime + FRAME_INTERVAL_NS - nowNanoseconds()) / 1000000, 0, INT_MAX);
+      struct pollfd fds[3] = {{ConnectionNumber(display), POLLIN, 0}, {traceSignalPipe[0], POLLIN, 0}, {import.active ? import.wakePipe[0] : -1, POLLIN, 0}};
+      poll(fds, 3, timeout);
+      if (fds[1].revents & POLLIN) {
+        char byte;
+        read(traceSignalPipe[0], &byte, 1);
+        traceDump(TRACE_PATH);
+        layoutCachePrintStats(program.layoutCache);
+      }
+      if (fds[2].revents & POLLIN) {
+        int64_t traceStart = traceBegin();
+        Boolean merged = csvImportPoll(&import, &sheet);
+        traceEnd("csvImportPoll", traceStart);
+        if (merged) {
+          if (!import.active) {
+            journalOpen(&journal, &sheet);
+            sheet.history = &history;
+          }
+          if (program.cr) {
+            sheet.structureChanged = TRUE;
+            needsRender = TRUE;
+          }
         }
-        XSetFont(display, gc, fontStruct->fid);
-        XDrawString(display, window, gc, 800, 500, "Text", 4);
+      }
+    }
 
+    // Drain the queue, but not for longer than a frame so a flood of input still shows up as it goes
+    int64_t batchStart = nowNanoseconds();
+    while (XPending(display) && nowNanoseconds() - batchStart < FRAME_INTERVAL_NS) {
+      XNextEvent(display, &event);
+
+      int64_t traceStart = traceBegin();
+      if (program.shmImage && event.type == program.shmCompletionEvent)
+        program.shmPending--;
+      switch (event.type) {
+        case Expose: {
+          // The back buffer still holds the last frame so exposed areas can just be copied back, once the last
+          // Expose of the series (count 0) says how much was exposed altogether
+          exposeX1 = event.xexpose.x < exposeX1 ? event.xexpose.x : exposeX1;
+          exposeY1 = event.xexpose.y < exposeY1 ? event.xexpose.y : exposeY1;
+          exposeX2 = event.xexpose.x + event.xexpose.width > exposeX2 ? event.xexpose.x + event.xexpose.width : exposeX2;
+          exposeY2 = event.xexpose.y + event.xexpose.height > exposeY2 ? event.xexpose.y + event.xexpose.height : exposeY2;
+          if (event.xexpose.count > 0)
+            break;
+          if (program.cr)
+            presentBackBuffer(&program, exposeX1, exposeY1, exposeX2 - exposeX1, exposeY2 - exposeY1);
+          else
+            needsRender = TRUE;
+          exposeX1 = exposeY1 = INT_MAX;
+          exposeX2 = exposeY2 = 0;
+
+          /*
+          XTextItem textItem = {0};
+          textItem.chars = "hi";
+          textItem.nchars = 2;
+          XFontStruct *fontStruct = XLoadQueryFont(display, "r14");
+          if (!fontStruct) {
+            printf("error");
+            return 1;
+          }
+          XSetFont(display, gc, fontStruct->fid);
+          XDrawString(display, window, gc, 800, 500, "Text", 4);
 
 
-        PangoGlyphString *glyphString = pango_glyph_string_new();
-        char *text = "hi";
-        for (int i = 0; text[i] != 0; i++) {
-          PangoGlyphInfo gi = {0};
-          gi.glyph = text[i];
-          glyphString->glyphs[i] = gi;
-        }
-        PangoRenderer pangoRenderer = {0};
-        pango_renderer_draw_glyphs(pangoRenderer, PangoFont *font, glyphString, 10, 10);
-        */
 
-      }
-      case KeyPress: {
-        KeySym keysym = XLookupKeysym(&event.xkey, 0);
-        char *keyPressed = XKeysymToString(keysym);
-        if (!keyPressed)
+          PangoGlyphString *glyphString = pango_glyph_string_new();
+          char *text = "hi";
+          for (int i = 0; text[i] != 0; i++) {
+            PangoGlyphInfo gi = {0};
+            gi.glyph = text[i];
+            glyphString->glyphs[i] = gi;
+          }
+          PangoRenderer pangoRenderer = {0};
+          pango_renderer_draw_glyphs(pangoRenderer, PangoFont *font, glyphString, 10, 10);
+          */
           break;
-
-        if (stringsEqual("Shift_L", 7, keyPressed)) {
-          program.shiftDown = TRUE;
         }
-
-        if (sheet.insertMode == TRUE && !IsModifierKey(keysym) && !IsFunctionKey(keysym)) {
-          if (stringsEqual("Escape", 6, keyPressed)) {
-            sheet.insertMode = FALSE;
+        case KeyPress: {
+          KeySym keysym = XLookupKeysym(&event.xkey, 0);
+          char *keyPressed = XKeysymToString(keysym);
+          if (!keyPressed)
             break;
+          needsRender = TRUE;
+
+          if (stringsEqual("Shift_L", 7, keyPressed)) {
+            program.shiftDown = TRUE;
           }
-          else if (stringsEqual("space", 5, keyPressed)) {
-            sheetCellAppend(sheet, sheet.selectedCell, " ", 1);
-          }
-          else if (stringsEqual("Return", 6, keyPressed)) {
-            sheetCellAppend(sheet, sheet.selectedCell, "\n", 1);
+          if (stringsEqual("Control_L", 9, keyPressed) || stringsEqual("Control_R", 9, keyPressed)) {
+            program.controlDown = TRUE;
           }
-          else if (stringsEqual("BackSpace", 9, keyPressed)) {
-            sheetCellBackSpace(sheet, sheet.selectedCell, sheet.strings.data[sheet.selectedCell].length - 1);
+
+          if (sheet.insertMode == TRUE && !IsModifierKey(keysym) && !IsFunctionKey(keysym)) {
+            if (stringsEqual("Escape", 6, keyPressed)) {
+              sheetEndEdit(&sheet);
+              sheet.insertMode = FALSE;
+              break;
+            }
+            else if (stringsEqual("space", 5, keyPressed)) {
+              sheetCellAppend(&sheet, sheet.selectedRow, sheet.selectedColumn, " ", 1);
+            }
+            else if (stringsEqual("Return", 6, keyPressed)) {
+              sheetCellAppend(&sheet, sheet.selectedRow, sheet.selectedColumn, "\n", 1);
+            }
+            else if (stringsEqual("BackSpace", 9, keyPressed)) {
+              sheetCellBackSpace(&sheet, sheet.selectedRow, sheet.selectedColumn, sheetGetCell(&sheet, sheet.selectedRow, sheet.selectedColumn).length - 1);
+            }
+            else {
+              char valueToInsert = *keyPressed;
+              if (program.shiftDown) {
+                valueToInsert = keyToUpper(*keyPressed);
+              }
+              int valueToInsertLength = 1;
+              sheetCellAppend(&sheet, sheet.selectedRow, sheet.selectedColumn, &valueToInsert, valueToInsertLength);
+              gapBufferInsert(&program.lastTextInserted, gapBufferLength(&program.lastTextInserted), &valueToInsert, 1);
+            }
           }
           else {
-            char valueToInsert = *keyPressed;
+            char charKeyPressed = keyPressedToChar(keyPressed);
             if (program.shiftDown) {
-              valueToInsert = keyToUpper(*keyPressed);
+              charKeyPressed = keyToUpper(charKeyPressed);
+            }
+            if (program.controlDown) {
+              charKeyPressed = KEY_CONTROL(charKeyPressed);
+            }
+            // Entering insert mode starts recording the text that '.' will insert
+            if (charKeyPressed == 'i')
+              gapBufferClear(&program.lastTextInserted);
+            if (charKeyPressed == 'T') {
+              traceDump(TRACE_PATH);
+              layoutCachePrintStats(program.layoutCache);
+              break;
             }
-            int valueToInsertLength = 1;
-            sheetCellAppend(sheet, sheet.selectedCell, &valueToInsert, valueToInsertLength);
-            program.lastTextInserted = stringInsertChar(program.lastTextInserted, valueToInsert, program.lastTextInserted.length);
+            int64_t inputStart = traceBegin();
+            program.lastCharKeyPressed = handleNormalModeInput(&sheet, charKeyPressed, FALSE, program.lastCharKeyPressed, gapBufferContents(&program.lastTextInserted));
+            traceEnd("handleNormalModeInput", inputStart);
           }
+          break;
         }
-        else {
-          char charKeyPressed = keyPressedToChar(keyPressed);
-          if (program.shiftDown) {
-            charKeyPressed = keyToUpper(charKeyPressed);
+        case ConfigureNotify: {
+          if (event.xconfigure.width != program.windowWidth || event.xconfigure.height != program.windowHeight) {
+            program.windowWidth = event.xconfigure.width;
+            program.windowHeight = event.xconfigure.height;
+            needsRender = TRUE;
           }
-          String placeholder = {0};
-          program.lastCharKeyPressed = handleNormalModeInput(&sheet, charKeyPressed, FALSE, program.lastCharKeyPressed, program.lastTextInserted);
+          break;
         }
-        render(program, sheet);
-        break;
-      }
-      case KeyRelease: {
-        KeySym keysym = XLookupKeysym(&event.xkey, 0);
-        char *keyReleased = XKeysymToString(keysym);
-        if (!keyReleased)
+        case KeyRelease: {
+          KeySym keysym = XLookupKeysym(&event.xkey, 0);
+          char *keyReleased = XKeysymToString(keysym);
+          if (!keyReleased)
+            break;
+          if (stringsEqual("Shift_L", 7, keyReleased)) {
+            program.shiftDown = FALSE;
+          }
+          if (stringsEqual("Control_L", 9, keyReleased) || stringsEqual("Control_R", 9, keyReleased)) {
+            program.controlDown = FALSE;
+          }
           break;
-        if (stringsEqual("Shift_L", 7, keyReleased)) {
-          program.shiftDown = FALSE;
         }
-        break;
-      }
-      case ButtonPress: {
-        if (event.xbutton.button == Button1) {
-          printf("Button1 press\n");
+        case ButtonPress: {
+          // The wheel scrolls up and down, or left and right with shift held or on a tilting wheel. Trackpads send lots
+          // of these for a swipe, so each is only a few pixels. Nothing scrolls while a cell is being edited.
+          unsigned int button = event.xbutton.button;
+          if (button == Button4 || button == Button5 || button == 6 || button == 7) {
+            if (sheet.insertMode)
+              break;
+            int step = button == Button4 || button == 6 ? -WHEEL_SCROLL_PIXELS : WHEEL_SCROLL_PIXELS;
+            if (button == 6 || button == 7 || (event.xbutton.state & ShiftMask))
+              program.wheelX += step;
+            else
+              program.wheelY += step;
+            break;
+          }
+          // Clicking a cell selects it and starts a range that dragging stretches out. Clicks on the headers, or before
+          // anything has been drawn, are ignored.
+          Frame *frame = &program.lastFrame;
+          if (event.xbutton.button != Button1 || !frame->textScaledHeightPixels || event.xbutton.x < frame->xoffset || event.xbutton.y < frame->yoffset)
+            break;
+          if (sheet.insertMode) {
+            sheetEndEdit(&sheet);
+            sheet.insertMode = FALSE;
+          }
+          frameCellAt(frame, &sheet, event.xbutton.x, event.xbutton.y, &sheet.selectedRow, &sheet.selectedColumn);
+          sheet.anchorRow = sheet.selectedRow;
+          sheet.anchorColumn = sheet.selectedColumn;
+          program.dragging = TRUE;
+          needsRender = TRUE;
+          break;
+        }
+        case MotionNotify: {
+          if (program.dragging) {
+            program.dragX = event.xmotion.x;
+            program.dragY = event.xmotion.y;
+            program.dragMoved = TRUE;
+          }
+          break;
+        }
+        case ButtonRelease: {
+          if (event.xbutton.button == Button1)
+            program.dragging = FALSE;
+          break;
         }
-        break;
       }
+      traceEnd(event.type == Expose ? "Expose" : event.type == KeyPress ? "KeyPress" : "event", traceStart);
     }
-  }
 
+    // However many motion events came in, the range is only stretched to where the pointer ended up
+    if (program.dragMoved) {
+      int row, column;
+      frameCellAt(&program.lastFrame, &sheet, program.dragX, program.dragY, &row, &column);
+      if (row != sheet.selectedRow || column != sheet.selectedColumn) {
+        sheet.selectedRow = row;
+        sheet.selectedColumn = column;
+        needsRender = TRUE;
+      }
+      program.dragMoved = FALSE;
+    }
+    if (program.wheelX || program.wheelY) {
+      Frame *frame = &program.lastFrame;
+      if (frame->textScaledHeightPixels) {
+        sheetScrollByPixels(&sheet, program.wheelX, program.wheelY, frame->width - frame->xoffset, frame->height - frame->yoffset, frame->textScaledWidthPixels, frame->textScaledHeightPixels);
+        needsRender = TRUE;
+      }
+      program.wheelX = 0;
+      program.wheelY = 0;
+    }
+
+    // The shared memory back buffer can't be drawn into while the server is still reading the last frame out of it
+    if (needsRender && !program.shmPending && nowNanoseconds() - lastRenderTime >= FRAME_INTERVAL_NS) {
+      render(&program, &sheet);
+      lastRenderTime = nowNanoseconds();
+      needsRender = FALSE;
+      // An opened workbook's formulas are compiled once the first screen is up
+      if (sheet.unloadedFormulaCount) {
+        workbookLoadFormulas(&sheet);
+        needsRender = TRUE;
+      }
+    }
+    journalFlush(sheet.journal);
+  }
   return 0;
 }
 
@@ -813,7 +1599,6 @@ int main() {
 // make the renderer render things relative to a point so that a cells text, extents, etc are all 'stuck' together
 // make i insert before text and a insert after text
 // Support keyToUpper for non alphabet characters such as $
-// Support scrolling
 // '.' doesnt work for certain input operations, i think my string handling is broken
 //
 // Done:
@@ -827,6 +1612,7 @@ int main() {
 // support uppercase character insertion and uppercase key actions
 // Add line numbers and column characters
 // Make '.' repeat the last command
+// Support scrolling (the viewport follows the selection and only visible cells are drawn)
 //
 //
 // Requirements: